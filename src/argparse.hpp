@@ -291,9 +291,9 @@ public:
         }
         else
         {
-            if (arglength == optlength + 4)
+            if (arglength == optlength + 5)
             {
-                if (strncmp("--no-", argv[0], 4) == 0 && strcmp(optLong(), &argv[0][4]) == 0)
+                if (strncmp("--no-", argv[0], 5) == 0 && strcmp(optLong(), &argv[0][5]) == 0)
                 {
                     m_val = false;
                     found();
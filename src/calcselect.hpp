@@ -19,6 +19,124 @@
 
 #include "config.h"
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+class HapMap;
+struct IhsScore;
+struct XPEHH;
+
+/**
+ * Options controlling how a run is carried out which do not affect the calculated statistics.
+ */
+struct RunOptions
+{
+    RunOptions() : progressInterval(10.0), checkpointInterval(600.0), resume(false), partial(false), shard(0), numShards(0), rangeStart(0ULL), rangeEnd(0ULL), chunkSize(0), batchSize(65536), partitionLoad(false), halo(1000), sharedMemory(true), progressThread(true), distributed(false), binaryOutput(false), genomeWide(false), permutations(0), seed(1), withIhs(false), nsl(false), rsb(false) {}
+    double progressInterval;
+    std::string metricsFile;
+    std::string traceFile;
+    std::string checkpointFile;
+    double checkpointInterval;
+    bool resume;
+    /**
+     * Only calculate a slice of the loci and write the unstandardized results to the output file in the
+     * checkpoint format instead of the final table. The slice is shard #shard of #numShards if #numShards
+     * is set, or [#rangeStart, #rangeEnd) otherwise, with a #rangeEnd of 0 meaning the last locus.
+     */
+    bool partial;
+    int shard;
+    int numShards;
+    unsigned long long rangeStart;
+    unsigned long long rangeEnd;
+    /**
+     * Partial results to combine, standardize and write instead of calculating anything.
+     */
+    std::vector<std::string> mergeFiles;
+    /**
+     * Number of loci MPI ranks take from the shared counter at a time. 0 picks a size giving each rank about
+     * 16 chunks.
+     */
+    std::size_t chunkSize;
+    /**
+     * Largest number of loci whose results an MPI rank sends to rank 0 in one message. 0 sends each chunk
+     * in a single message.
+     */
+    std::size_t batchSize;
+    /**
+     * Have each MPI rank calculate a fixed slice of the loci and load only the rows it needs: the slice plus
+     * a halo of --max-extend bp or, without it, #halo rows, doubled whenever a walk reaches its edge.
+     */
+    bool partitionLoad;
+    std::size_t halo;
+    /**
+     * Have the MPI ranks on a node share one read-only copy of the haplotypes and positions instead of
+     * each loading its own. Not used with #partitionLoad.
+     */
+    bool sharedMemory;
+    /**
+     * Have MPI rank 0 handle the results of other ranks on a progress thread, so that its OpenMP team keeps
+     * calculating. Needs MPI_THREAD_MULTIPLE.
+     */
+    bool progressThread;
+    /**
+     * Keep the results of each MPI rank where they were calculated. The ranks standardize their own loci
+     * with bin moments merged over all ranks and write their rows of the output in place, so rank 0 never
+     * holds every score. Cannot be combined with checkpoints.
+     */
+    bool distributed;
+    /**
+     * Write the results as a columnar binary file (see columns.hpp) instead of a tab separated table.
+     */
+    bool binaryOutput;
+    /**
+     * In a batch of chromosomes, standardize every locus with the frequency bins of all chromosomes instead
+     * of those of its own chromosome.
+     */
+    bool genomeWide;
+    /**
+     * Number of random relabellings of the two XP-EHH populations to score at every locus for an empirical
+     * p-value, drawn from #seed. 0 disables them.
+     */
+    std::size_t permutations;
+    unsigned long long seed;
+    /**
+     * Also calculate the iHS of each XP-EHH population from the same walk.
+     */
+    bool withIhs;
+    /**
+     * Also calculate and standardize nSL from the iHS walks.
+     */
+    bool nsl;
+    /**
+     * Also calculate and standardize Rsb from the XP-EHH walk.
+     */
+    bool rsb;
+
+    void range(std::size_t numSnps, std::size_t& start, std::size_t& end) const;
+};
+
+/**
+ * Split #num loci into #numParts contiguous parts and return the bounds of part #part. The last part takes
+ * the remainder. Used both for MPI ranks and for --shard so that the two agree.
+ */
+inline void splitRange(std::size_t num, int part, int numParts, std::size_t& start, std::size_t& end)
+{
+    std::size_t perPart = num/numParts;
+    start = perPart*part;
+    end = (part == numParts-1) ? num : perPart*(part+1);
+}
+
+inline void RunOptions::range(std::size_t numSnps, std::size_t& start, std::size_t& end) const
+{
+    if (numShards > 0)
+    {
+        splitRange(numSnps, shard, numShards, start, end);
+        return;
+    }
+    start = std::min<std::size_t>(rangeStart, numSnps);
+    end = (rangeEnd == 0ULL) ? numSnps : std::min<std::size_t>(rangeEnd, numSnps);
+}
 
 void calcIhsNoMpi(
     const std::string& hap,
@@ -29,7 +147,40 @@ void calcIhsNoMpi(
     double scale,
     unsigned long long maxExtend,
     int bins,
-    bool binom);
+    bool binom,
+    const RunOptions& options = RunOptions());
+
+/**
+ * Calculate iHS with every combination of #cutoffs, #maxExtends and #binoms from one walk per locus, in this
+ * process. The results with cutoff C, maximum extension E and binomial EHH are written to #outfile.cC-eE-binom,
+ * and those with frequency squared EHH to #outfile.cC-eE.
+ */
+void calcIhsSweep(
+    const std::string& hap,
+    const std::string& map,
+    const std::string& outfile,
+    const std::vector<double>& cutoffs,
+    const std::vector<unsigned long long>& maxExtends,
+    const std::vector<bool>& binoms,
+    double minMAF,
+    double scale,
+    int bins,
+    const RunOptions& options = RunOptions());
+
+/**
+ * Calculate iHS for every chromosome listed in #manifest, one "hap map out" line each, in this process. The
+ * next chromosome is loaded while the current one is calculated. With more than one chromosome, the progress
+ * metrics of the i-th, counting from 1, are written to the metrics file with the suffix .i.
+ */
+void calcIhsBatch(
+    const std::string& manifest,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    int bins,
+    bool binom,
+    const RunOptions& options = RunOptions());
 
 void calcIhsMpi(
     const std::string& hapfile,
@@ -40,7 +191,8 @@ void calcIhsMpi(
     double scale,
     unsigned long long maxExtend,
     int binFactor,
-    bool binom);
+    bool binom,
+    const RunOptions& options = RunOptions());
 
 void calcXpehhNoMpi(
     const std::string& hapA,
@@ -52,7 +204,42 @@ void calcXpehhNoMpi(
     double scale,
     unsigned long long maxExtend,
     int bins,
-    bool binom);
+    bool binom,
+    const RunOptions& options = RunOptions());
+
+/**
+ * Calculate XP-EHH for every pair of the populations listed in #populations, one "name hap" line each, in
+ * this process, with one walk per locus over all of them. Pair (A, B) is written to #outfile.A-B, and with
+ * options.withIhs the iHS of population A to #outfile.iHS-A.
+ */
+void calcXpehhPairs(
+    const std::string& populations,
+    const std::string& map,
+    const std::string& outfile,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    int bins,
+    bool binom,
+    const RunOptions& options = RunOptions());
+
+/**
+ * Calculate XP-EHH of #hapA and #hapB into #outfile and the iHS of each population into #outfile.iHS-A and
+ * #outfile.iHS-B, all from one walk per locus in this process.
+ */
+void calcXpehhWithIhs(
+    const std::string& hapA,
+    const std::string& hapB,
+    const std::string& map,
+    const std::string& outfile,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    int bins,
+    bool binom,
+    const RunOptions& options = RunOptions());
 
 void calcXpehhMpi(
     const std::string& hapA,
@@ -64,16 +251,49 @@ void calcXpehhMpi(
     double scale,
     unsigned long long maxExtend,
     int binFactor,
-    bool binom);
+    bool binom,
+    const RunOptions& options = RunOptions());
+
+/**
+ * Write the standardized iHS results #res and their unstandardized scores #unStd to #outfile, as a table
+ * or, if #binary is set, as columns. If #stdNsl is given, the nSL columns and standardized nSL are added.
+ */
+bool writeIhsResults(
+    const std::string& outfile,
+    const HapMap& hm,
+    const std::map<std::size_t, double>& res,
+    const std::map<std::size_t, IhsScore>& unStd,
+    bool binary,
+    const std::map<std::size_t, double>* stdNsl = nullptr);
+
+/**
+ * Write the XP-EHH results #unStd and their standardized scores #standardized to #outfile, as a table or,
+ * if #binary is set, as columns. #numChromosomes is the number of chromosomes in both populations. With
+ * #pValues, the permutation p-values are written too, and if #stdRsb is given, the site EHH integrals, Rsb
+ * and standardized Rsb, which is NaN for loci without one.
+ */
+bool writeXpehhResults(
+    const std::string& outfile,
+    const HapMap& hA,
+    std::size_t numChromosomes,
+    const std::map<std::size_t, XPEHH>& unStd,
+    const std::map<std::size_t, double>& standardized,
+    bool binary,
+    bool pValues = false,
+    const std::map<std::size_t, double>* stdRsb = nullptr);
 
 #if MPI_FOUND
 class ParameterStream;
-struct IhsScore;
-struct XPEHH;
+struct IhsBlock;
+struct XpehhBlock;
 ParameterStream& operator<<(ParameterStream& out, const IhsScore& info);
 ParameterStream& operator>>(ParameterStream& in, IhsScore& info);
 ParameterStream& operator<<(ParameterStream& out, const XPEHH& info);
 ParameterStream& operator>>(ParameterStream& in, XPEHH& info);
+ParameterStream& operator<<(ParameterStream& out, const IhsBlock& block);
+ParameterStream& operator>>(ParameterStream& in, IhsBlock& block);
+ParameterStream& operator<<(ParameterStream& out, const XpehhBlock& block);
+ParameterStream& operator>>(ParameterStream& in, XpehhBlock& block);
 
 #define calcIhs calcIhsMpi
 #define calcXpehh calcXpehhMpi
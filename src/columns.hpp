@@ -0,0 +1,168 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef COLUMNS_HPP
+#define COLUMNS_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Binary columnar output, written by ihsbin and xpehhbin with --binary-out. This header only depends on
+ * the standard library and POSIX so that other tools can include it on its own to read the files.
+ *
+ * A file is a ColumnFileHeader, followed by one ColumnInfo per column, followed by the columns. Every column
+ * holds numRows values of 8 bytes in the byte order of the machine that wrote it, starting at a multiple
+ * of 64 bytes from the start of the file. Rows are in increasing order of the "Index" column.
+ */
+
+struct ColumnFileHeader
+{
+    uint64_t magic;
+    uint64_t version;
+    uint64_t numRows;
+    uint64_t numColumns;
+};
+
+struct ColumnInfo
+{
+    enum Type : uint32_t { UInt64 = 1, Float64 = 2 };
+    char name[48];
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+static const uint64_t columnFileMagic = 0x314C4F4342504148ULL; // "HAPBCOL1"
+static const uint64_t columnFileVersion = 1;
+static const std::size_t columnAlignment = 64;
+
+template<typename T> struct ColumnType;
+template<> struct ColumnType<uint64_t> { static const uint32_t value = ColumnInfo::UInt64; };
+template<> struct ColumnType<double> { static const uint32_t value = ColumnInfo::Float64; };
+
+/**
+ * Read-only view of a columnar output file. The file is memory mapped, so opening it is cheap and only the
+ * pages of the columns and rows actually used are read.
+ */
+class ColumnFile
+{
+public:
+    ColumnFile() : m_data(nullptr), m_size(0) {}
+    ColumnFile(const ColumnFile&) = delete;
+    ColumnFile& operator=(const ColumnFile&) = delete;
+    ~ColumnFile() { close(); }
+
+    bool open(const char* filename)
+    {
+        close();
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (std::size_t) st.st_size < sizeof(ColumnFileHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        m_data = static_cast<const char*>(p);
+        m_size = st.st_size;
+        if (!valid())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (m_data)
+            munmap(const_cast<char*>(m_data), m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    std::size_t numRows() const { return header()->numRows; }
+    std::size_t numColumns() const { return header()->numColumns; }
+    const ColumnInfo& info(std::size_t column) const { return columns()[column]; }
+
+    /**
+     * The values of the column called #name, or nullptr if there is no such column of type T.
+     */
+    template<typename T>
+    const T* column(const char* name) const
+    {
+        for (std::size_t i = 0; i < numColumns(); ++i)
+        {
+            const ColumnInfo& c = columns()[i];
+            if (std::strncmp(c.name, name, sizeof(c.name)) == 0)
+                return (c.type == ColumnType<T>::value) ? reinterpret_cast<const T*>(m_data + c.offset) : nullptr;
+        }
+        return nullptr;
+    }
+
+    /**
+     * The first row whose value in the sorted column #name is not less than #value, for region queries on
+     * "Index" or "Position". Returns numRows() if there is none or no such column.
+     */
+    std::size_t lowerBound(const char* name, uint64_t value) const
+    {
+        const uint64_t* c = column<uint64_t>(name);
+        if (!c)
+            return numRows();
+        return std::lower_bound(c, c + numRows(), value) - c;
+    }
+
+protected:
+    const ColumnFileHeader* header() const { return reinterpret_cast<const ColumnFileHeader*>(m_data); }
+    const ColumnInfo* columns() const { return reinterpret_cast<const ColumnInfo*>(m_data + sizeof(ColumnFileHeader)); }
+
+    bool valid() const
+    {
+        const ColumnFileHeader* h = header();
+        if (h->magic != columnFileMagic || h->version != columnFileVersion)
+            return false;
+        if (sizeof(ColumnFileHeader) + h->numColumns*sizeof(ColumnInfo) > m_size)
+            return false;
+        for (std::size_t i = 0; i < h->numColumns; ++i)
+        {
+            const ColumnInfo& c = columns()[i];
+            if (c.offset % columnAlignment != 0 || c.offset > m_size || h->numRows*8 > m_size - c.offset)
+                return false;
+        }
+        return true;
+    }
+
+    const char* m_data;
+    std::size_t m_size;
+};
+
+#endif // COLUMNS_HPP
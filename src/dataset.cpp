@@ -0,0 +1,131 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dataset.hpp"
+#include "ehhfinder.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+
+bool Dataset::open(const std::vector<std::string>& haps, const std::string& map)
+{
+    m_maps.clear();
+    for (const std::string& hap : haps)
+    {
+        std::unique_ptr<HapMap> hm(new HapMap());
+        if (!hm->loadHap(hap.c_str()))
+        {
+            m_maps.clear();
+            return false;
+        }
+        if (!m_maps.empty() && hm->numSnps() != m_maps[0]->numSnps())
+        {
+            std::cerr << "ERROR: " << hap << " has " << hm->numSnps() << " loci but " << m_maps[0]->numSnps() << " were expected." << std::endl;
+            m_maps.clear();
+            return false;
+        }
+        // Ids are looked up in the first population only.
+        hm->loadMap(map.c_str(), m_maps.empty());
+        m_maps.push_back(std::move(hm));
+    }
+    return !m_maps.empty();
+}
+
+std::size_t Dataset::runIhs(std::size_t pop, std::size_t start, std::size_t end, const IhsCallback& callback, bool curves)
+{
+    HapMap* hm = m_maps[pop].get();
+    end = std::min(end, hm->numSnps());
+    const Parameters p = m_parameters;
+    std::mutex callbackMutex;
+    std::size_t count = 0;
+    #pragma omp parallel shared(hm, callback, callbackMutex, count)
+    {
+        EHHFinder finder(hm->snpDataSize(), 0, 2000, p.cutoff, p.minMAF, p.scale, p.maxExtend);
+        IhsLocus locus;
+        #pragma omp for schedule(dynamic,10)
+        for (std::size_t i = start; i < end; ++i)
+        {
+            std::atomic<unsigned long long> reachedEnd{};
+            std::atomic<unsigned long long> outsideMaf{};
+            locus = IhsLocus();
+            locus.line = i;
+            if (p.binom)
+                locus.ehh = finder.find<true>(hm, i, &reachedEnd, &outsideMaf, curves);
+            else
+                locus.ehh = finder.find<false>(hm, i, &reachedEnd, &outsideMaf, curves);
+            if (outsideMaf > 0)
+                locus.status = OutsideMaf;
+            else if (reachedEnd > 0)
+                locus.status = ReachedEnd;
+            // The same loci as IHSFinder::processEHH() keeps.
+            else if (locus.ehh.iHH_0 <= 0.0 || locus.ehh.iHH_1 <= 0.0)
+                locus.status = Undefined;
+            else
+            {
+                locus.iHS = log(locus.ehh.iHH_0/locus.ehh.iHH_1);
+                locus.nSL = log(locus.ehh.SL_0/locus.ehh.SL_1);
+            }
+            std::lock_guard<std::mutex> lock(callbackMutex);
+            callback(locus);
+            ++count;
+        }
+    }
+    return count;
+}
+
+std::size_t Dataset::runXpehh(std::size_t popA, std::size_t popB, std::size_t start, std::size_t end, const XpehhCallback& callback)
+{
+    HapMap* hmA = m_maps[popA].get();
+    HapMap* hmB = m_maps[popB].get();
+    end = std::min(end, hmA->numSnps());
+    const Parameters p = m_parameters;
+    std::mutex callbackMutex;
+    std::size_t count = 0;
+    #pragma omp parallel shared(hmA, hmB, callback, callbackMutex, count)
+    {
+        EHHFinder finder(hmA->snpDataSize(), hmB->snpDataSize(), 2000, p.cutoff, p.minMAF, p.scale, p.maxExtend);
+        XpehhLocus locus;
+        #pragma omp for schedule(dynamic,10)
+        for (std::size_t i = start; i < end; ++i)
+        {
+            std::atomic<unsigned long long> reachedEnd{};
+            locus = XpehhLocus();
+            locus.line = i;
+            if (p.binom)
+                locus.xpehh = finder.findXPEHH<true>(hmA, hmB, i, &reachedEnd);
+            else
+                locus.xpehh = finder.findXPEHH<false>(hmA, hmB, i, &reachedEnd);
+            // findXPEHH() returns an empty result without counting it for the first and last two loci.
+            if (reachedEnd > 0 || i <= 1 || i >= hmA->numSnps()-2)
+                locus.status = ReachedEnd;
+            else if (locus.xpehh.numA + locus.xpehh.numNotA == 0)
+                locus.status = OutsideMaf;
+            // The same loci as IHSFinder::processXPEHH() keeps without Rsb.
+            else if (locus.xpehh.iHH_A1 == 0.0 || locus.xpehh.iHH_B1 == 0.0)
+                locus.status = Undefined;
+            else
+                locus.xpehh.xpehh = log(locus.xpehh.iHH_A1/locus.xpehh.iHH_B1);
+            std::lock_guard<std::mutex> lock(callbackMutex);
+            callback(locus);
+            ++count;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,148 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DATASET_HPP
+#define DATASET_HPP
+
+#include "hapmap.hpp"
+#include "ehh.hpp"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Entry point for programs embedding hapbin. A Dataset holds one or more populations with the same loci and
+ * streams the unstandardized per locus results of a range of loci to a callback as they are calculated,
+ * without writing any files. Standardizing needs the results of every locus, so it is left to the caller,
+ * or to IHSFinder for whole chromosomes.
+ *
+ *     Dataset data;
+ *     if (!data.open({"pop.hapbin"}, "chr.map"))
+ *         return 1;
+ *     data.runIhs(0, 0, data.numSnps(), [](const Dataset::IhsLocus& locus) { ... });
+ */
+class Dataset
+{
+public:
+    struct Parameters
+    {
+        Parameters() : cutoff(0.05), minMAF(0.05), scale(20000.0), maxExtend(0ULL), binom(false) {}
+        double cutoff;
+        double minMAF;
+        /**
+         * Gap scale parameter in bp, as ihsbin --scale.
+         */
+        double scale;
+        /**
+         * Maximum distance in bp to walk from a locus, 0 for none.
+         */
+        unsigned long long maxExtend;
+        bool binom;
+    };
+
+    enum Status
+    {
+        Calculated,
+        /**
+         * The allele frequency at the locus is outside the minimum allele frequency range.
+         */
+        OutsideMaf,
+        /**
+         * The walk reached the end of the chromosome before EHH dropped below the cutoff.
+         */
+        ReachedEnd,
+        /**
+         * The walk finished but the statistic is infinite or NaN because an iHH is 0. ihsbin and xpehhbin leave
+         * these loci out.
+         */
+        Undefined
+    };
+
+    /**
+     * iHS is log(iHH_0/iHH_1) and nSL log(SL_0/SL_1). Only #line and #status are set for loci outside the MAF
+     * range or reaching the end, and #iHS and #nSL are only set for calculated loci.
+     */
+    struct IhsLocus
+    {
+        IhsLocus() : line(0), status(Calculated), iHS(0.0), nSL(0.0) {}
+        std::size_t line;
+        Status status;
+        EHH ehh;
+        double iHS;
+        double nSL;
+    };
+
+    /**
+     * xpehh.xpehh is log(iHH_A1/iHH_B1), and only set for calculated loci.
+     */
+    struct XpehhLocus
+    {
+        XpehhLocus() : line(0), status(Calculated) {}
+        std::size_t line;
+        Status status;
+        XPEHH xpehh;
+    };
+
+    using IhsCallback = std::function<void(const IhsLocus&)>;
+    using XpehhCallback = std::function<void(const XpehhLocus&)>;
+
+    /**
+     * Load the populations in #haps, which must all have the same loci, and the positions and ids of the
+     * loci from #map. Fails if a file cannot be read.
+     */
+    bool open(const std::vector<std::string>& haps, const std::string& map);
+
+    void setParameters(const Parameters& parameters) { m_parameters = parameters; }
+    const Parameters& parameters() const { return m_parameters; }
+
+    std::size_t numPopulations() const { return m_maps.size(); }
+    std::size_t numSnps() const { return m_maps.empty() ? 0 : m_maps[0]->numSnps(); }
+    /**
+     * The loaded data of population #pop, for its positions, ids and sizes.
+     */
+    const HapMap& hapMap(std::size_t pop) const { return *m_maps[pop]; }
+    /**
+     * The haplotypes of population #pop at locus #line, one bit per haplotype in HapMap::snpDataSize()
+     * words. This points into the loaded data, which stays valid as long as the Dataset.
+     */
+    const HapMap::PrimitiveType* row(std::size_t pop, std::size_t line) const { return m_maps[pop]->row(line); }
+    /**
+     * Line of the locus with the id #id, or std::numeric_limits<std::size_t>::max() if there is none.
+     */
+    std::size_t line(const std::string& id) const { return m_maps[0]->idToLine(id); }
+
+    /**
+     * Calculate iHS of population #pop for the loci [start, end) in parallel and pass each locus to #callback
+     * as soon as it is done, in the order the loci complete. Calls to #callback are serialized, so it need
+     * not be thread safe, but the calculations wait for it. With #curves, IhsLocus::ehh also holds the EHH
+     * of every row of the walk. Returns the number of loci passed to #callback.
+     */
+    std::size_t runIhs(std::size_t pop, std::size_t start, std::size_t end, const IhsCallback& callback, bool curves = false);
+    /**
+     * Calculate XP-EHH of populations #popA and #popB for the loci [start, end) in the same way.
+     */
+    std::size_t runXpehh(std::size_t popA, std::size_t popB, std::size_t start, std::size_t end, const XpehhCallback& callback);
+
+protected:
+    std::vector<std::unique_ptr<HapMap>> m_maps;
+    Parameters m_parameters;
+};
+
+#endif // DATASET_HPP
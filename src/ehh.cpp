@@ -0,0 +1,149 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ehh.hpp"
+#include "hapmap.hpp"
+#include "ehhfinder.hpp"
+#include "output.hpp"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+bool calcEhhLoci(
+    const std::string& hap,
+    const std::string& map,
+    const std::string& loci,
+    const std::string& outfile,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    bool binom,
+    bool binary)
+{
+    HapMap hm;
+    if (!hm.loadHap(hap.c_str()))
+        return false;
+    hm.loadMap(map.c_str());
+
+    std::ifstream file(loci);
+    if (!file.good())
+    {
+        std::cerr << "ERROR: Could not open loci file: " << loci << std::endl;
+        return false;
+    }
+    std::vector<std::size_t> lines;
+    std::unordered_map<std::string, std::size_t> index = hm.idIndex();
+    std::string id;
+    while (file >> id)
+    {
+        auto l = index.find(id);
+        if (l == index.end())
+        {
+            std::cerr << "WARNING: no locus with the id: " << id << std::endl;
+            continue;
+        }
+        lines.push_back(l->second);
+    }
+
+#ifdef _OPENMP
+    std::cout << "Threads: " << omp_get_max_threads() << std::endl;
+#endif
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<EHH> results(lines.size());
+    std::atomic<unsigned long long> reachedEnd{};
+    std::atomic<unsigned long long> outsideMaf{};
+    #pragma omp parallel shared(hm, lines, results, reachedEnd, outsideMaf)
+    {
+        EHHFinder finder(hm.snpDataSize(), 0, 1000, cutoff, minMAF, scale, maxExtend);
+        #pragma omp for schedule(dynamic,1)
+        for (std::size_t i = 0; i < lines.size(); ++i)
+        {
+            if (binom)
+                results[i] = finder.find<true>(&hm, lines[i], &reachedEnd, &outsideMaf, true);
+            else
+                results[i] = finder.find<false>(&hm, lines[i], &reachedEnd, &outsideMaf, true);
+        }
+    }
+    auto tend = std::chrono::high_resolution_clock::now();
+    std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(tend - start).count() << "ms" << std::endl;
+
+    // Loci which were not calculated have no rows. Repeated loci are only written once.
+    std::map<std::size_t, const EHH*> curves;
+    for (std::size_t i = 0; i < lines.size(); ++i)
+    {
+        if (!results[i].upstream.empty() || !results[i].downstream.empty())
+            curves.emplace(lines[i], &results[i]);
+    }
+
+    /*
+     * Each curve is written from its furthest upstream row to its furthest downstream row, with the core at
+     * EHH 1. EHH_1 is the EHH of the haplotypes carrying allele 1 at the core.
+     */
+    auto forEachRow = [&](const EHH& e, const std::function<void(std::size_t, double, double)>& row) {
+        for (std::size_t i = e.upstream.size(); i != 0; --i)
+            row(e.index-i, e.upstream[i-1].probsNot, e.upstream[i-1].probs);
+        row(e.index, 1.0, 1.0);
+        for (std::size_t i = 0; i < e.downstream.size(); ++i)
+            row(e.index+i+1, e.downstream[i].probsNot, e.downstream[i].probs);
+    };
+    bool ok;
+    if (!binary)
+    {
+        ok = writeRows(outfile, "Locus\tLocus ID\tIndex\tID\tGenetic Position\tPhysical Position\tEHH_0\tEHH_1\n", curves, [&](TextBlock& out, std::size_t focus, const EHH* e) {
+            forEachRow(*e, [&](std::size_t line, double ehh0, double ehh1) {
+                out << focus << '\t' << hm.lineToId(focus) << '\t' << line << '\t' << hm.lineToId(line) << '\t' << hm.geneticPosition(line)
+                    << '\t' << hm.physicalPosition(line) << '\t' << ehh0 << '\t' << ehh1 << '\n';
+            });
+        });
+    }
+    else
+    {
+        std::vector<uint64_t> locus, index, position;
+        std::vector<double> geneticPosition, ehh0s, ehh1s;
+        for (const auto& it : curves)
+        {
+            forEachRow(*it.second, [&](std::size_t line, double ehh0, double ehh1) {
+                locus.push_back(it.first);
+                index.push_back(line);
+                position.push_back(hm.physicalPosition(line));
+                geneticPosition.push_back(hm.geneticPosition(line));
+                ehh0s.push_back(ehh0);
+                ehh1s.push_back(ehh1);
+            });
+        }
+        ColumnTable table;
+        table.add("Locus", std::move(locus));
+        table.add("Index", std::move(index));
+        table.add("Position", std::move(position));
+        table.add("Genetic Position", std::move(geneticPosition));
+        table.add("EHH_0", std::move(ehh0s));
+        table.add("EHH_1", std::move(ehh1s));
+        ok = table.write(outfile);
+    }
+    std::cout << "# loci: " << curves.size() << std::endl;
+    std::cout << "# loci with MAF <= " << minMAF << ": " << outsideMaf << std::endl;
+    std::cout << "# loci which reached the end of the chromosome: " << reachedEnd << std::endl;
+    return ok;
+}
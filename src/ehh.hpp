@@ -45,6 +45,8 @@ struct EHH
         , numNot{}
         , iHH_0{}
         , iHH_1{}
+        , SL_0{}
+        , SL_1{}
         {}
     std::vector<HapStats> upstream;
     std::vector<HapStats> downstream;
@@ -56,6 +58,11 @@ struct EHH
 
     double iHH_0;
     double iHH_1;
+    /**
+     * The same integrals over the number of rows instead of the genetic distance, for nSL.
+     */
+    double SL_0;
+    double SL_1;
 
     ~EHH() {}
 
@@ -113,6 +120,10 @@ struct XPEHH
         , iHH_A1(0.0)
         , iHH_B1(0.0)
         , iHH_P1(0.0)
+        , pValue(1.0)
+        , iES_A(0.0)
+        , iES_B(0.0)
+        , rsb(0.0)
     {}
     std::size_t index;
 
@@ -126,16 +137,73 @@ struct XPEHH
     double iHH_A1;
     double iHH_B1;
     double iHH_P1;
+    /**
+     * Share of label permutations whose XP-EHH is at least as far from 0 as #xpehh, counting the observed
+     * labels as one of them. Only calculated when EHHFinder::setPermutations() was given permutations.
+     */
+    double pValue;
+    /**
+     * Integrated site EHH of each population and Rsb = ln(iES_A/iES_B). Only calculated when
+     * EHHFinder::setSiteEhh() is enabled; the integrals are 0 when either walk reached the end of the
+     * chromosome, and then #rsb is NaN.
+     */
+    double iES_A;
+    double iES_B;
+    double rsb;
+};
+
+/**
+ * Cost of the calculation for a single locus, collected when tracing is enabled.
+ */
+struct LocusTrace
+{
+    LocusTrace()
+        : index(0ULL)
+        , seconds(0.0)
+        , upstreamRows(0ULL)
+        , downstreamRows(0ULL)
+        , peakBranches(0ULL)
+        , reallocs(0ULL)
+    {}
+    std::size_t index;
+    double seconds;
+    std::size_t upstreamRows;
+    std::size_t downstreamRows;
+    std::size_t peakBranches;
+    std::size_t reallocs;
 };
 
 struct IhsScore
 {
-    IhsScore() : iHS(0.0), iHH_0(0.0), iHH_1(0.0), freq(0.0) {}
-    IhsScore(double s, double a, double d, double f) : iHS(s), iHH_0(a), iHH_1(d), freq(f) {}
+    IhsScore() : iHS(0.0), iHH_0(0.0), iHH_1(0.0), freq(0.0), nSL(0.0), SL_0(0.0), SL_1(0.0) {}
+    IhsScore(double s, double a, double d, double f) : iHS(s), iHH_0(a), iHH_1(d), freq(f), nSL(0.0), SL_0(0.0), SL_1(0.0) {}
     double iHS;
     double iHH_0;
     double iHH_1;
     double freq;
+    /**
+     * Only set when the IHSFinder was asked for nSL.
+     */
+    double nSL;
+    double SL_0;
+    double SL_1;
 };
 
+/**
+ * Calculate the EHH decay around every locus listed by id in #loci, in parallel, and write one row per locus and
+ * row of its walk to #outfile, as a table or, if #binary is set, as columns. Returns false if an input could
+ * not be read or the output could not be written.
+ */
+bool calcEhhLoci(
+    const std::string& hap,
+    const std::string& map,
+    const std::string& loci,
+    const std::string& outfile,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    bool binom,
+    bool binary);
+
 #endif // EHH_HPP
@@ -17,10 +17,10 @@
  *
  */
 
-template <bool Binom>
-void EHHFinder::calcBranch(HapMap* hm, HapMap::PrimitiveType* parent, std::size_t parentcount, HapMap::PrimitiveType* branch, std::size_t& branchcount, std::size_t currLine, double freq, double &probs, std::size_t& singlecount, std::size_t maxBreadth, bool* overflow)
+template <bool Freq, bool Binom>
+void EHHFinder::calcBranch(HapMap* hm, HapMap::PrimitiveType* parent, std::size_t parentcount, HapMap::PrimitiveType* branch, std::size_t& branchcount, std::size_t currLine, double freq, double freqBinom, double& probs, double& probsBinom, std::size_t& singlecount, std::size_t maxBreadth, bool* overflow)
 {
-    HapMap::PrimitiveType* mapData = hm->rawData();
+    const HapMap::PrimitiveType* row = hm->row(currLine);
     std::size_t snpDataSize = hm->snpDataSize();
     std::size_t snpDataSizeULL = hm->snpDataSizeULL();
     std::size_t bcnt = 0;
@@ -33,35 +33,33 @@ void EHHFinder::calcBranch(HapMap* hm, HapMap::PrimitiveType* parent, std::size_
             count += popcount1(leaf[j]);
         }
 
-        if (Binom && count <= 1)
-        {
-            continue;
-        }
-        if (!Binom && count == 0)
+        if (count == 0)
         {
             continue;
         }
-        else if (!Binom && count == 1)
+        else if (count == 1)
         {
-            ++singlecount;
+            // Binomial EHH leaves singles out, frequency squared EHH adds them back in find().
+            if (Freq)
+                ++singlecount;
             continue;
         }
         else
         {
-            if (Binom)
-                probs += binom_2(count)*freq;
-            else
+            if (Freq)
                 probs += (count*freq)*(count*freq);
+            if (Binom)
+                probsBinom += binom_2(count)*freqBinom;
             for(std::size_t j = 0; j < snpDataSize; ++j)
             {
-                branch[bcnt*snpDataSize+j] = parent[i*snpDataSize+j] & mapData[currLine*snpDataSize+j];
+                branch[bcnt*snpDataSize+j] = parent[i*snpDataSize+j] & row[j];
             }
             ++bcnt;
             for(std::size_t j = 0; j < snpDataSize-1; ++j)
             {
-                branch[bcnt*snpDataSize+j] = parent[i*snpDataSize+j] & ~mapData[currLine*snpDataSize+j];
+                branch[bcnt*snpDataSize+j] = parent[i*snpDataSize+j] & ~row[j];
             }
-            branch[bcnt*snpDataSize+snpDataSize-1] = (parent[i*snpDataSize+snpDataSize-1] & ~mapData[currLine*snpDataSize+snpDataSize-1]) & m_maskA;
+            branch[bcnt*snpDataSize+snpDataSize-1] = (parent[i*snpDataSize+snpDataSize-1] & ~row[snpDataSize-1]) & m_maskA;
             ++bcnt;
         }
         if (bcnt > maxBreadth-2)
@@ -77,6 +75,8 @@ template <bool Binom>
 inline void EHHFinder::calcBranchXPEHH(std::size_t currLine, std::size_t& singleA, std::size_t& singleB, std::size_t& singleP, bool* overflow)
 {
     std::size_t snpDataSize = m_snpDataSizeA + m_snpDataSizeB;
+    const HapMap::PrimitiveType* rowA = m_hmA->row(currLine);
+    const HapMap::PrimitiveType* rowB = m_hmB->row(currLine);
     std::size_t bcnt = 0;
     for(std::size_t i = 0; i < m_parent0count; ++i)
     {
@@ -106,6 +106,8 @@ inline void EHHFinder::calcBranchXPEHH(std::size_t currLine, std::size_t& single
             ++singleP;
             singleA+=countA;
             singleB+=countB;
+            for (std::size_t r = 0; r < m_numPerms; ++r)
+                m_permSingleStepA[r] += maskedCount(&m_parent0[i*snpDataSize], r);
             continue;
         }
         else
@@ -122,29 +124,44 @@ inline void EHHFinder::calcBranchXPEHH(std::size_t currLine, std::size_t& single
                 m_ehhB += (countB*m_freqB)*(countB*m_freqB);
                 m_ehhP += (count*m_freqP)*(count*m_freqP);
             }
+            for (std::size_t r = 0; r < m_numPerms; ++r)
+            {
+                int permA = maskedCount(&m_parent0[i*snpDataSize], r);
+                int permB = count - permA;
+                if (Binom)
+                {
+                    m_permEhhA[r] += binom_2(permA)*m_freqA;
+                    m_permEhhB[r] += binom_2(permB)*m_freqB;
+                }
+                else
+                {
+                    m_permEhhA[r] += (permA*m_freqA)*(permA*m_freqA);
+                    m_permEhhB[r] += (permB*m_freqB)*(permB*m_freqB);
+                }
+            }
             //A part of the 1 branch
             for(std::size_t j = 0; j < m_snpDataSizeA; ++j)
             {
-                m_branch0[bcnt*snpDataSize+j] = m_parent0[i*snpDataSize+j] & m_hdA[currLine*m_snpDataSizeA+j];
+                m_branch0[bcnt*snpDataSize+j] = m_parent0[i*snpDataSize+j] & rowA[j];
             }
             //B part of the 1 branch
             for(std::size_t j = 0; j < m_snpDataSizeB; ++j)
             {
-                m_branch0[bcnt*snpDataSize+m_snpDataSizeA+j] = m_parent0[i*snpDataSize+m_snpDataSizeA+j] & m_hdB[currLine*m_snpDataSizeB+j];
+                m_branch0[bcnt*snpDataSize+m_snpDataSizeA+j] = m_parent0[i*snpDataSize+m_snpDataSizeA+j] & rowB[j];
             }
             ++bcnt;
             //A part of the 0 branch
             for(std::size_t j = 0; j < m_snpDataSizeA-1; ++j)
             {
-                m_branch0[bcnt*snpDataSize+j] = m_parent0[i*snpDataSize+j] & ~m_hdA[currLine*m_snpDataSizeA+j];
+                m_branch0[bcnt*snpDataSize+j] = m_parent0[i*snpDataSize+j] & ~rowA[j];
             }
-            m_branch0[bcnt*snpDataSize+m_snpDataSizeA-1] = (m_parent0[i*snpDataSize+m_snpDataSizeA-1] & ~m_hdA[(currLine+1)*m_snpDataSizeA-1]) & m_maskA;
+            m_branch0[bcnt*snpDataSize+m_snpDataSizeA-1] = (m_parent0[i*snpDataSize+m_snpDataSizeA-1] & ~rowA[m_snpDataSizeA-1]) & m_maskA;
             //B part of the 0 branch
             for(std::size_t j = 0; j < m_snpDataSizeB-1; ++j)
             {
-                m_branch0[bcnt*snpDataSize+m_snpDataSizeA+j] = m_parent0[i*snpDataSize+m_snpDataSizeA+j] & ~m_hdB[currLine*m_snpDataSizeB+j];
+                m_branch0[bcnt*snpDataSize+m_snpDataSizeA+j] = m_parent0[i*snpDataSize+m_snpDataSizeA+j] & ~rowB[j];
             }
-            m_branch0[(bcnt+1)*snpDataSize-1] = (m_parent0[(i+1)*snpDataSize-1] & ~m_hdB[(currLine+1)*m_snpDataSizeB-1]) & m_maskB;
+            m_branch0[(bcnt+1)*snpDataSize-1] = (m_parent0[(i+1)*snpDataSize-1] & ~rowB[m_snpDataSizeB-1]) & m_maskB;
             ++bcnt;
         }
         if (bcnt > m_maxBreadth0-2)
@@ -174,6 +191,9 @@ void EHHFinder::calcBranchesXPEHH(std::size_t currLine)
         m_ehhA = 0.0;
         m_ehhB = 0.0;
         m_ehhP = 0.0;
+        std::fill(m_permEhhA.begin(), m_permEhhA.end(), 0.0);
+        std::fill(m_permEhhB.begin(), m_permEhhB.end(), 0.0);
+        std::fill(m_permSingleStepA.begin(), m_permSingleStepA.end(), 0);
         m_branch0count = 0;
         calcBranchXPEHH<Binom>(currLine, singleA, singleB, singleP, &overflow);
         if (overflow)
@@ -182,9 +202,9 @@ void EHHFinder::calcBranchesXPEHH(std::size_t currLine)
             aligned_free(m_branch0);
             m_branch0 = reinterpret_cast<HapMap::PrimitiveType*>(aligned_alloc(128, (m_snpDataSizeA+m_snpDataSizeB)*m_maxBreadth0*sizeof(HapMap::PrimitiveType)));
             realloced0 = true;
-            continue;
+            ++m_trace.reallocs;
         }
-    } while (false);
+    } while (overflow);
     if (realloced0)
     {
         aligned_free(m_parent0);
@@ -195,23 +215,27 @@ void EHHFinder::calcBranchesXPEHH(std::size_t currLine)
         m_single0count += singleA;
         m_single1count += singleB;
         m_singlePcount += singleP;
+        for (std::size_t r = 0; r < m_numPerms; ++r)
+            m_permSingleA[r] += m_permSingleStepA[r];
     }
     m_parent0count = m_branch0count;
     m_branch0count = 0ULL;
     std::swap(m_parent0, m_branch0);
+    m_trace.peakBranches = std::max(m_trace.peakBranches, m_parent0count);
 }
 
 template <bool Binom>
 XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::atomic<unsigned long long>* reachedEnd)
 {
+    m_trace = LocusTrace();
+    m_trace.index = focus;
+    m_windowEdge = false;
     if (focus <= 1 || focus >= hmA->numSnps()-2)
         return XPEHH();
     m_hmA = hmA;
     m_hmB = hmB;
-    m_hdA = hmA->rawData();
     m_snpDataSizeA = hmA->snpDataSize();
     m_snpDataSizeULL_A = hmA->snpDataSizeULL();
-    m_hdB = hmB->rawData();
     m_snpDataSizeB = hmB->snpDataSize();
     m_snpDataSizeULL_B = hmB->snpDataSizeULL();
 #if VEC==4
@@ -239,14 +263,14 @@ XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::ato
     ret.index = focus;
     for(std::size_t i = 0; i < m_snpDataSizeA; ++i)
     {
-        ret.numA += POPCOUNT(m_hdA[focus*m_snpDataSizeA+i]);
+        ret.numA += POPCOUNT(m_hmA->row(focus)[i]);
     }
     ret.numNotA = hmA->snpLength() - ret.numA;
     for(std::size_t i = 0; i < m_snpDataSizeB; ++i)
     {
-        ret.numB += POPCOUNT(m_hdB[focus*m_snpDataSizeB+i]);
+        ret.numB += POPCOUNT(m_hmB->row(focus)[i]);
     }
-    ret.numNotB = hmA->snpLength() - ret.numB;
+    ret.numNotB = hmB->snpLength() - ret.numB;
     double maxEHH_A = ret.numA/(double)hmA->snpLength();
     double maxEHH_B = ret.numB/(double)hmB->snpLength();
     bool mafAInRange = (maxEHH_A <= 1.0 - m_minMAF && maxEHH_A >= m_minMAF);
@@ -290,7 +314,30 @@ XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::ato
         m_single1count = 0ULL;
         m_singlePcount = 0ULL;
     }
+    std::vector<double> permLastA, permLastB, permIhhA(m_numPerms), permIhhB(m_numPerms);
+
+    /*
+     * With setSiteEhh(), the site EHH of each population is integrated until it drops below the cutoff itself,
+     * which may be before or after the pooled EHH ends the XP-EHH integrals, so the walk goes on while any of
+     * them is active. Returns whether either site EHH is.
+     */
+    bool xpehhActive = true, siteA = m_siteEhh, siteB = m_siteEhh, siteEnd = false;
+    double lastSiteA = lastEhhA, lastSiteB = lastEhhB;
+    auto siteStep = [&](double gap, double scale) {
+        if (siteA && m_ehhA <= m_cutoff - 1e-15)
+            siteA = false;
+        if (siteB && m_ehhB <= m_cutoff - 1e-15)
+            siteB = false;
+        if (siteA)
+            ret.iES_A += gap*(lastSiteA + m_ehhA)*scale*0.5;
+        if (siteB)
+            ret.iES_B += gap*(lastSiteB + m_ehhB)*scale*0.5;
+        lastSiteA = m_ehhA;
+        lastSiteB = m_ehhB;
+        return siteA || siteB;
+    };
     setInitialXPEHH(focus);
+    setInitialPermutations<Binom>(focus, ret, permLastA, permLastB);
     calcBranchesXPEHH<Binom>(focus-1);
     if (focus > 1)
     {
@@ -302,24 +349,41 @@ XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::ato
                 scale=1;
 
             calcBranchesXPEHH<Binom>(currLine);
+            ++m_trace.upstreamRows;
 
             if (!Binom)
             {
                 m_ehhA += probASingle*m_single0count;
                 m_ehhB += probBSingle*m_single1count;
                 m_ehhP += probPSingle*(m_single0count+m_single1count);
+                for (std::size_t r = 0; r < m_numPerms; ++r)
+                {
+                    m_permEhhA[r] += probASingle*m_permSingleA[r];
+                    m_permEhhB[r] += probBSingle*(m_single0count+m_single1count-m_permSingleA[r]);
+                }
             }
 
             if (m_ehhP <= m_cutoff - 1e-15)
+                xpehhActive = false;
+            if (!siteStep(hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1), scale) && !xpehhActive)
                 break;
+            if (xpehhActive)
+            {
+                ret.iHH_A1 += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(lastEhhA + m_ehhA)*scale*0.5;
+                ret.iHH_B1 += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(lastEhhB + m_ehhB)*scale*0.5;
+                ret.iHH_P1 += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(lastEhhP + m_ehhP)*scale*0.5;
 
-            ret.iHH_A1 += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(lastEhhA + m_ehhA)*scale*0.5;
-            ret.iHH_B1 += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(lastEhhB + m_ehhB)*scale*0.5;
-            ret.iHH_P1 += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(lastEhhP + m_ehhP)*scale*0.5;
-
-            lastEhhA = m_ehhA;
-            lastEhhB = m_ehhB;
-            lastEhhP = m_ehhP;
+                lastEhhA = m_ehhA;
+                lastEhhB = m_ehhB;
+                lastEhhP = m_ehhP;
+                for (std::size_t r = 0; r < m_numPerms; ++r)
+                {
+                    permIhhA[r] += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(permLastA[r] + m_permEhhA[r])*scale*0.5;
+                    permIhhB[r] += (hmA->geneticPosition(currLine+2)-hmA->geneticPosition(currLine+1))*(permLastB[r] + m_permEhhB[r])*scale*0.5;
+                    permLastA[r] = m_permEhhA[r];
+                    permLastB[r] = m_permEhhB[r];
+                }
+            }
 
             if (m_maxExtend != 0 && locusPysPos - currPhysPos > m_maxExtend)
                 break;
@@ -327,11 +391,21 @@ XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::ato
                 break;
             if (!Binom && (m_single0count+m_single1count) == (hmA->snpLength()+hmB->snpLength()))
                 break;
-            if(currLine == 0)
+            if (currLine == hmA->firstLine() && currLine != 0)
+            {
+                m_windowEdge = true;
+                return XPEHH();
+            }
+            if (currLine == 0 && xpehhActive)
             {
                 ++(*reachedEnd);
                 return XPEHH();
             }
+            if (currLine == 0)
+            {
+                siteEnd = true;
+                break;
+            }
         }
     }
 
@@ -352,10 +426,15 @@ XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::ato
         m_single0count = 0ULL;
         m_single1count = 0ULL;
     }
+    xpehhActive = true;
+    siteA = siteB = m_siteEhh;
+    lastSiteA = lastEhhA;
+    lastSiteB = lastEhhB;
 
     setInitialXPEHH(focus);
+    setInitialPermutations<Binom>(focus, ret, permLastA, permLastB);
     calcBranchesXPEHH<Binom>(focus+1);
-    for (std::size_t currLine = focus + 2; currLine < hmA->numSnps(); ++currLine)
+    for (std::size_t currLine = focus + 2; currLine < hmA->endLine(); ++currLine)
     {
         unsigned long long currPhysPos = hmA->physicalPosition(currLine-1);
         double scale = (double)(m_scale) / (double)(currPhysPos - hmA->physicalPosition(currLine-2));
@@ -363,24 +442,41 @@ XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::ato
             scale=1;
 
         calcBranchesXPEHH<Binom>(currLine);
+        ++m_trace.downstreamRows;
 
         if (!Binom)
         {
             m_ehhA += probASingle*m_single0count;
             m_ehhB += probBSingle*m_single1count;
             m_ehhP += probPSingle*(m_single0count+m_single1count);
+            for (std::size_t r = 0; r < m_numPerms; ++r)
+            {
+                m_permEhhA[r] += probASingle*m_permSingleA[r];
+                m_permEhhB[r] += probBSingle*(m_single0count+m_single1count-m_permSingleA[r]);
+            }
         }
 
         if (m_ehhP <= m_cutoff - 1e-15)
+            xpehhActive = false;
+        if (!siteStep(hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2), scale) && !xpehhActive)
             break;
+        if (xpehhActive)
+        {
+            ret.iHH_A1 += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(lastEhhA + m_ehhA)*scale*0.5;
+            ret.iHH_B1 += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(lastEhhB + m_ehhB)*scale*0.5;
+            ret.iHH_P1 += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(lastEhhP + m_ehhP)*scale*0.5;
 
-        ret.iHH_A1 += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(lastEhhA + m_ehhA)*scale*0.5;
-        ret.iHH_B1 += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(lastEhhB + m_ehhB)*scale*0.5;
-        ret.iHH_P1 += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(lastEhhP + m_ehhP)*scale*0.5;
-
-        lastEhhA = m_ehhA;
-        lastEhhB = m_ehhB;
-        lastEhhP = m_ehhP;
+            lastEhhA = m_ehhA;
+            lastEhhB = m_ehhB;
+            lastEhhP = m_ehhP;
+            for (std::size_t r = 0; r < m_numPerms; ++r)
+            {
+                permIhhA[r] += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(permLastA[r] + m_permEhhA[r])*scale*0.5;
+                permIhhB[r] += (hmA->geneticPosition(currLine-1)-hmA->geneticPosition(currLine-2))*(permLastB[r] + m_permEhhB[r])*scale*0.5;
+                permLastA[r] = m_permEhhA[r];
+                permLastB[r] = m_permEhhB[r];
+            }
+        }
 
         if (m_maxExtend != 0 && currPhysPos - locusPysPos > m_maxExtend)
             break;
@@ -388,17 +484,522 @@ XPEHH EHHFinder::findXPEHH(HapMap* hmA, HapMap* hmB, std::size_t focus, std::ato
             break;
         if (Binom && m_ehhP == 0)
             break;
-        if (currLine == hmA->numSnps()-1)
+        if (currLine == hmA->endLine()-1 && currLine != hmA->numSnps()-1)
+        {
+            m_windowEdge = true;
+            return XPEHH();
+        }
+        if (currLine == hmA->numSnps()-1 && xpehhActive)
         {
             ++(*reachedEnd);
             return XPEHH();
         }
+        if (currLine == hmA->numSnps()-1)
+        {
+            siteEnd = true;
+            break;
+        }
+    }
+    if (siteEnd)
+    {
+        // A site EHH which reaches the end of the chromosome gives no Rsb, while XP-EHH is kept.
+        ret.iES_A = 0.0;
+        ret.iES_B = 0.0;
+    }
+    if (m_numPerms > 0)
+    {
+        double observed = std::fabs(std::log(ret.iHH_A1/ret.iHH_B1));
+        std::size_t extreme = 0;
+        for (std::size_t r = 0; r < m_numPerms; ++r)
+        {
+            if (std::fabs(std::log(permIhhA[r]/permIhhB[r])) >= observed)
+                ++extreme;
+        }
+        ret.pValue = (extreme + 1.0)/(m_numPerms + 1.0);
     }
     return ret;
 }
 
 template <bool Binom>
-void EHHFinder::calcBranches(HapMap* hapmap, std::size_t focus, std::size_t currLine, double freq0,  double freq1, HapStats &stats)
+void EHHFinder::setInitialPermutations(std::size_t focus, const XPEHH& observed, std::vector<double>& lastEhhA, std::vector<double>& lastEhhB)
+{
+    std::size_t lengthA = m_hmA->snpLength(), lengthB = m_hmB->snpLength();
+    lastEhhA.resize(m_numPerms);
+    lastEhhB.resize(m_numPerms);
+    for (std::size_t r = 0; r < m_numPerms; ++r)
+    {
+        // The second initial branch holds the haplotypes with the derived allele.
+        int numA = maskedCount(&m_parent0[m_snpDataSizeA+m_snpDataSizeB], r);
+        int numB = observed.numA + observed.numB - numA;
+        if (Binom)
+        {
+            lastEhhA[r] = (binom_2(numA)+binom_2(lengthA-numA))*m_freqA;
+            lastEhhB[r] = (binom_2(numB)+binom_2(lengthB-numB))*m_freqB;
+        }
+        else
+        {
+            double f = numA*m_freqA;
+            lastEhhA[r] = f*f+(1.0-f)*(1.0-f);
+            f = numB*m_freqB;
+            lastEhhB[r] = f*f+(1.0-f)*(1.0-f);
+        }
+        m_permSingleA[r] = 0;
+    }
+}
+
+template <bool Binom>
+inline void EHHFinder::calcBranchXPEHHPairs(std::size_t currLine, bool* overflow)
+{
+    std::size_t snpDataSize = m_popOffsets.back();
+    std::size_t numPops = m_pops.size();
+    bool ihs = !m_ihsEhh.empty();
+    std::size_t bcnt = 0;
+    for (std::size_t i = 0; i < m_parent0count; ++i)
+    {
+        HapMap::PrimitiveType* parent = &m_parent0[i*snpDataSize];
+        char cls = ihs ? m_parentClass[i] : 0;
+        int total = 0;
+        for (std::size_t k = 0; k < numPops; ++k)
+        {
+            int count = 0;
+            unsigned long long *leaf = (unsigned long long*) &parent[m_popOffsets[k]];
+            for (std::size_t j = 0; j < m_pops[k]->snpDataSizeULL(); ++j)
+            {
+                count += popcount1(leaf[j]);
+            }
+            m_popCounts[k] = count;
+            total += count;
+        }
+
+        if (total == 0 || (Binom && total == 1))
+        {
+            continue;
+        }
+        else if (total == 1)
+        {
+            for (std::size_t k = 0; k < numPops; ++k)
+            {
+                m_popSinglesStep[k] += m_popCounts[k];
+                if (ihs)
+                    m_ihsSinglesStep[2*k+cls] += m_popCounts[k];
+            }
+            continue;
+        }
+        /*
+         * A branch is only dropped once it holds a single haplotype of all the populations. Until then, a pair
+         * with one haplotype left in it adds the same 1/n^2 that the two population walk adds for a single.
+         */
+        for (std::size_t k = 0; k < numPops; ++k)
+        {
+            int count = m_popCounts[k];
+            if (Binom)
+                m_popEhh[k] += binom_2(count)*m_popFreq[k];
+            else
+                m_popEhh[k] += (count*m_popFreq[k])*(count*m_popFreq[k]);
+            if (!ihs)
+                continue;
+            // One haplotype of the population adds the same as a single of find(), and none adds nothing.
+            double freq = m_ihsFreq[2*k+cls];
+            if (count >= 2)
+                m_ihsSplit[k] = 1;
+            if (Binom && count >= 2)
+                m_ihsEhh[2*k+cls] += binom_2(count)*freq;
+            else if (!Binom && count > 0)
+                m_ihsEhh[2*k+cls] += (count*freq)*(count*freq);
+        }
+        for (std::size_t p = 0; p < m_pairEhh.size(); ++p)
+        {
+            int count = m_popCounts[m_pairA[p]] + m_popCounts[m_pairB[p]];
+            if (count >= 2)
+                m_pairSplit[p] = 1;
+            if (Binom)
+                m_pairEhh[p] += binom_2(count)*m_pairFreq[p];
+            else
+                m_pairEhh[p] += (count*m_pairFreq[p])*(count*m_pairFreq[p]);
+        }
+
+        for (std::size_t k = 0; k < numPops; ++k)
+        {
+            std::size_t size = m_pops[k]->snpDataSize();
+            const HapMap::PrimitiveType* line = m_pops[k]->row(currLine);
+            HapMap::PrimitiveType* branch1 = &m_branch0[bcnt*snpDataSize+m_popOffsets[k]];
+            HapMap::PrimitiveType* branch0 = &m_branch0[(bcnt+1)*snpDataSize+m_popOffsets[k]];
+            for (std::size_t j = 0; j < size; ++j)
+            {
+                branch1[j] = parent[m_popOffsets[k]+j] & line[j];
+                branch0[j] = parent[m_popOffsets[k]+j] & ~line[j];
+            }
+        }
+        if (ihs)
+        {
+            m_branchClass[bcnt] = cls;
+            m_branchClass[bcnt+1] = cls;
+        }
+        bcnt += 2;
+        if (bcnt > m_maxBreadth0-2)
+        {
+            *overflow = true;
+            return;
+        }
+    }
+    m_branch0count = bcnt;
+}
+
+template <bool Binom>
+void EHHFinder::calcBranchesXPEHHPairs(std::size_t currLine)
+{
+    bool overflow;
+    bool realloced0 = false;
+    do
+    {
+        overflow = false;
+        std::fill(m_popEhh.begin(), m_popEhh.end(), 0.0);
+        std::fill(m_pairEhh.begin(), m_pairEhh.end(), 0.0);
+        std::fill(m_pairSplit.begin(), m_pairSplit.end(), 0);
+        std::fill(m_popSinglesStep.begin(), m_popSinglesStep.end(), 0);
+        std::fill(m_ihsEhh.begin(), m_ihsEhh.end(), 0.0);
+        std::fill(m_ihsSplit.begin(), m_ihsSplit.end(), 0);
+        std::fill(m_ihsSinglesStep.begin(), m_ihsSinglesStep.end(), 0);
+        m_branch0count = 0;
+        calcBranchXPEHHPairs<Binom>(currLine, &overflow);
+        if (overflow)
+        {
+            m_maxBreadth0 += 100;
+            aligned_free(m_branch0);
+            m_branch0 = reinterpret_cast<HapMap::PrimitiveType*>(aligned_alloc(128, m_popOffsets.back()*m_maxBreadth0*sizeof(HapMap::PrimitiveType)));
+            if (!m_ihsEhh.empty())
+                m_branchClass.resize(m_maxBreadth0);
+            realloced0 = true;
+            ++m_trace.reallocs;
+        }
+    } while (overflow);
+    if (realloced0)
+    {
+        aligned_free(m_parent0);
+        m_parent0 = reinterpret_cast<HapMap::PrimitiveType*>(aligned_alloc(128, m_popOffsets.back()*m_maxBreadth0*sizeof(HapMap::PrimitiveType)));
+        if (!m_ihsEhh.empty())
+            m_parentClass.resize(m_maxBreadth0);
+    }
+    if (!Binom)
+    {
+        for (std::size_t k = 0; k < m_pops.size(); ++k)
+            m_popSingles[k] += m_popSinglesStep[k];
+        for (std::size_t c = 0; c < m_ihsSingles.size(); ++c)
+            m_ihsSingles[c] += m_ihsSinglesStep[c];
+    }
+    m_parent0count = m_branch0count;
+    m_branch0count = 0ULL;
+    std::swap(m_parent0, m_branch0);
+    std::swap(m_parentClass, m_branchClass);
+    m_trace.peakBranches = std::max(m_trace.peakBranches, m_parent0count);
+}
+
+template <bool Binom>
+void EHHFinder::findXPEHHPairs(const std::vector<HapMap*>& pops, std::size_t focus, std::vector<XPEHH>& ret, const std::vector<std::atomic<unsigned long long>*>& reachedEnd, IhsOutput* ihs)
+{
+    enum PairState : char { Active, Done, Failed };
+    std::size_t numPops = pops.size();
+    std::size_t numPairs = numPops*(numPops-1)/2;
+    HapMap* map = pops[0];
+    m_trace = LocusTrace();
+    m_trace.index = focus;
+    m_windowEdge = false;
+    ret.assign(numPairs, XPEHH());
+    bool xpehhLocus = (focus > 1 && focus < map->numSnps()-2);
+    if (!xpehhLocus && !ihs)
+        return;
+    if (m_pops != pops)
+    {
+        m_pops = pops;
+        m_popOffsets.assign(1, 0);
+        m_pairA.clear();
+        m_pairB.clear();
+        m_pairFreq.clear();
+        m_popFreq.resize(numPops);
+        for (std::size_t k = 0; k < numPops; ++k)
+        {
+            m_popOffsets.push_back(m_popOffsets.back() + pops[k]->snpDataSize());
+            m_popFreq[k] = Binom ? 1.0/binom_2(pops[k]->snpLength()) : 1.0/(double)pops[k]->snpLength();
+            for (std::size_t b = k + 1; b < numPops; ++b)
+            {
+                m_pairA.push_back(k);
+                m_pairB.push_back(b);
+                std::size_t length = pops[k]->snpLength() + pops[b]->snpLength();
+                m_pairFreq.push_back(Binom ? 1.0/binom_2(length) : 1.0/(double)length);
+            }
+        }
+        m_popCounts.resize(numPops);
+        m_popEhh.resize(numPops);
+        m_popSingles.resize(numPops);
+        m_popSinglesStep.resize(numPops);
+        m_pairEhh.resize(numPairs);
+        m_pairSplit.resize(numPairs);
+    }
+    if (ihs)
+    {
+        m_parentClass.resize(m_maxBreadth0);
+        m_branchClass.resize(m_maxBreadth0);
+        m_ihsFreq.resize(2*numPops);
+        m_ihsEhh.resize(2*numPops);
+        m_ihsSingles.resize(2*numPops);
+        m_ihsSinglesStep.resize(2*numPops);
+        m_ihsSplit.resize(numPops);
+    }
+    else
+    {
+        m_parentClass.clear();
+        m_ihsEhh.clear();
+        m_ihsSingles.clear();
+    }
+
+    std::vector<int> num(numPops);
+    std::vector<char> state(numPairs, Active);
+    for (std::size_t k = 0; k < numPops; ++k)
+    {
+        const HapMap::PrimitiveType* hd = pops[k]->row(focus);
+        std::size_t size = pops[k]->snpDataSize();
+        for (std::size_t i = 0; i < size; ++i)
+            num[k] += POPCOUNT(hd[i]);
+    }
+    for (std::size_t p = 0; p < numPairs; ++p)
+    {
+        if (!xpehhLocus)
+        {
+            state[p] = Failed;
+            continue;
+        }
+        std::size_t a = m_pairA[p], b = m_pairB[p];
+        ret[p].index = focus;
+        ret[p].numA = num[a];
+        ret[p].numNotA = pops[a]->snpLength() - num[a];
+        ret[p].numB = num[b];
+        ret[p].numNotB = pops[b]->snpLength() - num[b];
+        double maxEHH_A = num[a]/(double)pops[a]->snpLength();
+        double maxEHH_B = num[b]/(double)pops[b]->snpLength();
+        bool mafAInRange = (maxEHH_A <= 1.0 - m_minMAF && maxEHH_A >= m_minMAF);
+        bool mafBInRange = (maxEHH_B <= 1.0 - m_minMAF && maxEHH_B >= m_minMAF);
+        if ((!mafAInRange || !mafBInRange) && m_minMAF != 0.0)
+            state[p] = Failed;
+    }
+
+    /*
+     * The iHS of each population is checked and stopped as find() does it. A locus next to either end is
+     * only walked upstream when it is the last one, where find() has no row to start the downstream walk.
+     */
+    std::vector<char> ihsState(ihs ? numPops : 0, Active);
+    if (ihs)
+    {
+        ihs->ehh.assign(numPops, EHH());
+        for (std::size_t k = 0; k < numPops; ++k)
+        {
+            EHH& e = ihs->ehh[k];
+            e.index = focus;
+            e.num = num[k];
+            e.numNot = pops[k]->snpLength() - num[k];
+            double maxEHH = e.num/(double)pops[k]->snpLength();
+            if (!(maxEHH <= 1.0 - m_minMAF && maxEHH >= m_minMAF) && m_minMAF != 0.0)
+            {
+                ++(*ihs->outsideMaf[k]);
+                ihsState[k] = Failed;
+            }
+            else if (focus < 2 || focus == map->numSnps()-2)
+            {
+                ++(*ihs->reachedEnd[k]);
+                ihsState[k] = Failed;
+            }
+            m_ihsFreq[2*k] = Binom ? 1.0/binom_2(e.numNot) : 1.0/(double)e.numNot;
+            m_ihsFreq[2*k+1] = Binom ? 1.0/binom_2(e.num) : 1.0/(double)e.num;
+        }
+    }
+
+    /*
+     * The EHH of the previous row, of each population and of each pair, and the start of a walk, which puts
+     * back every pair and population that has not failed.
+     */
+    std::vector<double> lastPop(numPops), lastPair(numPairs), lastIhs(2*ihsState.size());
+    auto ehhOfCore = [&](int n, std::size_t length, double freq) {
+        if (Binom)
+            return (binom_2(n)+binom_2(length-n))*freq;
+        double f = n*freq;
+        return f*f+(1.0-f)*(1.0-f);
+    };
+    auto begin = [&]() {
+        std::size_t active = 0;
+        for (std::size_t k = 0; k < numPops; ++k)
+            lastPop[k] = ehhOfCore(num[k], pops[k]->snpLength(), m_popFreq[k]);
+        for (std::size_t p = 0; p < numPairs; ++p)
+        {
+            std::size_t a = m_pairA[p], b = m_pairB[p];
+            lastPair[p] = ehhOfCore(num[a] + num[b], pops[a]->snpLength() + pops[b]->snpLength(), m_pairFreq[p]);
+            if (state[p] != Failed)
+            {
+                state[p] = Active;
+                ++active;
+            }
+        }
+        for (std::size_t k = 0; k < ihsState.size(); ++k)
+        {
+            if (ihsState[k] != Failed)
+            {
+                ihsState[k] = Active;
+                ++active;
+            }
+        }
+        std::fill(lastIhs.begin(), lastIhs.end(), 1.0);
+        std::fill(m_popSingles.begin(), m_popSingles.end(), 0);
+        std::fill(m_ihsSingles.begin(), m_ihsSingles.end(), 0);
+        return active;
+    };
+    /*
+     * Integrate one more row for every active pair and population, stopping each the way findXPEHH() and
+     * find() stop a walk. Returns the number of pairs and populations still active.
+     */
+    auto step = [&](double gap, double scale) {
+        if (!Binom)
+        {
+            for (std::size_t k = 0; k < numPops; ++k)
+                m_popEhh[k] += (m_popFreq[k]*m_popFreq[k])*m_popSingles[k];
+            for (std::size_t p = 0; p < numPairs; ++p)
+                m_pairEhh[p] += (m_pairFreq[p]*m_pairFreq[p])*(m_popSingles[m_pairA[p]]+m_popSingles[m_pairB[p]]);
+            for (std::size_t c = 0; c < m_ihsEhh.size(); ++c)
+                m_ihsEhh[c] += (m_ihsFreq[c]*m_ihsFreq[c])*m_ihsSingles[c];
+        }
+        std::size_t active = 0;
+        for (std::size_t p = 0; p < numPairs; ++p)
+        {
+            if (state[p] != Active)
+                continue;
+            if (m_pairEhh[p] <= m_cutoff - 1e-15)
+            {
+                state[p] = Done;
+                continue;
+            }
+            std::size_t a = m_pairA[p], b = m_pairB[p];
+            ret[p].iHH_A1 += gap*(lastPop[a] + m_popEhh[a])*scale*0.5;
+            ret[p].iHH_B1 += gap*(lastPop[b] + m_popEhh[b])*scale*0.5;
+            ret[p].iHH_P1 += gap*(lastPair[p] + m_pairEhh[p])*scale*0.5;
+            lastPair[p] = m_pairEhh[p];
+            if (!m_pairSplit[p])
+                state[p] = Done;
+            else
+                ++active;
+        }
+        for (std::size_t k = 0; k < numPops; ++k)
+            lastPop[k] = m_popEhh[k];
+        for (std::size_t k = 0; k < ihsState.size(); ++k)
+        {
+            if (ihsState[k] != Active)
+                continue;
+            EHH& e = ihs->ehh[k];
+            if (lastIhs[2*k+1] > m_cutoff - 1e-15)
+            {
+                e.iHH_1 += gap*(lastIhs[2*k+1] + m_ihsEhh[2*k+1])*scale*0.5;
+                e.SL_1 += (lastIhs[2*k+1] + m_ihsEhh[2*k+1])*0.5;
+            }
+            if (lastIhs[2*k] > m_cutoff - 1e-15)
+            {
+                e.iHH_0 += gap*(lastIhs[2*k] + m_ihsEhh[2*k])*scale*0.5;
+                e.SL_0 += (lastIhs[2*k] + m_ihsEhh[2*k])*0.5;
+            }
+            lastIhs[2*k] = m_ihsEhh[2*k];
+            lastIhs[2*k+1] = m_ihsEhh[2*k+1];
+            if ((lastIhs[2*k+1] <= m_cutoff - 1e-15 && lastIhs[2*k] <= m_cutoff - 1e-15) || (!Binom && !m_ihsSplit[k]))
+                ihsState[k] = Done;
+            else
+                ++active;
+        }
+        return active;
+    };
+    /*
+     * find() keeps a binomial iHS walk which reaches the end of the chromosome downstream, so the
+     * populations only fail there if #ihsFails.
+     */
+    auto reachEnd = [&](bool ihsFails) {
+        for (std::size_t p = 0; p < numPairs; ++p)
+        {
+            if (state[p] == Active)
+            {
+                state[p] = Failed;
+                ++(*reachedEnd[p]);
+            }
+        }
+        for (std::size_t k = 0; k < ihsState.size(); ++k)
+        {
+            if (ihsFails && ihsState[k] == Active)
+            {
+                ihsState[k] = Failed;
+                ++(*ihs->reachedEnd[k]);
+            }
+        }
+    };
+    unsigned long long locusPysPos = map->physicalPosition(focus);
+
+    if (begin() > 0)
+    {
+        setInitialXPEHHPairs(focus);
+        calcBranchesXPEHHPairs<Binom>(focus-1);
+        for (std::size_t currLine = focus - 2;; --currLine)
+        {
+            unsigned long long currPhysPos = map->physicalPosition(currLine+1);
+            double scale = (double)(m_scale) / (double)(map->physicalPosition(currLine+2) - currPhysPos);
+            if (scale > 1)
+                scale=1;
+
+            calcBranchesXPEHHPairs<Binom>(currLine);
+            ++m_trace.upstreamRows;
+
+            if (step(map->geneticPosition(currLine+2)-map->geneticPosition(currLine+1), scale) == 0)
+                break;
+            if (m_maxExtend != 0 && locusPysPos - currPhysPos > m_maxExtend)
+                break;
+            if (currLine == 0)
+            {
+                reachEnd(true);
+                break;
+            }
+        }
+    }
+
+    if (focus + 1 < map->numSnps() && begin() > 0)
+    {
+        setInitialXPEHHPairs(focus);
+        calcBranchesXPEHHPairs<Binom>(focus+1);
+        for (std::size_t currLine = focus + 2; currLine < map->numSnps(); ++currLine)
+        {
+            unsigned long long currPhysPos = map->physicalPosition(currLine-1);
+            double scale = (double)(m_scale) / (double)(currPhysPos - map->physicalPosition(currLine-2));
+            if (scale > 1)
+                scale=1;
+
+            calcBranchesXPEHHPairs<Binom>(currLine);
+            ++m_trace.downstreamRows;
+
+            if (step(map->geneticPosition(currLine-1)-map->geneticPosition(currLine-2), scale) == 0)
+                break;
+            if (m_maxExtend != 0 && currPhysPos - locusPysPos > m_maxExtend)
+                break;
+            if (currLine == map->numSnps()-1)
+            {
+                reachEnd(!Binom);
+                break;
+            }
+        }
+    }
+
+    for (std::size_t p = 0; p < numPairs; ++p)
+    {
+        if (state[p] == Failed)
+            ret[p] = XPEHH();
+    }
+    for (std::size_t k = 0; k < ihsState.size(); ++k)
+    {
+        if (ihsState[k] == Failed)
+            ihs->ehh[k] = EHH();
+    }
+}
+
+template <bool Freq, bool Binom>
+void EHHFinder::calcBranches(HapMap* hapmap, std::size_t currLine, double freq0, double freq1, double freqBinom0, double freqBinom1, HapStats& stats, HapStats& statsBinom)
 {
     bool overflow;
     bool realloced0 = false, realloced1 = false;
@@ -406,19 +1007,19 @@ void EHHFinder::calcBranches(HapMap* hapmap, std::size_t focus, std::size_t curr
     do
     {
         overflow = false;
-        if (!Binom)
-            single0 = 0;
+        single0 = 0;
         stats.probsNot = 0.0;
-        calcBranch<Binom>(hapmap, m_parent0, m_parent0count, m_branch0, m_branch0count, currLine, freq0, stats.probsNot, single0, m_maxBreadth0, &overflow);
+        statsBinom.probsNot = 0.0;
+        calcBranch<Freq, Binom>(hapmap, m_parent0, m_parent0count, m_branch0, m_branch0count, currLine, freq0, freqBinom0, stats.probsNot, statsBinom.probsNot, single0, m_maxBreadth0, &overflow);
         if(overflow)
         {
             m_maxBreadth0 += 100;
             aligned_free(m_branch0);
             m_branch0 = reinterpret_cast<HapMap::PrimitiveType*>(aligned_alloc(128, m_snpDataSizeA*m_maxBreadth0*sizeof(HapMap::PrimitiveType)));
             realloced0 = true;
-            continue;
+            ++m_trace.reallocs;
         }
-    } while (false);
+    } while (overflow);
     if (realloced0)
     {
         aligned_free(m_parent0);
@@ -428,19 +1029,19 @@ void EHHFinder::calcBranches(HapMap* hapmap, std::size_t focus, std::size_t curr
     do
     {
         overflow = false;
-        if (!Binom)
-            single1 = 0;
+        single1 = 0;
         stats.probs = 0.0;
-        calcBranch<Binom>(hapmap, m_parent1, m_parent1count, m_branch1, m_branch1count, currLine, freq1, stats.probs, single1, m_maxBreadth1, &overflow);
+        statsBinom.probs = 0.0;
+        calcBranch<Freq, Binom>(hapmap, m_parent1, m_parent1count, m_branch1, m_branch1count, currLine, freq1, freqBinom1, stats.probs, statsBinom.probs, single1, m_maxBreadth1, &overflow);
         if(overflow)
         {
             m_maxBreadth1 += 100;
             aligned_free(m_branch1);
             m_branch1 = reinterpret_cast<HapMap::PrimitiveType*>(aligned_alloc(128, m_snpDataSizeB*m_maxBreadth1*sizeof(HapMap::PrimitiveType)));
             realloced1 = true;
-            continue;
+            ++m_trace.reallocs;
         }
-    } while (false);
+    } while (overflow);
     if (realloced1)
     {
         aligned_free(m_parent1);
@@ -450,28 +1051,20 @@ void EHHFinder::calcBranches(HapMap* hapmap, std::size_t focus, std::size_t curr
     m_parent1count = m_branch1count;
     m_branch0count = 0ULL;
     m_branch1count = 0ULL;
-    if (!Binom)
-    {
-        m_single0count += single0;
-        m_single1count += single1;
-    }
+    m_single0count += single0;
+    m_single1count += single1;
     std::swap(m_parent0, m_branch0);
     std::swap(m_parent1, m_branch1);
+    m_trace.peakBranches = std::max(m_trace.peakBranches, m_parent0count + m_parent1count);
 }
 
-template <bool Binom>
-EHH EHHFinder::find(HapMap* hapmap, std::size_t focus, std::atomic<unsigned long long>* reachedEnd, std::atomic<unsigned long long>* outsideMaf, bool ehhsave)
+template <bool Freq, bool Binom>
+void EHHFinder::walk(HapMap* hapmap, std::size_t focus, const SweepSetting* settings, std::size_t numSettings, EHH* ret, std::atomic<unsigned long long>* const* reachedEnd, std::atomic<unsigned long long>* const* outsideMaf, bool ehhsave)
 {
-    m_parent0count = 2ULL;
-    m_parent1count = 2ULL;
-    m_branch0count = 0ULL;
-    m_branch1count = 0ULL;
-    if (!Binom)
-    {
-        m_single0count = 0ULL;
-        m_single1count = 0ULL;
-    }
-    m_hdA = hapmap->rawData();
+    m_trace = LocusTrace();
+    m_trace.index = focus;
+    m_windowEdge = false;
+    m_hmA = hapmap;
     m_snpDataSizeA = m_snpDataSizeB = hapmap->snpDataSize();
 
 #if VEC==4
@@ -481,125 +1074,187 @@ EHH EHHFinder::find(HapMap* hapmap, std::size_t focus, std::atomic<unsigned long
 #else
     m_maskA = ::bitsetMask<HapMap::PrimitiveType>(hapmap->snpLength());
 #endif
-    EHH ret;
-    ret.index = focus;
+    for (std::size_t s = 0; s < numSettings; ++s)
+        ret[s] = EHH();
 
+    int num = 0;
     for(std::size_t i = 0; i < m_snpDataSizeA; ++i)
     {
-        ret.num += POPCOUNT(m_hdA[focus*m_snpDataSizeA+i]);
+        num += POPCOUNT(m_hmA->row(focus)[i]);
     }
-    ret.numNot = hapmap->snpLength() - ret.num;
+    int numNot = hapmap->snpLength() - num;
 
-    double maxEHH = ret.num/(double)hapmap->snpLength();
+    double maxEHH = num/(double)hapmap->snpLength();
     if (!(maxEHH <= 1.0 - m_minMAF && maxEHH >= m_minMAF) && m_minMAF != 0.0)
     {
-        ++(*outsideMaf);
-        return EHH();
+        for (std::size_t s = 0; s < numSettings; ++s)
+            ++(*outsideMaf[s]);
+        return;
     }
     if (focus < 2 || focus == hapmap->numSnps()-2)
     {
-        ++(*reachedEnd);
-        return EHH();
-    }
-
-    double freq0, freq1;
-    double probSingle, probNotSingle;
-    if (Binom)
-    {
-        freq0 = 1.0/binom_2(ret.numNot);
-        freq1 = 1.0/binom_2(ret.num);
+        for (std::size_t s = 0; s < numSettings; ++s)
+            ++(*reachedEnd[s]);
+        return;
     }
-    else
+    for (std::size_t s = 0; s < numSettings; ++s)
     {
-        freq0 = 1.0/(double)ret.numNot;
-        freq1 = 1.0/(double)ret.num;
-        probSingle = freq1*freq1;
-        probNotSingle = freq0*freq0;
+        ret[s].index = focus;
+        ret[s].num = num;
+        ret[s].numNot = numNot;
     }
-    double lastProbs = 1.0, lastProbsNot = 1.0;
+
+    double freq0 = 1.0/(double)numNot;
+    double freq1 = 1.0/(double)num;
+    double freqBinom0 = 1.0/binom_2(numNot);
+    double freqBinom1 = 1.0/binom_2(num);
+    double probSingle = freq1*freq1;
+    double probNotSingle = freq0*freq0;
     unsigned long long locusPysPos = hapmap->physicalPosition(focus);
 
-    setInitial(focus, focus-1);
+    /*
+     * A setting is active until it stops: when both EHH are below its cutoff, when it has gone further than
+     * its maximum extension, or, for frequency squared EHH, when every haplotype is a single. A setting which
+     * reaches the end of the chromosome before that gets an empty result and skips the other side.
+     */
+    std::vector<char>& active = m_walkActive;
+    std::vector<char>& failed = m_walkFailed;
+    active.assign(numSettings, 1);
+    failed.assign(numSettings, 0);
+    HapStats last, lastBinom;
+    auto step = [&](double dist, double scale, const HapStats& stats, const HapStats& statsBinom, bool upstream) {
+        for (std::size_t s = 0; s < numSettings; ++s)
+        {
+            if (!active[s])
+                continue;
+            const HapStats& prev = settings[s].binom ? lastBinom : last;
+            const HapStats& cur = settings[s].binom ? statsBinom : stats;
+            if (prev.probs > settings[s].cutoff - 1e-15)
+            {
+                ret[s].iHH_1 += dist*(prev.probs + cur.probs)*scale*0.5;
+                ret[s].SL_1 += (prev.probs + cur.probs)*0.5;
+            }
+            if (prev.probsNot > settings[s].cutoff - 1e-15)
+            {
+                ret[s].iHH_0 += dist*(prev.probsNot + cur.probsNot)*scale*0.5;
+                ret[s].SL_0 += (prev.probsNot + cur.probsNot)*0.5;
+            }
+            if (ehhsave)
+                (upstream ? ret[s].upstream : ret[s].downstream).push_back(cur);
+        }
+        last = stats;
+        lastBinom = statsBinom;
+    };
+    auto stop = [&](unsigned long long extension) {
+        bool allSingles = (m_single0count+m_single1count) == hapmap->snpLength();
+        bool any = false;
+        for (std::size_t s = 0; s < numSettings; ++s)
+        {
+            if (!active[s])
+                continue;
+            const HapStats& cur = settings[s].binom ? lastBinom : last;
+            if ((settings[s].maxExtend != 0 && extension > settings[s].maxExtend)
+                || (cur.probs <= settings[s].cutoff - 1e-15 && cur.probsNot <= settings[s].cutoff - 1e-15)
+                || (!settings[s].binom && allSingles))
+                active[s] = 0;
+            else
+                any = true;
+        }
+        return !any;
+    };
+    auto fail = [&](bool binom) {
+        for (std::size_t s = 0; s < numSettings; ++s)
+        {
+            if (active[s] && settings[s].binom == binom)
+            {
+                active[s] = 0;
+                failed[s] = 1;
+                ret[s] = EHH();
+                ++(*reachedEnd[s]);
+            }
+        }
+    };
+    auto edge = [&]() {
+        m_windowEdge = true;
+        for (std::size_t s = 0; s < numSettings; ++s)
+            ret[s] = EHH();
+    };
 
+    setInitial(focus, focus-1);
+    last.probs = last.probsNot = lastBinom.probs = lastBinom.probsNot = 1.0;
     for (std::size_t currLine = focus - 2;; --currLine)
     {
-        HapStats stats;
+        HapStats stats, statsBinom;
         unsigned long long currPhysPos = hapmap->physicalPosition(currLine+1);
         double scale = (double)(m_scale) / (double)(hapmap->physicalPosition(currLine+2) - currPhysPos);
         if (scale > 1)
             scale=1;
 
-        calcBranches<Binom>(hapmap, focus, currLine, freq0, freq1, stats);
-
-        if (!Binom)
+        calcBranches<Freq, Binom>(hapmap, currLine, freq0, freq1, freqBinom0, freqBinom1, stats, statsBinom);
+        ++m_trace.upstreamRows;
+        if (Freq)
         {
-            stats.probs +=  probSingle*m_single1count;
+            stats.probs += probSingle*m_single1count;
             stats.probsNot += probNotSingle*m_single0count;
         }
 
-        if (lastProbs > m_cutoff - 1e-15)
-            ret.iHH_1 += (hapmap->geneticPosition(currLine+2)-hapmap->geneticPosition(currLine+1))*(lastProbs + stats.probs)*scale*0.5;
-        if (lastProbsNot > m_cutoff - 1e-15)
-            ret.iHH_0 += (hapmap->geneticPosition(currLine+2)-hapmap->geneticPosition(currLine+1))*(lastProbsNot + stats.probsNot)*scale*0.5;
-
-        lastProbs = stats.probs;
-        lastProbsNot = stats.probsNot;
-        if (ehhsave)
-            ret.upstream.push_back(std::move(stats));
-
-
-        if (m_maxExtend != 0 && locusPysPos - currPhysPos > m_maxExtend)
-            break;
-        if (lastProbs <= m_cutoff - 1e-15 && lastProbsNot <= m_cutoff - 1e-15)
-            break;
-        if (!Binom && (m_single0count+m_single1count) == hapmap->snpLength())
+        step(hapmap->geneticPosition(currLine+2)-hapmap->geneticPosition(currLine+1), scale, stats, statsBinom, true);
+        if (stop(locusPysPos - currPhysPos))
             break;
+        if (currLine == hapmap->firstLine() && currLine != 0)
+        {
+            edge();
+            return;
+        }
         if (currLine == 0)
         {
-            ++(*reachedEnd);
-            return EHH();
+            fail(false);
+            fail(true);
+            break;
         }
     }
 
-    setInitial(focus,focus+1);
-    lastProbs = 1.0, lastProbsNot = 1.0;
-    for (std::size_t currLine = focus + 2; currLine < hapmap->numSnps(); ++currLine)
+    setInitial(focus, focus+1);
+    last.probs = last.probsNot = lastBinom.probs = lastBinom.probsNot = 1.0;
+    for (std::size_t s = 0; s < numSettings; ++s)
+        active[s] = !failed[s];
+    if (std::find(active.begin(), active.end(), 1) == active.end())
+        return;
+    for (std::size_t currLine = focus + 2; currLine < hapmap->endLine(); ++currLine)
     {
-        HapStats stats;
+        HapStats stats, statsBinom;
         unsigned long long currPhysPos = hapmap->physicalPosition(currLine-1);
         double scale = double(m_scale) / double(hapmap->physicalPosition(currLine-1) - hapmap->physicalPosition(currLine-2));
         if (scale > 1)
             scale=1;
 
-        calcBranches<Binom>(hapmap, focus, currLine, freq0, freq1, stats);
-
-        if (!Binom)
+        calcBranches<Freq, Binom>(hapmap, currLine, freq0, freq1, freqBinom0, freqBinom1, stats, statsBinom);
+        ++m_trace.downstreamRows;
+        if (Freq)
         {
-            stats.probs +=  probSingle*m_single1count;
+            stats.probs += probSingle*m_single1count;
             stats.probsNot += probNotSingle*m_single0count;
         }
 
-        if (lastProbs > m_cutoff - 1e-15) {
-            ret.iHH_1 += (hapmap->geneticPosition(currLine-1)-hapmap->geneticPosition(currLine-2))*(lastProbs + stats.probs)*scale*0.5;
-        }
-        if (lastProbsNot > m_cutoff - 1e-15) {
-            ret.iHH_0 += (hapmap->geneticPosition(currLine-1)-hapmap->geneticPosition(currLine-2))*(lastProbsNot + stats.probsNot)*scale*0.5;
-        }
-
-        lastProbs = stats.probs;
-        lastProbsNot = stats.probsNot;
-        if (ehhsave)
-            ret.downstream.push_back(std::move(stats));
-
-        if (lastProbs <= m_cutoff - 1e-15 && lastProbsNot <= m_cutoff - 1e-15 || (m_single0count+m_single1count) == hapmap->snpLength())
-            break;
-        if (m_maxExtend != 0 && currPhysPos - locusPysPos > m_maxExtend)
+        step(hapmap->geneticPosition(currLine-1)-hapmap->geneticPosition(currLine-2), scale, stats, statsBinom, false);
+        if (stop(currPhysPos - locusPysPos))
             break;
-        if (!Binom && currLine == hapmap->numSnps()-1)
+        if (currLine == hapmap->endLine()-1 && currLine != hapmap->numSnps()-1)
         {
-            ++(*reachedEnd);
-            return EHH();
+            edge();
+            return;
         }
+        // Only frequency squared EHH gives up at the end of the chromosome downstream.
+        if (currLine == hapmap->numSnps()-1)
+            fail(false);
     }
+}
+
+template <bool Binom>
+EHH EHHFinder::find(HapMap* hapmap, std::size_t focus, std::atomic<unsigned long long>* reachedEnd, std::atomic<unsigned long long>* outsideMaf, bool ehhsave)
+{
+    SweepSetting setting{m_cutoff, m_maxExtend, Binom};
+    EHH ret;
+    walk<!Binom, Binom>(hapmap, focus, &setting, 1, &ret, &reachedEnd, &outsideMaf, ehhsave);
     return ret;
 }
@@ -41,8 +41,22 @@ EHHFinder::EHHFinder(std::size_t snpDataSizeA, std::size_t snpDataSizeB, std::si
     , m_ehhA{}
     , m_ehhB{}
     , m_ehhP{}
+    , m_windowEdge(false)
+    , m_permMasks(nullptr)
+    , m_numPerms(0)
+    , m_siteEhh(false)
 {}
 
+void EHHFinder::setPermutations(const HapMap::PrimitiveType* masks, std::size_t count)
+{
+    m_permMasks = masks;
+    m_numPerms = count;
+    m_permEhhA.assign(count, 0.0);
+    m_permEhhB.assign(count, 0.0);
+    m_permSingleA.assign(count, 0);
+    m_permSingleStepA.assign(count, 0);
+}
+
 /**
  * Set initial state. Set m_parent0 to '0' core haplotype positions, m_parent1 to '1' core haplotype positions.
  *
@@ -58,12 +72,14 @@ void EHHFinder::setInitial(std::size_t focus, std::size_t line)
     m_single0count = 0ULL;
     m_single1count = 0ULL;
 
+    const HapMap::PrimitiveType* core = m_hmA->row(focus);
+    const HapMap::PrimitiveType* next = m_hmA->row(line);
     for (int j = 0; j < m_snpDataSizeA; ++j)
     {
-        m_parent0[               j] = ~m_hdA[focus*m_snpDataSizeA+j] &  m_hdA[line*m_snpDataSizeA+j];
-        m_parent0[m_snpDataSizeA+j] = (~m_hdA[focus*m_snpDataSizeA+j]) & (~m_hdA[line*m_snpDataSizeA+j]);
-        m_parent1[               j] =  m_hdA[focus*m_snpDataSizeA+j] &  m_hdA[line*m_snpDataSizeA+j];
-        m_parent1[m_snpDataSizeA+j] =  m_hdA[focus*m_snpDataSizeA+j] & ~m_hdA[line*m_snpDataSizeA+j];
+        m_parent0[               j] = ~core[j] &  next[j];
+        m_parent0[m_snpDataSizeA+j] = (~core[j]) & (~next[j]);
+        m_parent1[               j] =  core[j] &  next[j];
+        m_parent1[m_snpDataSizeA+j] =  core[j] & ~next[j];
     }
     m_parent0[  m_snpDataSizeA-1] &= m_maskA;
     m_parent0[2*m_snpDataSizeA-1] &= m_maskA;
@@ -77,16 +93,68 @@ void EHHFinder::setInitialXPEHH(std::size_t focus)
     m_branch0count = 0ULL;
     m_branch1count = 0ULL;
 
+    const HapMap::PrimitiveType* coreA = m_hmA->row(focus);
+    const HapMap::PrimitiveType* coreB = m_hmB->row(focus);
     for (std::size_t i = 0; i < m_snpDataSizeA; ++i)
-        m_parent0[i] = ~m_hdA[focus*m_snpDataSizeA+i];
+        m_parent0[i] = ~coreA[i];
     m_parent0[m_snpDataSizeA-1] &= m_maskA;
     for (std::size_t i = 0; i < m_snpDataSizeB; ++i)
-        m_parent0[i+m_snpDataSizeA] = ~m_hdB[focus*m_snpDataSizeB+i];
+        m_parent0[i+m_snpDataSizeA] = ~coreB[i];
     m_parent0[m_snpDataSizeA+m_snpDataSizeB-1] &= m_maskB;
     for (std::size_t i = 0; i < m_snpDataSizeA; ++i)
-        m_parent0[i+m_snpDataSizeA+m_snpDataSizeB] = m_hdA[focus*m_snpDataSizeA+i];
+        m_parent0[i+m_snpDataSizeA+m_snpDataSizeB] = coreA[i];
     for (std::size_t i = 0; i < m_snpDataSizeB; ++i)
-        m_parent0[i+2*m_snpDataSizeA+m_snpDataSizeB] = m_hdB[focus*m_snpDataSizeB+i];
+        m_parent0[i+2*m_snpDataSizeA+m_snpDataSizeB] = coreB[i];
+}
+
+static HapMap::PrimitiveType lastWordMask(std::size_t snpLength)
+{
+#if VEC==4
+    return ::bitsetMask4(snpLength);
+#elif VEC==2
+    return ::bitsetMask2(snpLength);
+#else
+    return ::bitsetMask<HapMap::PrimitiveType>(snpLength);
+#endif
+}
+
+void EHHFinder::setInitialXPEHHPairs(std::size_t focus)
+{
+    m_parent0count = 2ULL;
+    m_branch0count = 0ULL;
+
+    std::size_t snpDataSize = m_popOffsets.back();
+    for (std::size_t k = 0; k < m_pops.size(); ++k)
+    {
+        const HapMap::PrimitiveType* hd = m_pops[k]->row(focus);
+        std::size_t size = m_pops[k]->snpDataSize();
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            m_parent0[m_popOffsets[k]+i] = ~hd[i];
+            m_parent0[snpDataSize+m_popOffsets[k]+i] = hd[i];
+        }
+        m_parent0[m_popOffsets[k]+size-1] &= lastWordMask(m_pops[k]->snpLength());
+    }
+    if (!m_parentClass.empty())
+    {
+        m_parentClass[0] = 0;
+        m_parentClass[1] = 1;
+    }
+}
+
+void EHHFinder::findSweep(HapMap* hapmap, std::size_t focus, const std::vector<SweepSetting>& settings, std::vector<EHH>& ret, const std::vector<std::atomic<unsigned long long>*>& reachedEnd, const std::vector<std::atomic<unsigned long long>*>& outsideMaf)
+{
+    // Only the kinds of EHH some setting uses are summed.
+    bool freq = false, binom = false;
+    for (const SweepSetting& setting : settings)
+        (setting.binom ? binom : freq) = true;
+    ret.resize(settings.size());
+    if (freq && binom)
+        walk<true, true>(hapmap, focus, settings.data(), settings.size(), ret.data(), reachedEnd.data(), outsideMaf.data(), false);
+    else if (binom)
+        walk<false, true>(hapmap, focus, settings.data(), settings.size(), ret.data(), reachedEnd.data(), outsideMaf.data(), false);
+    else
+        walk<true, false>(hapmap, focus, settings.data(), settings.size(), ret.data(), reachedEnd.data(), outsideMaf.data(), false);
 }
 
 EHHFinder::~EHHFinder()
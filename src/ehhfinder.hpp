@@ -21,29 +21,142 @@
 #define LLEHHFINDER_H
 #include "ehh.hpp"
 #include "hapmap.hpp"
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cmath>
+#include <vector>
 
 class EHHFinder
 {
 public:
     explicit EHHFinder(std::size_t snpDataSizeA, std::size_t snpDataSizeB, std::size_t maxBreadth, double cutoff, double minMAF, double scale, unsigned long long maxExtend);
+    /**
+     * The masks are vector types, which plain new does not align before C++17.
+     */
+    static void* operator new(std::size_t size) { return aligned_alloc(128, size); }
+    static void operator delete(void* ptr) { aligned_free(ptr); }
     template <bool Binom>
     EHH find(HapMap* hapmap, std::size_t focus, std::atomic<unsigned long long>* reachedEnd, std::atomic<unsigned long long>* outsideMaf, bool ehhsave = false);
     template <bool Binom>
     XPEHH findXPEHH(HapMap* hmA, HapMap *hmB, std::size_t focus, std::atomic<unsigned long long>* reachedEnd);
+    /**
+     * Have findXPEHH() also walk #count permutations of the population labels and set XPEHH::pValue. Each
+     * of the #count masks has snpDataSizeA + snpDataSizeB words laid out like a branch, with the bits of
+     * the haplotypes relabelled to population A set. Relabelling does not change the pooled branches or
+     * where the walk stops, so a permutation only costs one masked count per branch. The masks are not
+     * copied.
+     */
+    void setPermutations(const HapMap::PrimitiveType* masks, std::size_t count);
+    /**
+     * Have findXPEHH() also integrate the site EHH of each population, the EHH of all its haplotypes
+     * without splitting them by the allele at the focus, into XPEHH::iES_A and XPEHH::iES_B for Rsb. These
+     * are the sums the walk already keeps for iHH_A1 and iHH_B1, but each is integrated until it drops
+     * below the cutoff itself rather than until the pooled EHH does.
+     */
+    void setSiteEhh(bool enabled) { m_siteEhh = enabled; }
+    /**
+     * iHS of every population from the walk of findXPEHHPairs(). Each result is what find() returns for the
+     * population on its own, including at the last locus. The caller sets one counter of each kind per
+     * population, and they are bumped the same way find() bumps them.
+     */
+    struct IhsOutput
+    {
+        std::vector<EHH> ehh;
+        std::vector<std::atomic<unsigned long long>*> reachedEnd;
+        std::vector<std::atomic<unsigned long long>*> outsideMaf;
+    };
+    /**
+     * XP-EHH of every pair of #pops at #focus from a single walk. The haplotypes of all the populations are
+     * partitioned together, so each population's branches are refined once however many pairs it is in, and
+     * the pooled EHH of a pair is summed from the per population counts of the shared branches. The finder
+     * must have been constructed with the summed snpDataSize() of #pops as snpDataSizeA.
+     *
+     * #ret gets one result per pair, in the order (0,1), (0,2), ..., (1,2), ... Pairs outside the MAF range
+     * or whose walk reached the end of the chromosome get an empty XPEHH, and the latter bump their
+     * #reachedEnd counter. Positions are taken from the map of #pops[0]. If #ihs is given, the branches also
+     * keep the allele they carry at #focus, and the walk goes on until every population's iHS is done too.
+     */
+    template <bool Binom>
+    void findXPEHHPairs(const std::vector<HapMap*>& pops, std::size_t focus, std::vector<XPEHH>& ret, const std::vector<std::atomic<unsigned long long>*>& reachedEnd, IhsOutput* ihs = nullptr);
+    /**
+     * One combination of the settings a sweep varies: the EHH cutoff, the maximum extension in bp (0 for
+     * none) and whether EHH uses binomial coefficients rather than frequency squared.
+     */
+    struct SweepSetting
+    {
+        double cutoff;
+        unsigned long long maxExtend;
+        bool binom;
+    };
+    /**
+     * iHH at #focus for every one of #settings from a single walk. The branches do not depend on the
+     * settings, so each row is split once, both kinds of EHH are summed from the same branch counts, and
+     * each setting integrates them until it would have stopped on its own. The walk goes on until the last
+     * setting stops. #ret[s] is what find() returns with setting s, and #reachedEnd[s] and #outsideMaf[s]
+     * are bumped the same way. The cutoff and maximum extension given to the constructor are not used.
+     */
+    void findSweep(HapMap* hapmap, std::size_t focus, const std::vector<SweepSetting>& settings, std::vector<EHH>& ret, const std::vector<std::atomic<unsigned long long>*>& reachedEnd, const std::vector<std::atomic<unsigned long long>*>& outsideMaf);
+    /**
+     * Rows visited, peak branch count and buffer reallocations of the last find() or findXPEHH(). The
+     * wall time is left for the caller to fill in.
+     */
+    const LocusTrace& trace() const { return m_trace; }
+    /**
+     * True if the last find() or findXPEHH() stopped at the edge of the rows loaded in the HapMap rather
+     * than at the end of the chromosome. The result is empty and the locus must be recalculated with a
+     * larger window.
+     */
+    bool reachedWindowEdge() const { return m_windowEdge; }
     ~EHHFinder();
 protected:
-    template <bool Binom>
-    inline void calcBranch(HapMap* hm, HapMap::PrimitiveType* parent, std::size_t parentcount, HapMap::PrimitiveType* branch, std::size_t& branchcount, std::size_t currLine, double freq, double& probs, std::size_t& singlecount, std::size_t maxBreadth, bool* overflow);
+    /**
+     * The walk of find() and findSweep(): iHH at #focus with each of the #numSettings #settings into #ret,
+     * from a single walk which goes on until the last setting stops. Only the kinds of EHH enabled by Freq
+     * (frequency squared) and Binom are summed, so the settings may only use those. #reachedEnd[s] and
+     * #outsideMaf[s] are bumped for setting s, and with #ehhsave each result keeps the EHH of every row its
+     * setting walked.
+     */
+    template <bool Freq, bool Binom>
+    void walk(HapMap* hapmap, std::size_t focus, const SweepSetting* settings, std::size_t numSettings, EHH* ret, std::atomic<unsigned long long>* const* reachedEnd, std::atomic<unsigned long long>* const* outsideMaf, bool ehhsave);
+    /**
+     * Split the #parentcount branches of #parent by the allele at #currLine into #branch, summing the
+     * frequency squared EHH of the parents into #probs if Freq is set and the binomial EHH into #probsBinom
+     * if Binom is. Singles are only counted for frequency squared EHH, and binomial EHH leaves them out.
+     */
+    template <bool Freq, bool Binom>
+    inline void calcBranch(HapMap* hm, HapMap::PrimitiveType* parent, std::size_t parentcount, HapMap::PrimitiveType* branch, std::size_t& branchcount, std::size_t currLine, double freq, double freqBinom, double& probs, double& probsBinom, std::size_t& singlecount, std::size_t maxBreadth, bool* overflow);
     template <bool Binom>
     inline void calcBranchXPEHH(std::size_t currLine, std::size_t& singleA, std::size_t& singleB, std::size_t& singleP, bool* overflow);
     void setInitial(std::size_t focus, std::size_t line);
     void setInitialXPEHH(std::size_t focus);
+    /**
+     * Number of haplotypes in #branch which permutation #perm labels as population A.
+     */
+    int maskedCount(const HapMap::PrimitiveType* branch, std::size_t perm) const
+    {
+        std::size_t snpDataSize = m_snpDataSizeA + m_snpDataSizeB;
+        const HapMap::PrimitiveType* mask = &m_permMasks[perm*snpDataSize];
+        int count = 0;
+        for (std::size_t j = 0; j < snpDataSize; ++j)
+            count += POPCOUNT(branch[j] & mask[j]);
+        return count;
+    }
+    /**
+     * Start the permuted walks of findXPEHH(): their EHH at the core, from the haplotypes carrying the
+     * derived allele, and no singles yet.
+     */
     template <bool Binom>
-    inline void calcBranches(HapMap* hapmap, std::size_t focus, std::size_t currLine, double freq0, double freq1, HapStats& stats);
+    void setInitialPermutations(std::size_t focus, const XPEHH& observed, std::vector<double>& lastEhhA, std::vector<double>& lastEhhB);
+    template <bool Freq, bool Binom>
+    inline void calcBranches(HapMap* hapmap, std::size_t currLine, double freq0, double freq1, double freqBinom0, double freqBinom1, HapStats& stats, HapStats& statsBinom);
     template <bool Binom>
     inline void calcBranchesXPEHH(std::size_t currLine);
+    template <bool Binom>
+    inline void calcBranchXPEHHPairs(std::size_t currLine, bool* overflow);
+    void setInitialXPEHHPairs(std::size_t focus);
+    template <bool Binom>
+    inline void calcBranchesXPEHHPairs(std::size_t currLine);
     
     std::size_t m_maxBreadth0;
     std::size_t m_maxBreadth1;
@@ -76,10 +189,59 @@ protected:
     std::size_t m_snpDataSizeB;
     std::size_t m_snpDataSizeULL_A;
     std::size_t m_snpDataSizeULL_B;
-    HapMap::PrimitiveType *m_hdA;
-    HapMap::PrimitiveType *m_hdB;
     HapMap* m_hmA;
     HapMap* m_hmB;
+    LocusTrace m_trace;
+    bool m_windowEdge;
+
+    /*
+     * State of findXPEHHPairs(). A branch holds the segments of every population back to back, population k
+     * starting at m_popOffsets[k]. The EHH sums are per population and per pair, and m_pairSplit flags the
+     * pairs with at least two haplotypes left in a branch.
+     */
+    std::vector<HapMap*> m_pops;
+    std::vector<std::size_t> m_popOffsets;
+    std::vector<std::size_t> m_pairA;
+    std::vector<std::size_t> m_pairB;
+    std::vector<int> m_popCounts;
+    std::vector<double> m_popFreq;
+    std::vector<double> m_popEhh;
+    std::vector<std::size_t> m_popSingles;
+    std::vector<std::size_t> m_popSinglesStep;
+    std::vector<double> m_pairFreq;
+    std::vector<double> m_pairEhh;
+    std::vector<char> m_pairSplit;
+    /*
+     * The iHS part of findXPEHHPairs(): the allele at the core of each branch, and the EHH sums, frequencies
+     * and singles per population and allele, population k's at 2k for the ancestral and 2k+1 for the derived
+     * allele. m_ihsSplit flags the populations with at least two haplotypes left in a branch. All empty when
+     * no iHS is wanted.
+     */
+    std::vector<char> m_parentClass;
+    std::vector<char> m_branchClass;
+    std::vector<double> m_ihsFreq;
+    std::vector<double> m_ihsEhh;
+    std::vector<std::size_t> m_ihsSingles;
+    std::vector<std::size_t> m_ihsSinglesStep;
+    std::vector<char> m_ihsSplit;
+
+    /*
+     * State of the permutations in findXPEHH(): the EHH of each relabelled population and the haplotypes of
+     * relabelled population A which are singles, in total and found in the current row.
+     */
+    const HapMap::PrimitiveType* m_permMasks;
+    std::size_t m_numPerms;
+    std::vector<double> m_permEhhA;
+    std::vector<double> m_permEhhB;
+    std::vector<std::size_t> m_permSingleA;
+    std::vector<std::size_t> m_permSingleStepA;
+    bool m_siteEhh;
+
+    /*
+     * Settings of walk() which have not stopped, and those which reached the end of the chromosome.
+     */
+    std::vector<char> m_walkActive;
+    std::vector<char> m_walkFailed;
 };
 
 #include "ehhfinder-impl.hpp"
@@ -77,6 +77,41 @@ Stats stats(const std::vector<double>& list)
     return s;
 }
 
+Moments moments(const std::vector<double>& list)
+{
+    Moments m;
+    if (list.size() == 0)
+        return m;
+    m.count = list.size();
+    for (double v : list)
+        m.mean += v;
+    m.mean /= m.count;
+    for (double v : list)
+        m.m2 += (v - m.mean)*(v - m.mean);
+    return m;
+}
+
+void Moments::merge(const Moments& other)
+{
+    if (other.count == 0.0)
+        return;
+    double total = count + other.count;
+    double delta = other.mean - mean;
+    mean += delta*other.count/total;
+    m2 += other.m2 + delta*delta*count*other.count/total;
+    count = total;
+}
+
+Stats Moments::stats() const
+{
+    Stats s;
+    if (count == 0.0)
+        return s;
+    s.mean = mean;
+    s.stddev = std::sqrt(m2/count);
+    return s;
+}
+
 std::vector<std::string> splitString(const std::string input, char delim)
 {
     std::stringstream ss(input);
@@ -193,9 +193,25 @@ struct Stats
     double stddev;
 };
 
+/**
+ * Count, mean and sum of squared deviations (M2) of a set of values. Moments of disjoint sets can be merged
+ * without the values, so that ranks holding different loci can agree on the same Stats.
+ */
+struct Moments
+{
+    Moments() : count(0.0), mean(0.0), m2(0.0) {}
+    double count;
+    double mean;
+    double m2;
+
+    void merge(const Moments& other);
+    Stats stats() const;
+};
+
 double binom_2(double n);
 double nearest(double target, double number);
 Stats stats(const std::vector<double>& list);
+Moments moments(const std::vector<double>& list);
 std::vector<std::string> splitString(const std::string input, char delim);
 
 inline int popcount1(unsigned long long val)
@@ -0,0 +1,439 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "hapbind.hpp"
+#include "output.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static volatile std::sig_atomic_t s_interrupted = 0;
+
+static void onSignal(int)
+{
+    s_interrupted = 1;
+}
+
+static bool sendAll(int fd, const std::string& data)
+{
+    std::size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+QueryServer::QueryServer(double cutoff, double minMAF, double scale, unsigned long long maxExtend, bool binom, std::size_t cacheSize)
+    : m_cutoff(cutoff)
+    , m_minMAF(minMAF)
+    , m_scale(scale)
+    , m_maxExtend(maxExtend)
+    , m_binom(binom)
+    , m_stopping(false)
+    , m_cacheSize(cacheSize)
+{}
+
+bool QueryServer::addPopulation(const std::string& name, const std::string& hap, const std::string& map)
+{
+    if (population(name) != std::numeric_limits<std::size_t>::max())
+    {
+        std::cerr << "ERROR: Population " << name << " is given more than once." << std::endl;
+        return false;
+    }
+    std::unique_ptr<HapMap> hm(new HapMap());
+    if (!hm->loadHap(hap.c_str()))
+        return false;
+    if (!m_maps.empty() && hm->numSnps() != m_maps[0]->numSnps())
+    {
+        std::cerr << "ERROR: " << hap << " has " << hm->numSnps() << " loci but " << m_maps[0]->numSnps() << " were expected." << std::endl;
+        return false;
+    }
+    // Loci are looked up in the first population, so only it needs the ids.
+    hm->loadMap(map.c_str(), m_maps.empty());
+    if (m_maps.empty())
+        m_lines = hm->idIndex();
+    m_names.push_back(name);
+    m_maps.push_back(std::move(hm));
+    return true;
+}
+
+std::size_t QueryServer::population(const std::string& name) const
+{
+    for (std::size_t k = 0; k < m_names.size(); ++k)
+    {
+        if (m_names[k] == name)
+            return k;
+    }
+    return std::numeric_limits<std::size_t>::max();
+}
+
+bool QueryServer::cached(const std::string& key, std::string& response)
+{
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    auto it = m_cache.find(key);
+    if (it == m_cache.end())
+        return false;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+    response = it->second.first;
+    return true;
+}
+
+void QueryServer::cache(const std::string& key, const std::string& response)
+{
+    if (m_cacheSize == 0)
+        return;
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    if (m_cache.count(key))
+        return;
+    m_lru.push_front(key);
+    m_cache[key] = std::make_pair(response, m_lru.begin());
+    if (m_lru.size() > m_cacheSize)
+    {
+        m_cache.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+}
+
+std::string QueryServer::respond(const std::string& request, Finders& finders)
+{
+    std::istringstream in(request);
+    std::vector<std::string> words;
+    std::string word;
+    while (in >> word)
+        words.push_back(word);
+    if (words.empty())
+        return "ERROR Empty request\n";
+
+    const std::string& command = words[0];
+    TextBlock out;
+    if (command == "POPULATIONS" && words.size() == 1)
+    {
+        out << "OK " << m_names.size() << '\n';
+        for (std::size_t k = 0; k < m_names.size(); ++k)
+            out << m_names[k] << '\t' << m_maps[k]->snpLength() << '\n';
+        return out.str();
+    }
+    bool xpehh = (command == "XPEHH");
+    if (command != "EHH" && command != "IHS" && !xpehh)
+        return "ERROR Unknown request: " + command + "\n";
+    if (words.size() != (xpehh ? 4U : 3U))
+        return xpehh ? "ERROR Usage: XPEHH <population A> <population B> <locus id>\n" : "ERROR Usage: " + command + " <population> <locus id>\n";
+    std::size_t a = population(words[1]);
+    std::size_t b = xpehh ? population(words[2]) : 0;
+    if (a == std::numeric_limits<std::size_t>::max())
+        return "ERROR Unknown population: " + words[1] + "\n";
+    if (b == std::numeric_limits<std::size_t>::max())
+        return "ERROR Unknown population: " + words[2] + "\n";
+    auto found = m_lines.find(words.back());
+    if (found == m_lines.end())
+        return "ERROR Unknown locus: " + words.back() + "\n";
+    std::size_t line = found->second;
+
+    TextBlock key;
+    key << command << '\t' << a << '\t' << b << '\t' << line;
+    std::string response;
+    if (cached(key.str(), response))
+        return response;
+
+    std::atomic<unsigned long long> reachedEnd{};
+    std::atomic<unsigned long long> outsideMaf{};
+    if (xpehh)
+    {
+        std::unique_ptr<EHHFinder>& finder = finders.xpehh[std::make_pair(a, b)];
+        if (!finder)
+            finder.reset(new EHHFinder(m_maps[a]->snpDataSize(), m_maps[b]->snpDataSize(), 2000, m_cutoff, m_minMAF, m_scale, m_maxExtend));
+        XPEHH e = m_binom ? finder->findXPEHH<true>(m_maps[a].get(), m_maps[b].get(), line, &reachedEnd)
+                          : finder->findXPEHH<false>(m_maps[a].get(), m_maps[b].get(), line, &reachedEnd);
+        if (e.iHH_A1 == 0.0 || e.iHH_B1 == 0.0)
+        {
+            response = "ERROR XP-EHH not calculated: allele frequency outside the --minmaf range or the walk reached the end of the chromosome\n";
+        }
+        else
+        {
+            out << "OK 1\n" << e.iHH_A1 << '\t' << e.iHH_B1 << '\t' << e.iHH_P1 << '\t' << log(e.iHH_A1/e.iHH_B1) << '\n';
+            response = out.str();
+        }
+    }
+    else
+    {
+        if (finders.ehh.size() < m_maps.size())
+            finders.ehh.resize(m_maps.size());
+        std::unique_ptr<EHHFinder>& finder = finders.ehh[a];
+        if (!finder)
+            finder.reset(new EHHFinder(m_maps[a]->snpDataSize(), 0, 1000, m_cutoff, m_minMAF, m_scale, m_maxExtend));
+        HapMap* hm = m_maps[a].get();
+        bool curve = (command == "EHH");
+        EHH e = m_binom ? finder->find<true>(hm, line, &reachedEnd, &outsideMaf, curve)
+                        : finder->find<false>(hm, line, &reachedEnd, &outsideMaf, curve);
+        if (outsideMaf > 0)
+        {
+            response = "ERROR Allele frequency outside the --minmaf range\n";
+        }
+        else if (reachedEnd > 0 || e.num + e.numNot == 0)
+        {
+            response = "ERROR The walk reached the end of the chromosome\n";
+        }
+        else if (curve)
+        {
+            out << "OK " << e.upstream.size() + 1 + e.downstream.size() << '\n';
+            auto row = [&](std::size_t l, double ehh0, double ehh1) {
+                out << l << '\t' << m_maps[0]->lineToId(l) << '\t' << hm->geneticPosition(l) << '\t' << hm->physicalPosition(l)
+                    << '\t' << ehh0 << '\t' << ehh1 << '\n';
+            };
+            for (std::size_t i = e.upstream.size(); i != 0; --i)
+                row(line-i, e.upstream[i-1].probsNot, e.upstream[i-1].probs);
+            row(line, 1.0, 1.0);
+            for (std::size_t i = 0; i < e.downstream.size(); ++i)
+                row(line+i+1, e.downstream[i].probsNot, e.downstream[i].probs);
+            response = out.str();
+        }
+        else
+        {
+            out << "OK 1\n" << e.num/(double)hm->snpLength() << '\t' << e.iHH_0 << '\t' << e.iHH_1 << '\t' << log(e.iHH_0/e.iHH_1) << '\n';
+            response = out.str();
+        }
+    }
+    cache(key.str(), response);
+    return response;
+}
+
+bool QueryServer::handle(Connection& connection, Finders& finders)
+{
+    std::size_t end = connection.buffer.find('\n');
+    if (end == std::string::npos)
+    {
+        // The connection was polled readable, so take what has arrived without waiting for more.
+        char chunk[4096];
+        ssize_t n;
+        do
+            n = recv(connection.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        while (n < 0 && errno == EINTR);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n <= 0)
+            return false;
+        connection.buffer.append(chunk, n);
+        end = connection.buffer.find('\n');
+        if (end == std::string::npos)
+        {
+            if (connection.buffer.size() > 65536)
+            {
+                sendAll(connection.fd, "ERROR Request too long\n");
+                return false;
+            }
+            return true;
+        }
+    }
+    std::string request = connection.buffer.substr(0, end);
+    connection.buffer.erase(0, end + 1);
+    if (!request.empty() && request.back() == '\r')
+        request.pop_back();
+    if (request == "QUIT")
+        return false;
+    return sendAll(connection.fd, respond(request, finders));
+}
+
+void QueryServer::work()
+{
+    Finders finders;
+    while (true)
+    {
+        Connection connection;
+        {
+            std::unique_lock<std::mutex> lock(m_queueMutex);
+            m_queueReady.wait(lock, [this] { return m_stopping || !m_ready.empty(); });
+            if (m_stopping)
+                return;
+            connection = std::move(m_ready.front());
+            m_ready.pop();
+            m_active.insert(connection.fd);
+        }
+        bool open = handle(connection, finders);
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        m_active.erase(connection.fd);
+        if (!open || m_stopping)
+            close(connection.fd);
+        else if (connection.buffer.find('\n') != std::string::npos)
+        {
+            // Pipelined requests wait behind the other ready connections rather than holding on to the worker.
+            m_ready.push(std::move(connection));
+            m_queueReady.notify_one();
+        }
+        else
+        {
+            m_returned.push_back(std::move(connection));
+            char wake = 0;
+            // The pipe is non-blocking. If it is full, serve() is due to wake anyway.
+            if (write(m_wake[1], &wake, 1) < 0) {}
+        }
+    }
+}
+
+bool QueryServer::serve(const std::string& socketPath, std::size_t workers)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "ERROR: The socket path is too long: " << socketPath << std::endl;
+        return false;
+    }
+    std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        std::cerr << "ERROR: Could not create a socket: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    unlink(socketPath.c_str());
+    if (bind(listenFd, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(listenFd, 64) < 0)
+    {
+        std::cerr << "ERROR: Could not listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        close(listenFd);
+        return false;
+    }
+    if (pipe(m_wake) < 0)
+    {
+        std::cerr << "ERROR: Could not create a pipe: " << std::strerror(errno) << std::endl;
+        close(listenFd);
+        unlink(socketPath.c_str());
+        return false;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    fcntl(m_wake[0], F_SETFL, fcntl(m_wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(m_wake[1], F_SETFL, fcntl(m_wake[1], F_GETFL) | O_NONBLOCK);
+
+    /*
+     * SIGINT and SIGTERM stay blocked, in the workers too, except while ppoll() below waits, so that a signal
+     * arriving between the check of s_interrupted and the wait is not lost.
+     */
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    sigset_t stopSignals, previous;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &previous);
+    std::vector<std::thread> pool;
+    for (std::size_t i = 0; i < workers; ++i)
+        pool.emplace_back(&QueryServer::work, this);
+    std::cout << "Listening on " << socketPath << " with " << workers << " workers" << std::endl;
+
+    // Connections waiting for their next request. The others are queued for or held by a worker.
+    std::map<int, Connection> idle;
+    std::vector<pollfd> fds;
+    bool ok = true;
+    while (!s_interrupted)
+    {
+        fds.clear();
+        fds.push_back({listenFd, POLLIN, 0});
+        fds.push_back({m_wake[0], POLLIN, 0});
+        for (const auto& connection : idle)
+            fds.push_back({connection.first, POLLIN, 0});
+        if (ppoll(fds.data(), fds.size(), nullptr, &previous) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "ERROR: Could not wait for requests: " << std::strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+        if (fds[1].revents)
+        {
+            char drain[64];
+            while (read(m_wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        for (std::size_t i = 2; i < fds.size(); ++i)
+        {
+            if (!fds[i].revents)
+                continue;
+            auto it = idle.find(fds[i].fd);
+            m_ready.push(std::move(it->second));
+            idle.erase(it);
+            m_queueReady.notify_one();
+        }
+        for (Connection& connection : m_returned)
+            idle.emplace(connection.fd, std::move(connection));
+        m_returned.clear();
+        if (fds[0].revents)
+        {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd >= 0)
+                idle.emplace(fd, Connection{fd, std::string()});
+            else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+            {
+                std::cerr << "ERROR: Could not accept a connection: " << std::strerror(errno) << std::endl;
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        m_stopping = true;
+        // Wake the workers blocked sending a response to a client which does not read it.
+        for (int fd : m_active)
+            shutdown(fd, SHUT_RDWR);
+        while (!m_ready.empty())
+        {
+            close(m_ready.front().fd);
+            m_ready.pop();
+        }
+    }
+    m_queueReady.notify_all();
+    for (std::thread& t : pool)
+        t.join();
+    for (const auto& connection : idle)
+        close(connection.first);
+    for (const Connection& connection : m_returned)
+        close(connection.fd);
+    m_returned.clear();
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    close(m_wake[0]);
+    close(m_wake[1]);
+    close(listenFd);
+    unlink(socketPath.c_str());
+    std::cout << "Stopped." << std::endl;
+    return ok;
+}
@@ -0,0 +1,139 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HAPBIND_HPP
+#define HAPBIND_HPP
+
+#include "hapmap.hpp"
+#include "ehhfinder.hpp"
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Answers EHH, iHS and XP-EHH queries for populations held in memory over a Unix socket. Requests are single
+ * lines of whitespace separated words:
+ *
+ *     POPULATIONS
+ *     EHH <population> <locus id>
+ *     IHS <population> <locus id>
+ *     XPEHH <population A> <population B> <locus id>
+ *     QUIT
+ *
+ * Every response starts with a status line, either "OK <rows>" followed by that many tab separated rows, or
+ * "ERROR <message>". The rows are, respectively: name and number of haplotypes; index, id, genetic and
+ * physical position, EHH_0 and EHH_1 for every row of the EHH decay; frequency, iHH_0, iHH_1 and iHS; and
+ * iHH_A1, iHH_B1, iHH_P1 and XP-EHH. iHS and XP-EHH are unstandardized, as standardizing needs every locus.
+ *
+ * Connections are polled for requests, and each request is answered by one of a fixed pool of workers with its
+ * own EHHFinders, so idle connections do not hold on to a worker. Responses are kept in a cache of the most
+ * recently used ones.
+ */
+class QueryServer
+{
+public:
+    /**
+     * The EHHFinders of a worker, made when first needed: one per population and one per pair of populations.
+     */
+    struct Finders
+    {
+        std::vector<std::unique_ptr<EHHFinder>> ehh;
+        std::map<std::pair<std::size_t, std::size_t>, std::unique_ptr<EHHFinder>> xpehh;
+    };
+
+    QueryServer(double cutoff, double minMAF, double scale, unsigned long long maxExtend, bool binom, std::size_t cacheSize);
+    /**
+     * Load the population #name from #hap, with the positions from #map. Every population must have as many
+     * loci as the first.
+     */
+    bool addPopulation(const std::string& name, const std::string& hap, const std::string& map);
+    std::size_t numPopulations() const { return m_maps.size(); }
+    /**
+     * Serve connections to #socketPath with #workers workers until interrupted by SIGINT or SIGTERM. Any
+     * file at #socketPath is replaced, and removed again when done.
+     */
+    bool serve(const std::string& socketPath, std::size_t workers);
+    /**
+     * The response to the request #line, with its trailing newline.
+     */
+    std::string respond(const std::string& line, Finders& finders);
+
+protected:
+    /**
+     * A client connection and what has been read of its next request.
+     */
+    struct Connection
+    {
+        int fd;
+        std::string buffer;
+    };
+
+    void work();
+    /**
+     * Read from the readable #connection and answer one request if a whole one has arrived. Returns false if
+     * the connection is to be closed.
+     */
+    bool handle(Connection& connection, Finders& finders);
+    std::size_t population(const std::string& name) const;
+    bool cached(const std::string& key, std::string& response);
+    void cache(const std::string& key, const std::string& response);
+
+    double m_cutoff;
+    double m_minMAF;
+    double m_scale;
+    unsigned long long m_maxExtend;
+    bool m_binom;
+
+    std::vector<std::string> m_names;
+    std::vector<std::unique_ptr<HapMap>> m_maps;
+    /*
+     * Line of every locus id of the first population, as HapMap::idToLine() scans every id.
+     */
+    std::unordered_map<std::string, std::size_t> m_lines;
+
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueReady;
+    /*
+     * Connections with a request to answer, and those a worker has answered which serve() is to poll again,
+     * after being woken through m_wake.
+     */
+    std::queue<Connection> m_ready;
+    std::vector<Connection> m_returned;
+    std::set<int> m_active;
+    int m_wake[2];
+    bool m_stopping;
+
+    /*
+     * Least recently used cache of responses. The list holds the keys, most recently used first, and the map
+     * the response and position in the list of every key.
+     */
+    std::mutex m_cacheMutex;
+    std::size_t m_cacheSize;
+    std::list<std::string> m_lru;
+    std::unordered_map<std::string, std::pair<std::string, std::list<std::string>::iterator>> m_cache;
+};
+
+#endif // HAPBIND_HPP
@@ -18,6 +18,7 @@
  */
 
 #include "hapmap.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 
@@ -26,29 +27,51 @@ HapMap::HapMap()
     , m_physPos(nullptr)
     , m_genPos(nullptr)
     , m_numSnps{}
+    , m_firstLine{}
+    , m_endLine{}
     , m_data(nullptr)
     , m_snpLength{}
     , m_snpDataSize{}
     , m_snpDataSize64{}
     , m_snpDataSizeULL{}
+    , m_shared(nullptr)
 {
 
 }
 
 HapMap::~HapMap()
 {
-    aligned_free(m_data);
-    delete m_physPos;
-    delete m_genPos;
+    freeData();
+    freePositions();
 }
 
-void HapMap::loadMap(const char* mapFilename)
+void HapMap::freeData()
+{
+    if (m_shared)
+    {
+        m_physPos = nullptr;
+        m_genPos = nullptr;
+    }
+    else
+        aligned_free(m_data);
+    m_data = nullptr;
+}
+
+void HapMap::freePositions()
+{
+    if (!m_shared)
+    {
+        delete[] m_physPos;
+        delete[] m_genPos;
+    }
+    m_physPos = nullptr;
+    m_genPos = nullptr;
+}
+
+void HapMap::loadMap(const char* mapFilename, bool ids)
 {
     assert(m_numSnps != 0ULL); //Must loadHap first.
-    if (m_physPos)
-        delete m_physPos;
-    if (m_genPos)
-        delete m_genPos;
+    freePositions();
     m_physPos = new unsigned long long[m_numSnps];
     m_genPos = new double[m_numSnps];
         
@@ -68,7 +91,8 @@ void HapMap::loadMap(const char* mapFilename)
 	if (split.size() == 1)
             split = splitString(line, '\t');
         if (split.size() == 4) {
-            m_idMap[lineNum] = split[1];
+            if (ids)
+                m_idMap[lineNum] = split[1];
             m_genPos[lineNum] = atof(split[2].c_str());
             m_physPos[lineNum] = strtoull(split[3].c_str(), 0, 10);
             ++lineNum;
@@ -114,7 +138,28 @@ double HapMap::geneticPosition(std::size_t line) const
     return m_genPos[line];
 }
 
-std::string HapMap::lineToId(std::size_t line) const
+void HapMap::widenRange(std::size_t& first, std::size_t& end, unsigned long long distance, std::size_t rows) const
+{
+    /*
+     * Walks read two rows past the last position they integrate over, so the window always has two extra
+     * rows on each side.
+     */
+    if (distance == 0)
+    {
+        first = (first > rows + 2) ? first - rows - 2 : 0;
+        end = std::min(end + rows + 2, m_numSnps);
+        return;
+    }
+    std::size_t lo = first, hi = end;
+    while (lo > 0 && m_physPos[first] - m_physPos[lo] <= distance)
+        --lo;
+    while (hi < m_numSnps && m_physPos[hi-1] - m_physPos[end-1] <= distance)
+        ++hi;
+    first = (lo > 2) ? lo - 2 : 0;
+    end = std::min(hi + 2, m_numSnps);
+}
+
+const std::string& HapMap::lineToId(std::size_t line) const
 {
     return m_idMap.at(line);
 }
@@ -127,6 +172,15 @@ std::size_t HapMap::idToLine(const std::string& id) const
     return std::numeric_limits<std::size_t>::max();
 }
 
+std::unordered_map<std::string, std::size_t> HapMap::idIndex() const
+{
+    std::unordered_map<std::string, std::size_t> index;
+    index.reserve(m_idMap.size());
+    for (const auto& p : m_idMap)
+        index.emplace(p.second, p.first);
+    return index;
+}
+
 std::size_t HapMap::querySnpLength(const char* filename)
 {
     std::ifstream f(filename, std::ios::in | std::ios::binary);
@@ -182,7 +236,7 @@ bool HapMap::loadHap(const char* filename)
 
 bool HapMap::loadHapBinary(const char* filename)
 {
-    aligned_free(m_data);
+    freeData();
     
     std::ifstream f(filename, std::ios::in | std::ios::binary);
     if (!f.good())
@@ -206,6 +260,8 @@ bool HapMap::loadHapBinary(const char* filename)
     m_snpDataSize64 = ::bitsetSize<uint64_t>(m_snpLength);
     m_snpDataSizeULL = ::bitsetSize<unsigned long long>(m_snpLength);
     m_data = (PrimitiveType*) aligned_alloc(128, m_snpDataSize*m_numSnps*sizeof(PrimitiveType));
+    m_firstLine = 0;
+    m_endLine = m_numSnps;
     
     for(uint64_t i = 0; i < m_numSnps; ++i)
         f.read((char*) &m_data[i*this->m_snpDataSize], sizeof(uint64_t)*m_snpDataSize64);
@@ -215,7 +271,7 @@ bool HapMap::loadHapBinary(const char* filename)
 
 bool HapMap::loadHapAscii(const char* filename, std::size_t maxLength)
 {
-    aligned_free(m_data);
+    freeData();
     
     std::ifstream file(filename);
     if (!file.good())
@@ -241,6 +297,8 @@ bool HapMap::loadHapAscii(const char* filename, std::size_t maxLength)
      * Allocate memory aligned to 128 bytes (cache line). Must be aligned to at least 32 bytes for required AVX instructions.
      */
     m_data = (PrimitiveType*) aligned_alloc(128, m_snpDataSize*m_numSnps*sizeof(PrimitiveType));
+    m_firstLine = 0;
+    m_endLine = m_numSnps;
     
     for (size_t i = 0; i < this->m_snpDataSize*this->m_numSnps; ++i)
     {
@@ -17,6 +17,9 @@
  *
  */
 
+#ifndef HAPMAP_HPP
+#define HAPMAP_HPP
+
 #include <cstdint>
 #include <vector>
 #include <string>
@@ -24,13 +27,16 @@
 #include <fstream>
 #include <unordered_map>
 #include <map>
-#include "hapbin.hpp"
-
-#ifndef HAPMAP_HPP
-#define HAPMAP_HPP
-
+#include <memory>
 #include <stdexcept>
 #include <iostream>
+#include "hapbin.hpp"
+#if MPI_FOUND
+// Only the C API is used, and tools which do not link MPI include this header too.
+#define OMPI_SKIP_MPICXX 1
+#define MPICH_SKIP_MPICXX 1
+#include <mpi.h>
+#endif
 
 class HapMap
 {
@@ -49,12 +55,49 @@ public:
     static std::size_t querySnpLength(const char* filename);
     double geneticPosition(std::size_t line) const;
     long long unsigned int physicalPosition(std::size_t line) const;
-    void loadMap(const char* mapFileName);
-    std::string lineToId(std::size_t line) const;
+    /**
+     * Load the map. When #ids is false, only the positions are kept, which is enough for calculations on
+     * ranks which never write output.
+     */
+    void loadMap(const char* mapFileName, bool ids = true);
+    const std::string& lineToId(std::size_t line) const;
+    /**
+     * Widen the range of rows [first, end) by #rows on each side or, if #distance is not 0, by enough rows to
+     * cover #distance bp, which is as far as a walk limited by --max-extend can reach. Needs the map.
+     */
+    void widenRange(std::size_t& first, std::size_t& end, unsigned long long distance, std::size_t rows) const;
+    /**
+     * Line of the locus with the id #id, or std::numeric_limits<std::size_t>::max() if there is none. This
+     * scans every id, so callers looking up many ids should build an idIndex() once instead.
+     */
     std::size_t idToLine(const std::string& id) const;
+    /**
+     * Map from the id of every locus to its line, keeping the first line of ids given more than once as
+     * idToLine() does.
+     */
+    std::unordered_map<std::string, std::size_t> idIndex() const;
     bool loadHapBinary(const char* filename);
     bool loadHapAscii(const char* filename, std::size_t maxLength = 0);
     bool loadHap(const char* filename);
+#if MPI_FOUND
+    /**
+     * Load only the rows [first, end) of a binary hap file with an MPI-IO read. This is collective over
+     * #comm; pass MPI_COMM_SELF to grow a single rank's window. numSnps() is still the number of loci in
+     * the whole file, and a range of [0, 0) only reads the header.
+     */
+    bool loadHapBinaryRange(const char* filename, std::size_t first, std::size_t end, MPI_Comm comm);
+    /**
+     * Load the hap and map files into a segment shared by the ranks of #comm on the same node. Only one rank
+     * per node reads the files; the others map the same memory read-only. Collective over #comm. When #ids
+     * is false, the locus ids are not loaded on this rank, and a null #mapFilename loads no map at all.
+     */
+    bool loadShared(const char* hapFilename, const char* mapFilename, MPI_Comm comm, bool ids = true);
+    /**
+     * Release the segment of loadShared(). This is collective over the ranks which loaded it, so every one
+     * must call it at the same point, before the HapMap is destroyed. Does nothing for other maps.
+     */
+    void freeShared();
+#endif
     void save(const char* filename);
     
     std::size_t numSnps() const { return m_numSnps; }
@@ -63,22 +106,48 @@ public:
     std::size_t snpDataSize() const { return m_snpDataSize; }
     std::size_t snpDataSizeULL() const { return m_snpDataSizeULL; }
     std::size_t snpDataSize64() const { return m_snpDataSize64; }
+    /**
+     * The loaded rows are [firstLine(), endLine()), which is every row unless only a range was loaded.
+     */
+    std::size_t firstLine() const { return m_firstLine; }
+    std::size_t endLine() const { return m_endLine; }
+    /**
+     * The loaded rows, starting with row firstLine().
+     */
     PrimitiveType* rawData() { return m_data; }
+    /**
+     * The haplotypes at #line, which must be one of the loaded rows, in snpDataSize() words.
+     */
+    const PrimitiveType* row(std::size_t line) const { return &m_data[(line - m_firstLine)*m_snpDataSize]; }
+    /**
+     * Free the haplotypes once they have been used, keeping the positions and ids. Only for maps loaded by
+     * this process, not with loadShared().
+     */
+    void releaseHaplotypes() { freeData(); }
     ~HapMap();
     
     static const uint64_t magicNumber;
     
 protected:
+    void freeData();
+    void freePositions();
+
     std::map<std::size_t, std::string> m_idMap;
     unsigned long long* m_physPos;
     double* m_genPos;
     
     std::size_t m_numSnps;
+    std::size_t m_firstLine;
+    std::size_t m_endLine;
     PrimitiveType *m_data;
     std::size_t m_snpLength;
     std::size_t m_snpDataSize;
     std::size_t m_snpDataSize64;
     std::size_t m_snpDataSizeULL;
+    /**
+     * Set when the data and positions live in a shared segment, which only freeShared() releases.
+     */
+    void* m_shared;
 };
 
 #endif // CTCHAPM_HPP
@@ -0,0 +1,246 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "hapmap.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if MPI_FOUND
+
+bool HapMap::loadHapBinaryRange(const char* filename, std::size_t first, std::size_t end, MPI_Comm comm)
+{
+    MPI_File f;
+    if (MPI_File_open(comm, const_cast<char*>(filename), MPI_MODE_RDONLY, MPI_INFO_NULL, &f) != MPI_SUCCESS)
+    {
+        std::cerr << "ERROR: Cannot open file or file not found: " << filename << std::endl;
+        return false;
+    }
+
+    uint64_t header[3];
+    MPI_File_read_at_all(f, 0, header, 3, MPI_UINT64_T, MPI_STATUS_IGNORE);
+    if (header[0] != magicNumber)
+    {
+        std::cerr << "ERROR: Wrong file type: " << filename << ". Expected binary format." << std::endl;
+        MPI_File_close(&f);
+        return false;
+    }
+    m_numSnps = header[1];
+    setSnpLength(header[2]);
+    end = std::min<std::size_t>(end, m_numSnps);
+    first = std::min(first, end);
+
+    /*
+     * Rows are stored as snpDataSize64() words in the file but padded to snpDataSize() vectors in memory, so
+     * the range is read in one go and then spread out from the back.
+     */
+    std::size_t rows = end - first;
+    std::size_t rowWords = m_snpDataSize64;
+    std::size_t memWords = m_snpDataSize*sizeof(PrimitiveType)/sizeof(uint64_t);
+    PrimitiveType* data = (PrimitiveType*) aligned_alloc(128, std::max<std::size_t>(1, rows*m_snpDataSize)*sizeof(PrimitiveType));
+    uint64_t* words = (uint64_t*) data;
+    MPI_Offset offset = (3 + first*rowWords)*sizeof(uint64_t);
+    std::size_t total = rows*rowWords;
+    std::size_t done = 0;
+    /*
+     * MPI counts are ints, so very large ranges are read in several calls.
+     */
+    const std::size_t maxCount = 1ULL << 30;
+    int iterations = (int) ((total + maxCount - 1)/maxCount);
+    int maxIterations;
+    MPI_Allreduce(&iterations, &maxIterations, 1, MPI_INT, MPI_MAX, comm);
+    for (int i = 0; i < maxIterations; ++i)
+    {
+        int count = (int) std::min(maxCount, total - done);
+        MPI_File_read_at_all(f, offset + done*sizeof(uint64_t), words + done, count, MPI_UINT64_T, MPI_STATUS_IGNORE);
+        done += count;
+    }
+    MPI_File_close(&f);
+
+    if (memWords != rowWords)
+    {
+        for (std::size_t i = rows; i-- > 0;)
+        {
+            std::copy_backward(words + i*rowWords, words + (i+1)*rowWords, words + i*memWords + rowWords);
+            std::fill(words + i*memWords + rowWords, words + (i+1)*memWords, 0ULL);
+        }
+    }
+
+    freeData();
+    m_data = data;
+    m_firstLine = first;
+    m_endLine = end;
+    return true;
+}
+
+namespace
+{
+struct SharedSegment
+{
+    MPI_Win win;
+    MPI_Comm node;
+};
+}
+
+bool HapMap::loadShared(const char* hapFilename, const char* mapFilename, MPI_Comm comm, bool ids)
+{
+    freeShared();
+    MPI_Comm node;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    int nodeRank;
+    MPI_Comm_rank(node, &nodeRank);
+
+    /*
+     * The node leader reads the header, or the whole file when it is not in the binary format, and tells the
+     * others how large the segment is. A row count of zero tells them the file could not be read. Every rank
+     * of #comm gives up if any node could not read it, so that none is left waiting for the others.
+     */
+    std::ifstream f;
+    HapMap ascii;
+    uint64_t header[2] = {0, 0};
+    if (nodeRank == 0)
+    {
+        f.open(hapFilename, std::ios::in | std::ios::binary);
+        uint64_t check = 0;
+        f.read((char*) &check, sizeof(uint64_t));
+        if (!f.good())
+            std::cerr << "ERROR: Cannot open file or file not found: " << hapFilename << std::endl;
+        else if (check == magicNumber)
+            f.read((char*) header, 2*sizeof(uint64_t));
+        else if (ascii.loadHapAscii(hapFilename))
+        {
+            header[0] = ascii.numSnps();
+            header[1] = ascii.snpLength();
+        }
+    }
+    MPI_Bcast(header, 2, MPI_UINT64_T, 0, node);
+    int ok = header[0] != 0;
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    if (!ok)
+    {
+        MPI_Comm_free(&node);
+        return false;
+    }
+
+    freeData();
+    freePositions();
+    m_numSnps = header[0];
+    setSnpLength(header[1]);
+    m_firstLine = 0;
+    m_endLine = m_numSnps;
+
+    MPI_Aint dataBytes = m_snpDataSize*m_numSnps*sizeof(PrimitiveType);
+    MPI_Aint posBytes = mapFilename ? m_numSnps*(sizeof(unsigned long long) + sizeof(double)) : 0;
+    MPI_Win win;
+    char* base;
+    MPI_Win_allocate_shared(nodeRank == 0 ? dataBytes + posBytes + 128 : 0, 1, MPI_INFO_NULL, node, &base, &win);
+    if (nodeRank != 0)
+    {
+        MPI_Aint size;
+        int dispUnit;
+        MPI_Win_shared_query(win, 0, &size, &dispUnit, &base);
+    }
+    /*
+     * The segment is not necessarily aligned for vector loads, so the data starts at the same aligned offset
+     * on every rank.
+     */
+    int pad = (int) ((128 - (uintptr_t) base % 128) % 128);
+    MPI_Bcast(&pad, 1, MPI_INT, 0, node);
+    base += pad;
+    PrimitiveType* data = (PrimitiveType*) base;
+    unsigned long long* physPos = (unsigned long long*) (base + dataBytes);
+    double* genPos = (double*) (physPos + m_numSnps);
+
+    /*
+     * The leader's stores are made visible to the other ranks with a sync on each side of the broadcast of
+     * whether they succeeded, as the separate memory model requires. The segment is only read after that.
+     */
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    if (nodeRank == 0)
+    {
+        if (ascii.numSnps() > 0)
+            std::memcpy(data, ascii.m_data, dataBytes);
+        else
+        {
+            std::memset(data, 0, dataBytes);
+            for (uint64_t i = 0; i < m_numSnps && ok; ++i)
+            {
+                f.read((char*) &data[i*m_snpDataSize], sizeof(uint64_t)*m_snpDataSize64);
+                ok = f.good();
+            }
+            if (!ok)
+                std::cerr << "ERROR: " << hapFilename << " is shorter than its header says." << std::endl;
+        }
+        if (ok && mapFilename)
+        {
+            if (!std::ifstream(mapFilename).good())
+            {
+                std::cerr << "ERROR: Cannot open file or file not found: " << mapFilename << std::endl;
+                ok = 0;
+            }
+            else
+            {
+                loadMap(mapFilename, ids);
+                std::memcpy(physPos, m_physPos, m_numSnps*sizeof(unsigned long long));
+                std::memcpy(genPos, m_genPos, m_numSnps*sizeof(double));
+                freePositions();
+            }
+        }
+        MPI_Win_sync(win);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, comm);
+    MPI_Win_sync(win);
+    MPI_Win_unlock_all(win);
+    if (ok && nodeRank != 0 && mapFilename && ids)
+    {
+        loadMap(mapFilename, true);
+        freePositions();
+    }
+
+    SharedSegment* segment = new SharedSegment{win, node};
+    m_shared = segment;
+    m_data = data;
+    if (mapFilename)
+    {
+        m_physPos = physPos;
+        m_genPos = genPos;
+    }
+    if (!ok)
+    {
+        freeShared();
+        return false;
+    }
+    return true;
+}
+
+void HapMap::freeShared()
+{
+    if (!m_shared)
+        return;
+    SharedSegment* segment = (SharedSegment*) m_shared;
+    MPI_Win_free(&segment->win);
+    MPI_Comm_free(&segment->node);
+    delete segment;
+    m_shared = nullptr;
+    m_data = nullptr;
+    m_physPos = nullptr;
+    m_genPos = nullptr;
+    m_numSnps = 0;
+}
+
+#endif
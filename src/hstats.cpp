@@ -0,0 +1,205 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "hstats.hpp"
+#include "output.hpp"
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+HStatsFinder::HStatsFinder(const HapMap* hapmap)
+    : m_hapmap(hapmap)
+    , m_snpDataSize(hapmap->snpDataSize())
+    , m_parentCount(0)
+{
+#if VEC==4
+    m_mask = ::bitsetMask4(hapmap->snpLength());
+#elif VEC==2
+    m_mask = ::bitsetMask2(hapmap->snpLength());
+#else
+    m_mask = ::bitsetMask<HapMap::PrimitiveType>(hapmap->snpLength());
+#endif
+    /*
+     * Only groups of two or more haplotypes are refined, so there are never more than snpLength() groups
+     * after a split and the buffers never grow.
+     */
+    std::size_t maxBreadth = hapmap->snpLength() + 2;
+    m_parent = (HapMap::PrimitiveType*) aligned_alloc(128, m_snpDataSize*maxBreadth*sizeof(HapMap::PrimitiveType));
+    m_branch = (HapMap::PrimitiveType*) aligned_alloc(128, m_snpDataSize*maxBreadth*sizeof(HapMap::PrimitiveType));
+}
+
+HStatsFinder::~HStatsFinder()
+{
+    aligned_free(m_parent);
+    aligned_free(m_branch);
+}
+
+HStats HStatsFinder::find(std::size_t first, std::size_t last)
+{
+    const HapMap::PrimitiveType* core = m_hapmap->row(first);
+    std::size_t snpDataSizeULL = m_hapmap->snpDataSizeULL();
+    std::size_t singles = 0;
+
+    for (std::size_t j = 0; j < m_snpDataSize; ++j)
+    {
+        m_parent[j] = core[j];
+        m_parent[m_snpDataSize+j] = ~core[j];
+    }
+    m_parent[2*m_snpDataSize-1] &= m_mask;
+    m_parentCount = 2;
+
+    /*
+     * Each pass splits the groups by the next row and also counts the groups of the previous one, so the
+     * pass after the last row only counts.
+     */
+    for (std::size_t line = first + 1; line <= last + 1; ++line)
+    {
+        bool split = (line <= last);
+        const HapMap::PrimitiveType* row = m_hapmap->row(line);
+        std::size_t bcnt = 0;
+        if (!split)
+            m_counts.clear();
+        for (std::size_t i = 0; i < m_parentCount; ++i)
+        {
+            HapMap::PrimitiveType* parent = &m_parent[i*m_snpDataSize];
+            int count = 0;
+            unsigned long long *leaf = (unsigned long long*) parent;
+            for (std::size_t j = 0; j < snpDataSizeULL; ++j)
+                count += popcount1(leaf[j]);
+            if (count == 0)
+                continue;
+            if (count == 1)
+            {
+                ++singles;
+                continue;
+            }
+            if (!split)
+            {
+                m_counts.push_back(count);
+                continue;
+            }
+            for (std::size_t j = 0; j < m_snpDataSize; ++j)
+            {
+                m_branch[bcnt*m_snpDataSize+j] = parent[j] & row[j];
+                m_branch[(bcnt+1)*m_snpDataSize+j] = parent[j] & ~row[j];
+            }
+            bcnt += 2;
+        }
+        if (split)
+        {
+            std::swap(m_parent, m_branch);
+            m_parentCount = bcnt;
+        }
+    }
+
+    HStats ret;
+    ret.first = first;
+    ret.last = last;
+    ret.haplotypes = m_counts.size() + singles;
+    double n = (double) m_hapmap->snpLength();
+    for (std::size_t c : m_counts)
+        ret.H1 += (c/n)*(c/n);
+    ret.H1 += singles/(n*n);
+
+    // The two most common haplotypes, which are singletons if fewer than two are shared.
+    std::partial_sort(m_counts.begin(), m_counts.begin() + std::min<std::size_t>(2, m_counts.size()), m_counts.end(), [](std::size_t a, std::size_t b) { return a > b; });
+    double p1 = (m_counts.size() > 0) ? m_counts[0]/n : 1.0/n;
+    double p2 = (m_counts.size() > 1) ? m_counts[1]/n : ((m_counts.size() + singles > 1) ? 1.0/n : 0.0);
+    ret.H12 = ret.H1 + 2.0*p1*p2;
+    ret.H2H1 = (ret.H1 - p1*p1)/ret.H1;
+    return ret;
+}
+
+bool calcHStats(
+    const std::string& hap,
+    const std::string& map,
+    const std::string& outfile,
+    std::size_t window,
+    std::size_t step,
+    bool binary)
+{
+    HapMap hm;
+    if (!hm.loadHap(hap.c_str()))
+        return false;
+    hm.loadMap(map.c_str());
+    if (window > hm.numSnps())
+    {
+        std::cerr << "ERROR: The window of " << window << " loci is larger than the " << hm.numSnps() << " loci in " << hap << std::endl;
+        return false;
+    }
+#ifdef _OPENMP
+    std::cout << "Threads: " << omp_get_max_threads() << std::endl;
+#endif
+    auto start = std::chrono::high_resolution_clock::now();
+    std::size_t numWindows = (hm.numSnps() - window)/step + 1;
+    std::vector<HStats> results(numWindows);
+    #pragma omp parallel shared(hm, results)
+    {
+        HStatsFinder finder(&hm);
+        #pragma omp for schedule(dynamic,10)
+        for (std::size_t w = 0; w < numWindows; ++w)
+            results[w] = finder.find(w*step, w*step + window - 1);
+    }
+    auto tend = std::chrono::high_resolution_clock::now();
+    std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(tend - start).count() << "ms" << std::endl;
+
+    bool ok;
+    if (!binary)
+    {
+        std::map<std::size_t, HStats> rows;
+        for (const HStats& s : results)
+            rows.emplace_hint(rows.end(), s.first, s);
+        ok = writeRows(outfile, "First\tLast\tFirst ID\tLast ID\tHaplotypes\tH1\tH12\tH2/H1\n", rows, [&](TextBlock& out, std::size_t, const HStats& s) {
+            out << s.first << '\t' << s.last << '\t' << hm.lineToId(s.first) << '\t' << hm.lineToId(s.last) << '\t' << s.haplotypes
+                << '\t' << s.H1 << '\t' << s.H12 << '\t' << s.H2H1 << '\n';
+        });
+    }
+    else
+    {
+        std::vector<uint64_t> first, last, firstPos, lastPos, haplotypes;
+        std::vector<double> H1, H12, H2H1;
+        for (const HStats& s : results)
+        {
+            first.push_back(s.first);
+            last.push_back(s.last);
+            firstPos.push_back(hm.physicalPosition(s.first));
+            lastPos.push_back(hm.physicalPosition(s.last));
+            haplotypes.push_back(s.haplotypes);
+            H1.push_back(s.H1);
+            H12.push_back(s.H12);
+            H2H1.push_back(s.H2H1);
+        }
+        ColumnTable table;
+        table.add("First", std::move(first));
+        table.add("Last", std::move(last));
+        table.add("First Position", std::move(firstPos));
+        table.add("Last Position", std::move(lastPos));
+        table.add("Haplotypes", std::move(haplotypes));
+        table.add("H1", std::move(H1));
+        table.add("H12", std::move(H12));
+        table.add("H2/H1", std::move(H2H1));
+        ok = table.write(outfile);
+    }
+    std::cout << "# windows: " << numWindows << std::endl;
+    return ok;
+}
@@ -0,0 +1,79 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HSTATS_HPP
+#define HSTATS_HPP
+
+#include "hapmap.hpp"
+#include <string>
+#include <vector>
+
+/**
+ * Haplotype homozygosity statistics of Garud et al. (2015) for the rows [first, last] of a HapMap.
+ */
+struct HStats
+{
+    HStats() : first(0), last(0), haplotypes(0), H1(0.0), H12(0.0), H2H1(0.0) {}
+    std::size_t first;
+    std::size_t last;
+    /**
+     * Number of distinct haplotypes in the window.
+     */
+    std::size_t haplotypes;
+    double H1;
+    double H12;
+    double H2H1;
+};
+
+/**
+ * Groups the haplotypes which are identical over a window of rows by refining a partition one row at a
+ * time, as EHHFinder does but without splitting at a focus. Haplotypes left alone in a group are only
+ * counted, not refined further. Each thread needs its own HStatsFinder.
+ */
+class HStatsFinder
+{
+public:
+    explicit HStatsFinder(const HapMap* hapmap);
+    HStats find(std::size_t first, std::size_t last);
+    ~HStatsFinder();
+
+protected:
+    const HapMap* m_hapmap;
+    std::size_t m_snpDataSize;
+    HapMap::PrimitiveType m_mask;
+    HapMap::PrimitiveType* m_parent;
+    HapMap::PrimitiveType* m_branch;
+    std::size_t m_parentCount;
+    std::vector<std::size_t> m_counts;
+};
+
+/**
+ * Calculate H1, H12 and H2/H1 in windows of #window rows starting every #step rows, in parallel, and write
+ * them to #outfile as a table or, if #binary is set, as columns. Returns false if the input could not be read,
+ * the window is larger than the number of loci or the output could not be written.
+ */
+bool calcHStats(
+    const std::string& hap,
+    const std::string& map,
+    const std::string& outfile,
+    std::size_t window,
+    std::size_t step,
+    bool binary);
+
+#endif // HSTATS_HPP
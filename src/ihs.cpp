@@ -20,11 +20,78 @@
 #include "hapmap.hpp"
 #include "ihsfinder.hpp"
 #include "hapbin.hpp"
+#include "calcselect.hpp"
+#include "output.hpp"
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <memory>
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+bool writeIhsResults(
+    const std::string& outfile,
+    const HapMap& hm,
+    const IHSFinder::LineMap& res,
+    const IHSFinder::IhsInfoMap& unStd,
+    bool binary,
+    const IHSFinder::LineMap* stdNsl)
+{
+    if (!binary && !stdNsl)
+    {
+        return writeRows(outfile, "Index\tID\tFreq\tiHH_0\tiHH_1\tiHS\tStd iHS\n", res, [&](TextBlock& out, std::size_t line, double stdIhs) {
+            const IhsScore& s = unStd.at(line);
+            out << line << '\t' << hm.lineToId(line) << '\t' << s.freq << '\t' << s.iHH_0 << '\t' << s.iHH_1 << '\t' << s.iHS << '\t' << stdIhs << '\n';
+        });
+    }
+    if (!binary)
+    {
+        return writeRows(outfile, "Index\tID\tFreq\tiHH_0\tiHH_1\tiHS\tStd iHS\tSL_0\tSL_1\tnSL\tStd nSL\n", res, [&](TextBlock& out, std::size_t line, double stdIhs) {
+            const IhsScore& s = unStd.at(line);
+            out << line << '\t' << hm.lineToId(line) << '\t' << s.freq << '\t' << s.iHH_0 << '\t' << s.iHH_1 << '\t' << s.iHS << '\t' << stdIhs
+                << '\t' << s.SL_0 << '\t' << s.SL_1 << '\t' << s.nSL << '\t' << stdNsl->at(line) << '\n';
+        });
+    }
+    std::vector<uint64_t> index, position;
+    std::vector<double> freq, iHH_0, iHH_1, iHS, stdIHS, SL_0, SL_1, nSL, stdNSL;
+    for (const auto& it : res)
+    {
+        const IhsScore& s = unStd.at(it.first);
+        index.push_back(it.first);
+        position.push_back(hm.physicalPosition(it.first));
+        freq.push_back(s.freq);
+        iHH_0.push_back(s.iHH_0);
+        iHH_1.push_back(s.iHH_1);
+        iHS.push_back(s.iHS);
+        stdIHS.push_back(it.second);
+        if (stdNsl)
+        {
+            SL_0.push_back(s.SL_0);
+            SL_1.push_back(s.SL_1);
+            nSL.push_back(s.nSL);
+            stdNSL.push_back(stdNsl->at(it.first));
+        }
+    }
+    ColumnTable table;
+    table.add("Index", std::move(index));
+    table.add("Position", std::move(position));
+    table.add("Freq", std::move(freq));
+    table.add("iHH_0", std::move(iHH_0));
+    table.add("iHH_1", std::move(iHH_1));
+    table.add("iHS", std::move(iHS));
+    table.add("Std iHS", std::move(stdIHS));
+    if (stdNsl)
+    {
+        table.add("SL_0", std::move(SL_0));
+        table.add("SL_1", std::move(SL_1));
+        table.add("nSL", std::move(nSL));
+        table.add("Std nSL", std::move(stdNSL));
+    }
+    return table.write(outfile);
+}
+
 void calcIhsNoMpi(
     const std::string& hap,
     const std::string& map,
@@ -34,7 +101,8 @@ void calcIhsNoMpi(
     double scale,
     unsigned long long maxExtend,
     int bins,
-    bool binom)
+    bool binom,
+    const RunOptions& options)
 {
     HapMap hm;
     if (!hm.loadHap(hap.c_str()))
@@ -48,29 +116,276 @@ void calcIhsNoMpi(
     hm.loadMap(map.c_str());
     auto start = std::chrono::high_resolution_clock::now();
     IHSFinder *ihsfinder = new IHSFinder(hm.snpLength(), cutoff, minMAF, scale, maxExtend, bins);
-    if (binom)
-        ihsfinder->run<true>(&hm, 0ULL, hm.numSnps());
+    ihsfinder->setProgress(options.progressInterval, options.metricsFile);
+    ihsfinder->setTracing(!options.traceFile.empty());
+    ihsfinder->setNsl(options.nsl);
+    if (!options.checkpointFile.empty())
+    {
+        if (options.resume && std::ifstream(options.checkpointFile).good())
+        {
+            if (!ihsfinder->loadCheckpoint(options.checkpointFile, false, binom))
+            {
+                delete ihsfinder;
+                return;
+            }
+            std::cout << "Resuming with " << ihsfinder->numDone() << " loci completed." << std::endl;
+        }
+        ihsfinder->setCheckpoint(options.checkpointFile, options.checkpointInterval);
+    }
+    if (!options.mergeFiles.empty())
+    {
+        for (const auto& file : options.mergeFiles)
+        {
+            if (!ihsfinder->loadCheckpoint(file, false, binom))
+            {
+                delete ihsfinder;
+                return;
+            }
+        }
+        if (ihsfinder->numDone() < hm.numSnps())
+            std::cerr << "WARNING: The merged files only cover " << ihsfinder->numDone() << " of " << hm.numSnps() << " loci." << std::endl;
+    }
     else
-        ihsfinder->run<false>(&hm, 0ULL, hm.numSnps());
+    {
+        std::size_t first, last;
+        options.range(hm.numSnps(), first, last);
+        if (binom)
+            ihsfinder->run<true>(&hm, first, last);
+        else
+            ihsfinder->run<false>(&hm, first, last);
+    }
+
+    if (options.partial)
+    {
+        if (!options.traceFile.empty())
+            ihsfinder->writeTraces(options.traceFile);
+        if (ihsfinder->saveCheckpoint(outfile, false, binom))
+            std::cout << "Wrote partial results for " << ihsfinder->numDone() << " loci to " << outfile << std::endl;
+        delete ihsfinder;
+        return;
+    }
     IHSFinder::LineMap res = ihsfinder->normalize();
+    IHSFinder::LineMap nsl;
+    if (options.nsl)
+        nsl = ihsfinder->normalizeNSL();
+
+    if (!options.traceFile.empty())
+        ihsfinder->writeTraces(options.traceFile);
 
     auto tend = std::chrono::high_resolution_clock::now();
     auto diff = tend - start;
     std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(diff).count() << "ms" << std::endl;
 
-    auto unStd = ihsfinder->unStdIHSByLine();
-
-    std::ofstream out2(outfile);
-    out2 << "Index\tID\tFreq\tiHH_0\tiHH_1\tiHS\tStd iHS" << std::endl;
-
-    for (const auto& it : res)
-    {
-        auto s = unStd[it.first];
-        out2 << it.first << '\t' << hm.lineToId(it.first) << '\t' << s.freq << '\t' << s.iHH_0 << '\t' << s.iHH_1 << '\t' << s.iHS << "\t" << it.second << std::endl;
-    }
+    writeIhsResults(outfile, hm, res, ihsfinder->unStdIHSByLine(), options.binaryOutput, options.nsl ? &nsl : nullptr);
     std::cout << "# valid loci: " << res.size() << std::endl;
     std::cout << "# loci with MAF <= " << minMAF << ": " << ihsfinder->numOutsideMaf() << std::endl;
     std::cout << "# loci with NaN result: " << ihsfinder->numNanResults() << std::endl;
     std::cout << "# loci which reached the end of the chromosome: " << ihsfinder->numReachedEnd() << std::endl;
     delete ihsfinder;
 }
+
+void calcIhsSweep(
+    const std::string& hap,
+    const std::string& map,
+    const std::string& outfile,
+    const std::vector<double>& cutoffs,
+    const std::vector<unsigned long long>& maxExtends,
+    const std::vector<bool>& binoms,
+    double minMAF,
+    double scale,
+    int bins,
+    const RunOptions& options)
+{
+    HapMap hm;
+    if (!hm.loadHap(hap.c_str()))
+    {
+        return;
+    }
+
+#ifdef _OPENMP
+    std::cout << "Threads: " << omp_get_max_threads() << std::endl;
+#endif
+    hm.loadMap(map.c_str());
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<EHHFinder::SweepSetting> settings;
+    std::vector<std::string> files;
+    std::vector<std::unique_ptr<IHSFinder>> results;
+    std::vector<IHSFinder*> resultPtrs;
+    for (double cutoff : cutoffs)
+    {
+        for (unsigned long long maxExtend : maxExtends)
+        {
+            for (bool binom : binoms)
+            {
+                settings.push_back(EHHFinder::SweepSetting{cutoff, maxExtend, binom});
+                std::ostringstream file;
+                file << outfile << ".c" << cutoff << "-e" << maxExtend << (binom ? "-binom" : "");
+                files.push_back(file.str());
+                results.emplace_back(new IHSFinder(hm.snpLength(), cutoff, minMAF, scale, maxExtend, bins));
+                resultPtrs.push_back(results.back().get());
+            }
+        }
+    }
+    IHSFinder walker(hm.snpLength(), cutoffs[0], minMAF, scale, maxExtends[0], bins);
+    walker.setProgress(options.progressInterval, options.metricsFile);
+    walker.setTracing(!options.traceFile.empty());
+    walker.runSweep(&hm, settings, resultPtrs);
+    if (!options.traceFile.empty())
+        walker.writeTraces(options.traceFile);
+
+    auto tend = std::chrono::high_resolution_clock::now();
+    std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(tend - start).count() << "ms" << std::endl;
+
+    for (std::size_t s = 0; s < settings.size(); ++s)
+    {
+        IHSFinder::LineMap res = results[s]->normalize();
+        writeIhsResults(files[s], hm, res, results[s]->unStdIHSByLine(), options.binaryOutput);
+        std::cout << files[s] << ": " << res.size() << " valid loci, " << results[s]->numOutsideMaf() << " with MAF <= " << minMAF
+                  << ", " << results[s]->numNanResults() << " NaN, " << results[s]->numReachedEnd() << " reached the end of the chromosome" << std::endl;
+    }
+}
+
+struct BatchEntry
+{
+    std::string hap;
+    std::string map;
+    std::string out;
+};
+
+static bool readManifest(const std::string& filename, std::vector<BatchEntry>& entries)
+{
+    std::ifstream f(filename);
+    if (!f.good())
+    {
+        std::cerr << "ERROR: Cannot open file or file not found: " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    std::size_t lineNum = 0;
+    while (std::getline(f, line))
+    {
+        ++lineNum;
+        std::istringstream fields(line);
+        BatchEntry e;
+        if (!(fields >> e.hap) || e.hap[0] == '#')
+            continue;
+        if (!(fields >> e.map >> e.out))
+        {
+            std::cerr << "ERROR: Line " << lineNum << " of " << filename << " must list a hap file, a map file and an output file." << std::endl;
+            return false;
+        }
+        entries.push_back(e);
+    }
+    if (entries.empty())
+    {
+        std::cerr << "ERROR: No chromosomes listed in " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static std::unique_ptr<HapMap> loadChromosome(const BatchEntry& entry)
+{
+    std::unique_ptr<HapMap> hm(new HapMap());
+    if (!hm->loadHap(entry.hap.c_str()))
+        return nullptr;
+    hm->loadMap(entry.map.c_str());
+    return hm;
+}
+
+void calcIhsBatch(
+    const std::string& manifest,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    int bins,
+    bool binom,
+    const RunOptions& options)
+{
+    std::vector<BatchEntry> entries;
+    if (!readManifest(manifest, entries))
+        return;
+
+#ifdef _OPENMP
+    std::cout << "Threads: " << omp_get_max_threads() << std::endl;
+#endif
+    auto start = std::chrono::high_resolution_clock::now();
+    /*
+     * Genome-wide standardization needs the bins of every chromosome first, so their results and maps are
+     * kept until the end. The haplotypes are always freed as soon as a chromosome is done.
+     */
+    std::vector<std::unique_ptr<IHSFinder>> finders;
+    std::vector<std::unique_ptr<HapMap>> maps;
+    IHSFinder::MomentsByBin moments, nslMoments;
+    std::future<std::unique_ptr<HapMap>> next = std::async(std::launch::async, loadChromosome, std::cref(entries[0]));
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        std::unique_ptr<HapMap> hm = next.get();
+        if (!hm)
+            return;
+        // The next chromosome is read while this one keeps the OpenMP team busy.
+        if (i + 1 < entries.size())
+            next = std::async(std::launch::async, loadChromosome, std::cref(entries[i+1]));
+
+        std::cout << "Chromosome " << i + 1 << " of " << entries.size() << ": " << entries[i].hap << std::endl;
+        std::unique_ptr<IHSFinder> ihsfinder(new IHSFinder(hm->snpLength(), cutoff, minMAF, scale, maxExtend, bins));
+        // Each chromosome writes its metrics to a file of its own, as MPI ranks do.
+        std::string metricsFile = options.metricsFile;
+        if (!metricsFile.empty() && entries.size() > 1)
+            metricsFile += "." + std::to_string(i + 1);
+        ihsfinder->setProgress(options.progressInterval, metricsFile);
+        ihsfinder->setNsl(options.nsl);
+        if (binom)
+            ihsfinder->run<true>(hm.get(), 0, hm->numSnps());
+        else
+            ihsfinder->run<false>(hm.get(), 0, hm->numSnps());
+        hm->releaseHaplotypes();
+
+        if (options.genomeWide)
+        {
+            IHSFinder::MomentsByBin m = ihsfinder->ihsMoments();
+            if (moments.empty())
+                moments.resize(m.size());
+            for (std::size_t b = 0; b < m.size(); ++b)
+                moments[b].merge(m[b]);
+            if (options.nsl)
+            {
+                m = ihsfinder->nslMoments();
+                if (nslMoments.empty())
+                    nslMoments.resize(m.size());
+                for (std::size_t b = 0; b < m.size(); ++b)
+                    nslMoments[b].merge(m[b]);
+            }
+            finders.push_back(std::move(ihsfinder));
+            maps.push_back(std::move(hm));
+            continue;
+        }
+        IHSFinder::LineMap res = ihsfinder->normalize();
+        IHSFinder::LineMap nsl;
+        if (options.nsl)
+            nsl = ihsfinder->normalizeNSL();
+        writeIhsResults(entries[i].out, *hm, res, ihsfinder->unStdIHSByLine(), options.binaryOutput, options.nsl ? &nsl : nullptr);
+        std::cout << "# valid loci: " << res.size() << std::endl;
+        std::cout << "# loci with MAF <= " << minMAF << ": " << ihsfinder->numOutsideMaf() << std::endl;
+        std::cout << "# loci with NaN result: " << ihsfinder->numNanResults() << std::endl;
+        std::cout << "# loci which reached the end of the chromosome: " << ihsfinder->numReachedEnd() << std::endl;
+    }
+
+    for (std::size_t i = 0; i < finders.size(); ++i)
+    {
+        IHSFinder::LineMap res = finders[i]->normalize(moments);
+        IHSFinder::LineMap nsl;
+        if (options.nsl)
+            nsl = finders[i]->normalizeNSL(nslMoments);
+        writeIhsResults(entries[i].out, *maps[i], res, finders[i]->unStdIHSByLine(), options.binaryOutput, options.nsl ? &nsl : nullptr);
+        std::cout << "Chromosome " << i + 1 << " of " << entries.size() << ": " << entries[i].out << std::endl;
+        std::cout << "# valid loci: " << res.size() << std::endl;
+        std::cout << "# loci with MAF <= " << minMAF << ": " << finders[i]->numOutsideMaf() << std::endl;
+        std::cout << "# loci with NaN result: " << finders[i]->numNanResults() << std::endl;
+        std::cout << "# loci which reached the end of the chromosome: " << finders[i]->numReachedEnd() << std::endl;
+    }
+
+    auto tend = std::chrono::high_resolution_clock::now();
+    std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(tend - start).count() << "ms" << std::endl;
+}
@@ -21,11 +21,15 @@
 #include "hapmap.hpp"
 #include "ihsfinder.hpp"
 #include "hapbin.hpp"
+#include "calcselect.hpp"
+#include "output.hpp"
 #include "ehh.hpp"
 
 #if MPI_FOUND
 #include "mpirpc/manager.hpp"
+#include "mpirpc/counter.hpp"
 #include "mpirpc/parameterstream.hpp"
+#include "mpirpc/reduce.hpp"
 
 ParameterStream& operator<<(ParameterStream& out, const IhsScore& info)
 {
@@ -38,9 +42,25 @@ ParameterStream& operator>>(ParameterStream& in, IhsScore& info)
     in >> info.iHS >> info.iHH_0 >> info.iHH_1 >> info.freq;
     return in;
 }
+
+ParameterStream& operator<<(ParameterStream& out, const IhsBlock& block)
+{
+    out << block.start << block.end << block.reachedEnd << block.outsideMaf << block.nanResults;
+    out << block.lines << block.binFreq << block.iHS << block.iHH_0 << block.iHH_1 << block.freq;
+    return out;
+}
+
+ParameterStream& operator>>(ParameterStream& in, IhsBlock& block)
+{
+    in >> block.start >> block.end >> block.reachedEnd >> block.outsideMaf >> block.nanResults;
+    in >> block.lines >> block.binFreq >> block.iHS >> block.iHH_0 >> block.iHH_1 >> block.freq;
+    return in;
+}
 #endif
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -56,22 +76,96 @@ void calcIhsMpi(
     double scale,
     unsigned long long maxExtend,
     int binFactor,
-    bool binom)
+    bool binom,
+    const RunOptions& options)
 {
 #if MPI_FOUND
     std::cout << "Calculating iHS using MPI." << std::endl;
+    mpirpc::Manager *manager = new mpirpc::Manager();
     HapMap hap;
-    if (!hap.loadHap(hapfile.c_str()))
+    /*
+     * With --partition-load, each rank calculates a fixed slice of the loci and only reads the rows of the
+     * slice plus a halo the walks can reach. A walk that reaches the edge of the halo anyway makes the rank
+     * double its halo and calculate the locus again.
+     */
+    std::size_t sliceStart = 0, sliceEnd = 0;
+    unsigned long long haloDistance = maxExtend;
+    std::size_t haloRows = options.halo;
+    auto loadWindow = [&](MPI_Comm comm) {
+        std::size_t first = sliceStart, end = sliceEnd;
+        hap.widenRange(first, end, haloDistance, haloRows);
+        if (!hap.loadHapBinaryRange(hapfile.c_str(), first, end, comm))
+            return false;
+        std::cout << "Rank " << manager->rank() << " loaded rows " << first << " to " << end << " for loci " << sliceStart << " to " << sliceEnd << "." << std::endl;
+        return true;
+    };
+    if (options.partitionLoad)
     {
-        return;
+        if (!hap.loadHapBinaryRange(hapfile.c_str(), 0, 0, manager->comm()))
+        {
+            delete manager;
+            return;
+        }
+        hap.loadMap(mapfile.c_str(), manager->rank() == 0 || options.distributed);
+        splitRange(hap.numSnps(), manager->rank(), manager->numProcs(), sliceStart, sliceEnd);
+        if (!loadWindow(manager->comm()))
+        {
+            delete manager;
+            return;
+        }
+    }
+    else if (options.sharedMemory)
+    {
+        if (!hap.loadShared(hapfile.c_str(), mapfile.c_str(), manager->comm(), manager->rank() == 0 || options.distributed))
+        {
+            delete manager;
+            return;
+        }
+    }
+    else
+    {
+        if (!hap.loadHap(hapfile.c_str()))
+        {
+            delete manager;
+            return;
+        }
+        hap.loadMap(mapfile.c_str());
     }
     std::cout << "Loaded " << hap.numSnps() << " snps." << std::endl;
     std::cout << "Haplotype count: " << hap.snpLength() << " " << maxExtend << std::endl;
-    hap.loadMap(mapfile.c_str());
     IHSFinder *ihsfinder = new IHSFinder(hap.snpLength(), cutoff, minMAF, scale, maxExtend, binFactor);
-    mpirpc::Manager *manager = new mpirpc::Manager();
-    int procsToGo = manager->numProcs();
+    std::atomic<int> procsToGo(manager->numProcs());
     std::cout << "Processes: " << procsToGo << std::endl;
+    std::string metricsFile = options.metricsFile;
+    if (!metricsFile.empty() && manager->numProcs() > 1)
+        metricsFile += "." + std::to_string(manager->rank());
+    ihsfinder->setProgress(options.progressInterval, metricsFile, "Rank " + std::to_string(manager->rank()));
+    ihsfinder->setTracing(!options.traceFile.empty());
+    /*
+     * Loci are handed out in chunks from a counter shared by all ranks, so every rank, including rank 0,
+     * keeps taking work until none is left. The results of every chunk are sent to rank 0 as soon as it is
+     * done, so only rank 0 writes a checkpoint. On resume, every rank loads it to skip the loci already done.
+     */
+    ihsfinder->prepareDone(hap.numSnps());
+    if (!options.checkpointFile.empty())
+    {
+        if (options.resume && std::ifstream(options.checkpointFile).good())
+        {
+            if (!ihsfinder->loadCheckpoint(options.checkpointFile, false, binom))
+            {
+                hap.freeShared();
+                delete ihsfinder;
+                delete manager;
+                return;
+            }
+            if (manager->rank() == 0)
+                std::cout << "Resuming with " << ihsfinder->numDone() << " loci completed." << std::endl;
+            else
+                ihsfinder->releaseResults();
+        }
+        if (manager->rank() == 0)
+            ihsfinder->setCheckpoint(options.checkpointFile, options.checkpointInterval);
+    }
 #ifdef _OPENMP
     std::cout << "Threads: " << omp_get_max_threads() << std::endl;
 #endif
@@ -94,56 +188,148 @@ void calcIhsMpi(
     }
     manager->barrier();
     mpirpc::ObjectWrapperBase* mainihsfinder = *(manager->getObjectsOfType<IHSFinder>().cbegin());
-    mpirpc::FunctionHandle runEHH =  manager->registerLambda([&](std::size_t start, std::size_t end) {
-        std::cout << "Computing EHH for " << (end-start) << " lines on rank " << manager->rank() << std::endl;
-        if (binom)
-            ihsfinder->run<true>(&hap, start, end);
-        else
-            ihsfinder->run<false>(&hap, start, end);
-        IHSFinder::LineMap fbl = ihsfinder->freqsByLine();
-        manager->invokeFunction(mainihsfinder, &IHSFinder::addData, false, fbl, ihsfinder->unStdIHSByLine(), ihsfinder->unStdIHSByFreq(), ihsfinder->numReachedEnd(), ihsfinder->numOutsideMaf(), ihsfinder->numNanResults());
-        manager->invokeFunction(0, done);
-    });
-    manager->barrier();
-
-    auto start = std::chrono::high_resolution_clock::now();
 
-    if (manager->rank() == 0)
-    {
-        std::size_t numSnps = hap.numSnps();
-        std::size_t snpsPerRank = numSnps/manager->numProcs();
-        std::size_t pos = 0ULL;
-        for (int i = 1; i < manager->numProcs(); ++i)
+    std::size_t numSnps = hap.numSnps();
+    std::size_t chunkSize = options.chunkSize;
+    if (chunkSize == 0)
+        chunkSize = std::max<std::size_t>(1, numSnps/(16*manager->numProcs()));
+    std::size_t batchSize = options.batchSize > 0 ? options.batchSize : chunkSize;
+    mpirpc::SharedCounter *counter = new mpirpc::SharedCounter(manager->comm());
+    std::size_t nextInSlice = sliceStart;
+    std::size_t limit = options.partitionLoad ? sliceEnd : numSnps;
+    std::size_t chunkStart = 0, chunkEnd = 0;
+    bool progressThread = false;
+    std::vector<std::size_t> chunkStarts;
+    unsigned long long sentReachedEnd = ihsfinder->numReachedEnd();
+    unsigned long long sentOutsideMaf = ihsfinder->numOutsideMaf();
+    unsigned long long sentNanResults = ihsfinder->numNanResults();
+    IHSFinder::ChunkSource nextChunk = [&](std::size_t& s, std::size_t& e) {
+        if (ihsfinder->numWindowEdge() > 0)
+        {
+            haloDistance *= 2;
+            haloRows *= 2;
+            ihsfinder->clearWindowEdge();
+            if (!loadWindow(MPI_COMM_SELF))
+                MPI_Abort(manager->comm(), 1);
+            s = chunkStart;
+            e = chunkEnd;
+            return true;
+        }
+        if (!options.distributed && manager->rank() != 0 && chunkEnd > chunkStart)
         {
-            std::size_t start = snpsPerRank*i;
-            std::size_t end = snpsPerRank*(i+1);
-            if (i == manager->numProcs()-1)
+            /*
+             * The results are sent in batches of at most batchSize loci and then dropped, so neither the
+             * messages nor the memory of this rank grow with the number of loci.
+             */
+            for (std::size_t batch = chunkStart; batch < chunkEnd; batch += batchSize)
             {
-                end = numSnps;
+                IhsBlock block = ihsfinder->ihsBlock(batch, std::min(batch + batchSize, chunkEnd));
+                block.reachedEnd = ihsfinder->numReachedEnd() - sentReachedEnd;
+                block.outsideMaf = ihsfinder->numOutsideMaf() - sentOutsideMaf;
+                block.nanResults = ihsfinder->numNanResults() - sentNanResults;
+                manager->invokeFunction(mainihsfinder, &IHSFinder::addData, false, block);
+                sentReachedEnd = ihsfinder->numReachedEnd();
+                sentOutsideMaf = ihsfinder->numOutsideMaf();
+                sentNanResults = ihsfinder->numNanResults();
             }
-            manager->invokeFunction(i, runEHH, start, end);
-            manager->checkMessages();
+            ihsfinder->releaseResults();
         }
-        while (manager->queueSize() > 0) {
+        if (!progressThread)
             manager->checkMessages();
+        if (options.partitionLoad)
+        {
+            chunkStart = nextInSlice;
+            nextInSlice += chunkSize;
         }
-        std::size_t end = snpsPerRank;
-        if (manager->numProcs() == 1)
-            end = numSnps;
-        if (binom)
-            ihsfinder->run<true>(&hap, 0UL, end);
         else
-            ihsfinder->run<false>(&hap, 0UL, end);
+            chunkStart = counter->fetchAdd(chunkSize);
+        if (chunkStart >= limit)
+        {
+            chunkStart = chunkEnd = 0;
+            return false;
+        }
+        chunkEnd = std::min(chunkStart + chunkSize, limit);
+        chunkStarts.push_back(chunkStart);
+        s = chunkStart;
+        e = chunkEnd;
+        return true;
+    };
+    manager->barrier();
+    /*
+     * Rank 0 merges the results of other ranks on a progress thread, so its own OpenMP team does not wait
+     * for them between chunks.
+     */
+    progressThread = options.progressThread && manager->rank() == 0 && manager->numProcs() > 1 && manager->startProgressThread();
+    if (progressThread)
+        std::cout << "Handling results on a progress thread." << std::endl;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (binom)
+        ihsfinder->run<true>(&hap, nextChunk, 0);
+    else
+        ihsfinder->run<false>(&hap, nextChunk, 0);
+    if (progressThread)
+        manager->stopProgressThread();
+    if (manager->rank() == 0)
         --procsToGo;
-    }
+    else
+        manager->invokeFunction(0, done);
 
-    while(manager->checkMessages())
+    while(manager->waitMessages())
     {
         if (procsToGo == 0)
             manager->shutdown();
     }
+    delete counter;
 
-    if (manager->rank() == 0)
+    if (manager->rank() == 0 && !options.checkpointFile.empty())
+        ihsfinder->saveCheckpoint(options.checkpointFile, false, binom);
+
+    if (!options.traceFile.empty())
+        ihsfinder->writeTraces(manager->numProcs() > 1 ? options.traceFile + "." + std::to_string(manager->rank()) : options.traceFile);
+
+    if (options.distributed)
+    {
+        /*
+         * Every rank standardizes the loci it calculated and writes their rows. The rows are grouped by the
+         * chunk they were calculated in, which is where they go in the output.
+         */
+        IHSFinder::LineMap res = ihsfinder->normalize(allreduceMoments(ihsfinder->ihsMoments(), manager->comm()));
+        IHSFinder::IhsInfoMap unStd = ihsfinder->unStdIHSByLine();
+        std::map<std::size_t, std::string> pieces;
+        TextBlock piece;
+        std::size_t key = 0;
+        for (const auto& it : res)
+        {
+            std::size_t chunk = *(std::upper_bound(chunkStarts.begin(), chunkStarts.end(), it.first) - 1);
+            if (chunk != key && piece.size() > 0)
+            {
+                pieces[key] = piece.str();
+                piece.clear();
+            }
+            key = chunk;
+            const IhsScore& s = unStd.at(it.first);
+            piece << it.first << '\t' << hap.lineToId(it.first) << '\t' << s.freq << '\t' << s.iHH_0 << '\t' << s.iHH_1 << '\t' << s.iHS << '\t' << it.second << '\n';
+        }
+        if (piece.size() > 0)
+            pieces[key] = piece.str();
+        writeOrdered(outfile, "Index\tID\tFreq\tiHH_0\tiHH_1\tiHS\tStd iHS\n", pieces, manager->comm());
+        unsigned long valid = mpirpc::allreduce((unsigned long) res.size(), MPI_SUM, 1, manager->comm());
+        unsigned long outsideMaf = mpirpc::allreduce((unsigned long) ihsfinder->numOutsideMaf(), MPI_SUM, 1, manager->comm());
+        unsigned long nanResults = mpirpc::allreduce((unsigned long) ihsfinder->numNanResults(), MPI_SUM, 1, manager->comm());
+        unsigned long reachedEnd = mpirpc::allreduce((unsigned long) ihsfinder->numReachedEnd(), MPI_SUM, 1, manager->comm());
+        if (manager->rank() == 0)
+        {
+            auto end = std::chrono::high_resolution_clock::now();
+            std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(end - start).count() << "ms" << std::endl;
+            std::cout << "# valid loci: " << valid << std::endl;
+            std::cout << "# loci with MAF <= " << minMAF << ": " << outsideMaf << std::endl;
+            std::cout << "# loci with NaN result: " << nanResults << std::endl;
+            std::cout << "# loci which reached the end of the chromosome: " << reachedEnd << std::endl;
+        }
+    }
+    else if (manager->rank() == 0)
     {
         auto end = std::chrono::high_resolution_clock::now();
         auto diff = end - start;
@@ -151,28 +337,14 @@ void calcIhsMpi(
 
         IHSFinder::LineMap res = ihsfinder->normalize();
 
-        auto unStd = ihsfinder->unStdIHSByLine();
-
-        /*std::ofstream out(outfile);
-        out << "Location\tiHH_0\tiHH_1\tiHS" << std::endl;
-        for (const auto& it : unStd)
-        {
-            out << hap.lineToId(it.first) << '\t' << it.second.iHH_0 << '\t' << it.second.iHH_1 << '\t' << it.second.iHS << std::endl;
-        }*/
-        std::ofstream out2(outfile);
-        out2 << "Index\tID\tFreq\tiHH_0\tiHH_1\tiHS\tStd iHS" << std::endl;
-
-        for (const auto& it : res)
-        {
-            auto s = unStd[it.first];
-            out2 << it.first << '\t' << hap.lineToId(it.first) << '\t' << s.freq << '\t' << s.iHH_0 << '\t' << s.iHH_1 << '\t' << s.iHS << "\t" << it.second << std::endl;
-        }
+        writeIhsResults(outfile, hap, res, ihsfinder->unStdIHSByLine(), options.binaryOutput);
         std::cout << "# valid loci: " << res.size() << std::endl;
         std::cout << "# loci with MAF <= " << minMAF << ": " << ihsfinder->numOutsideMaf() << std::endl;
         std::cout << "# loci with NaN result: " << ihsfinder->numNanResults() << std::endl;
         std::cout << "# loci which reached the end of the chromosome: " << ihsfinder->numReachedEnd() << std::endl;
     }
 
+    hap.freeShared();
     delete ihsfinder;
     delete manager;
 #else
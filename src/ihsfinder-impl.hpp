@@ -20,43 +20,178 @@
 template <bool Binom>
 void IHSFinder::runXpehh(HapMap* mA, HapMap* mB, std::size_t start, std::size_t end)
 {
-    #pragma omp parallel shared(mA,mB,start,end)
+    prepareDone(mA->numSnps());
+    runXpehh<Binom>(mA, mB, singleChunk(start, end), numPending(start, end));
+}
+
+template <bool Binom>
+void IHSFinder::runXpehh(HapMap* mA, HapMap* mB, const ChunkSource& next, std::size_t total)
+{
+    prepareDone(mA->numSnps());
+    beginProgress(total);
+    std::size_t start = 0, end = 0;
+    bool more = true;
+    HapMap::PrimitiveType* masks = (m_permutations > 0) ? permutationMasks(mA, mB) : nullptr;
+    #pragma omp parallel shared(mA, mB, next, start, end, more, masks)
     {
         EHHFinder finder(mA->snpDataSize(), mB->snpDataSize(), 2000, m_cutoff, m_minMAF, m_scale, m_maxExtend);
+        finder.setPermutations(masks, m_permutations);
+        finder.setSiteEhh(m_rsb);
+        std::atomic<unsigned long long>& completed = threadCounter();
+        std::vector<LocusTrace> traces;
+        while (true)
+        {
+            #pragma omp master
+            more = next(start, end);
+            #pragma omp barrier
+            if (!more)
+                break;
+            #pragma omp for schedule(dynamic,10)
+            for(size_t i = start; i < end; ++i)
+            {
+                if (m_done[i])
+                    continue;
+                auto t0 = std::chrono::steady_clock::now();
+                XPEHH xpehh = finder.findXPEHH<Binom>(mA, mB, i, &m_reachedEnd);
+                if (finder.reachedWindowEdge())
+                {
+                    ++m_windowEdge;
+                    continue;
+                }
+                if (m_tracing)
+                {
+                    traces.push_back(finder.trace());
+                    traces.back().seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                }
+                processXPEHH(std::move(xpehh), i);
+                m_done[i] = true;
+                completed.fetch_add(1, std::memory_order_relaxed);
+                checkpointIfDue(true, Binom);
+            }
+        }
+        if (m_tracing)
+            addTraces(traces);
+    }
+    endProgress();
+    if (masks)
+        aligned_free(masks);
+    if (!m_checkpointFile.empty())
+        saveCheckpoint(m_checkpointFile, true, Binom);
+}
+
+template <bool Binom>
+void IHSFinder::runXpehhPairs(const std::vector<HapMap*>& pops, const std::vector<IHSFinder*>& pairs, const std::vector<IHSFinder*>& ihs)
+{
+    std::size_t numSnps = pops[0]->numSnps();
+    std::size_t snpDataSize = 0;
+    for (HapMap* pop : pops)
+        snpDataSize += pop->snpDataSize();
+    std::vector<std::atomic<unsigned long long>*> reachedEnd;
+    for (IHSFinder* pair : pairs)
+    {
+        pair->prepareDone(numSnps);
+        reachedEnd.push_back(&pair->m_reachedEnd);
+    }
+    EHHFinder::IhsOutput ihsCounters;
+    for (IHSFinder* pop : ihs)
+    {
+        pop->prepareDone(numSnps);
+        ihsCounters.reachedEnd.push_back(&pop->m_reachedEnd);
+        ihsCounters.outsideMaf.push_back(&pop->m_outsideMaf);
+    }
+    prepareDone(numSnps);
+    beginProgress(numPending(0, numSnps));
+    #pragma omp parallel shared(pops, pairs, ihs, reachedEnd, ihsCounters)
+    {
+        EHHFinder finder(snpDataSize, 0, 2000, m_cutoff, m_minMAF, m_scale, m_maxExtend);
+        std::atomic<unsigned long long>& completed = threadCounter();
+        std::vector<XPEHH> results;
+        EHHFinder::IhsOutput ihsResults = ihsCounters;
+        std::vector<LocusTrace> traces;
         #pragma omp for schedule(dynamic,10)
-        for(size_t i = start; i < end; ++i)
+        for(size_t i = 0; i < numSnps; ++i)
         {
-            XPEHH xpehh = finder.findXPEHH<Binom>(mA, mB, i, &m_reachedEnd);
-            processXPEHH(std::move(xpehh), i);
-            ++m_counter;
-            unsigned long long tmp = m_counter;
-            if (tmp % 1000 == 0)
+            if (m_done[i])
+                continue;
+            auto t0 = std::chrono::steady_clock::now();
+            finder.findXPEHHPairs<Binom>(pops, i, results, reachedEnd, ihs.empty() ? nullptr : &ihsResults);
+            if (m_tracing)
             {
-                std::cout << '\r' << tmp << "/" << (end-start);
+                traces.push_back(finder.trace());
+                traces.back().seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
             }
+            for (std::size_t p = 0; p < pairs.size(); ++p)
+            {
+                pairs[p]->processXPEHH(std::move(results[p]), i);
+                pairs[p]->m_done[i] = true;
+            }
+            for (std::size_t k = 0; k < ihs.size(); ++k)
+            {
+                ihs[k]->processEHH(ihsResults.ehh[k], i);
+                ihs[k]->m_done[i] = true;
+            }
+            m_done[i] = true;
+            completed.fetch_add(1, std::memory_order_relaxed);
         }
+        if (m_tracing)
+            addTraces(traces);
     }
-    std::cout << std::endl;
+    endProgress();
 }
 
 template <bool Binom>
 void IHSFinder::run(HapMap* map, std::size_t start, std::size_t end)
 {
-    #pragma omp parallel shared(map, start, end)
+    prepareDone(map->numSnps());
+    run<Binom>(map, singleChunk(start, end), numPending(start, end));
+}
+
+template <bool Binom>
+void IHSFinder::run(HapMap* map, const ChunkSource& next, std::size_t total)
+{
+    prepareDone(map->numSnps());
+    beginProgress(total);
+    std::size_t start = 0, end = 0;
+    bool more = true;
+    #pragma omp parallel shared(map, next, start, end, more)
     {
         EHHFinder finder(map->snpDataSize(), 0, 2000, m_cutoff, m_minMAF, m_scale, m_maxExtend);
-        #pragma omp for schedule(dynamic,10)
-        for(size_t i = start; i < end; ++i)
+        std::atomic<unsigned long long>& completed = threadCounter();
+        std::vector<LocusTrace> traces;
+        while (true)
         {
-            EHH ehh = finder.find<Binom>(map, i, &m_reachedEnd, &m_outsideMaf);
-            processEHH(ehh, i);
-            ++m_counter;
-            unsigned long long tmp = m_counter;
-            if (tmp % 1000 == 0)
+            #pragma omp master
+            more = next(start, end);
+            #pragma omp barrier
+            if (!more)
+                break;
+            #pragma omp for schedule(dynamic,10)
+            for(size_t i = start; i < end; ++i)
             {
-                std::cout << '\r' << tmp << "/" << (end-start);
+                if (m_done[i])
+                    continue;
+                auto t0 = std::chrono::steady_clock::now();
+                EHH ehh = finder.find<Binom>(map, i, &m_reachedEnd, &m_outsideMaf);
+                if (finder.reachedWindowEdge())
+                {
+                    ++m_windowEdge;
+                    continue;
+                }
+                if (m_tracing)
+                {
+                    traces.push_back(finder.trace());
+                    traces.back().seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                }
+                processEHH(ehh, i);
+                m_done[i] = true;
+                completed.fetch_add(1, std::memory_order_relaxed);
+                checkpointIfDue(false, Binom);
             }
         }
+        if (m_tracing)
+            addTraces(traces);
     }
-    std::cout << std::endl;
+    endProgress();
+    if (!m_checkpointFile.empty())
+        saveCheckpoint(m_checkpointFile, false, Binom);
 }
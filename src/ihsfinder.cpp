@@ -18,11 +18,102 @@
  */
 
 #include "ihsfinder.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 IHSFinder::IHSFinder(std::size_t snpLength, double cutoff, double minMAF, double scale, unsigned long long maxExtend, int bins)
-    : m_snpLength(snpLength), m_cutoff(cutoff), m_minMAF(minMAF), m_scale(scale), m_maxExtend(maxExtend), m_bins(bins), m_counter{}, m_reachedEnd{}, m_outsideMaf{}, m_nanResults{}
+    : m_snpLength(snpLength), m_cutoff(cutoff), m_minMAF(minMAF), m_scale(scale), m_maxExtend(maxExtend), m_bins(bins), m_counter{}, m_reachedEnd{}, m_outsideMaf{}, m_nanResults{}, m_windowEdge{}
+    , m_progressInterval(0.0), m_tracing(false), m_checkpointInterval(0.0), m_nextCheckpoint{}
+    , m_permutations(0), m_permutationSeed(0), m_nsl(false), m_rsb(false)
 {}
 
+HapMap::PrimitiveType* IHSFinder::permutationMasks(HapMap* mA, HapMap* mB) const
+{
+    /*
+     * Shuffle the pooled labels, keeping the size of each population, and set the bits of the haplotypes
+     * which end up in A, laid out like an XP-EHH branch: population A's words, then population B's.
+     */
+    std::size_t lengthA = mA->snpLength(), lengthB = mB->snpLength();
+    std::size_t snpDataSize = mA->snpDataSize() + mB->snpDataSize();
+    std::size_t offsetB = mA->snpDataSize()*sizeof(HapMap::PrimitiveType)*8;
+    std::size_t bytes = m_permutations*snpDataSize*sizeof(HapMap::PrimitiveType);
+    HapMap::PrimitiveType* masks = (HapMap::PrimitiveType*) aligned_alloc(128, bytes);
+    std::fill((char*) masks, (char*) masks + bytes, 0);
+    std::vector<char> labels(lengthA + lengthB, 0);
+    std::fill(labels.begin(), labels.begin() + lengthA, 1);
+    std::mt19937_64 rng(m_permutationSeed);
+    for (std::size_t r = 0; r < m_permutations; ++r)
+    {
+        std::shuffle(labels.begin(), labels.end(), rng);
+        unsigned long long* mask = (unsigned long long*) &masks[r*snpDataSize];
+        for (std::size_t h = 0; h < labels.size(); ++h)
+        {
+            if (!labels[h])
+                continue;
+            std::size_t bit = (h < lengthA) ? h : offsetB + (h - lengthA);
+            mask[bit/64] |= 1ULL << (bit % 64);
+        }
+    }
+    return masks;
+}
+
+void IHSFinder::setProgress(double interval, const std::string& metricsFile, const std::string& label)
+{
+    m_progressInterval = interval;
+    m_metricsFile = metricsFile;
+    m_progressLabel = label;
+}
+
+void IHSFinder::beginProgress(std::size_t total)
+{
+#ifdef _OPENMP
+    m_threadCounters = std::vector<ThreadCounter>(omp_get_max_threads());
+#else
+    m_threadCounters = std::vector<ThreadCounter>(1);
+#endif
+    if (m_progressInterval <= 0.0)
+        return;
+    m_reporter.reset(new ProgressReporter(m_progressInterval, total, [this]() {
+        ProgressSample s;
+        for (const ThreadCounter& c : m_threadCounters)
+            s.completed += c.value.load(std::memory_order_relaxed);
+        s.reachedEnd = m_reachedEnd;
+        s.outsideMaf = m_outsideMaf;
+        s.nanResults = m_nanResults;
+        return s;
+    }, m_metricsFile, m_progressLabel));
+    m_reporter->start();
+}
+
+void IHSFinder::endProgress()
+{
+    if (m_reporter)
+    {
+        m_reporter->stop();
+        m_reporter.reset();
+    }
+    for (const ThreadCounter& c : m_threadCounters)
+        m_counter += c.value.load(std::memory_order_relaxed);
+    m_threadCounters.clear();
+}
+
+std::atomic<unsigned long long>& IHSFinder::threadCounter()
+{
+#ifdef _OPENMP
+    return m_threadCounters[omp_get_thread_num()].value;
+#else
+    return m_threadCounters[0].value;
+#endif
+}
+
 void IHSFinder::processEHH(const EHH& ehh, std::size_t line)
 {
     if (ehh.num + ehh.numNot != m_snpLength)
@@ -53,25 +144,91 @@ void IHSFinder::processEHH(const EHH& ehh, std::size_t line)
         m_freqmutex.unlock();
     }
 
+    IhsScore score(iHS, ehh.iHH_0, ehh.iHH_1, ehh.num/(double) m_snpLength);
+    if (m_nsl)
+    {
+        // Both integrals start at half the core's EHH of 1, so nSL is finite whenever iHS is.
+        score.nSL = log(ehh.SL_0/ehh.SL_1);
+        score.SL_0 = ehh.SL_0;
+        score.SL_1 = ehh.SL_1;
+        m_freqmutex.lock();
+        m_unStandNSLByFreq[freqs].push_back(score.nSL);
+        m_freqmutex.unlock();
+    }
+
     m_mutex.lock();
     m_freqsByLine[line] = freqs;
-    m_unStandIHSByLine[line] = IhsScore(iHS, ehh.iHH_0, ehh.iHH_1, ehh.num/(double) m_snpLength);
+    m_unStandIHSByLine[line] = score;
     m_mutex.unlock();
 }
 
 void IHSFinder::processXPEHH(XPEHH&& e, size_t line)
 {
-    if (e.iHH_A1 == 0.0 || e.iHH_B1 == 0.0)
+    /*
+     * Rsb comes from integrals of its own, so a locus with a valid Rsb is kept even when one of the iHH is 0,
+     * with a NaN XP-EHH which is left out of the XP-EHH bins.
+     */
+    bool validXpehh = e.iHH_A1 != 0.0 && e.iHH_B1 != 0.0;
+    if (m_rsb)
+        e.rsb = (e.iES_A > 0.0 && e.iES_B > 0.0) ? log(e.iES_A/e.iES_B) : NAN;
+    if (!validXpehh && (!m_rsb || std::isnan(e.rsb)))
         return;
-    e.xpehh = log(e.iHH_A1/e.iHH_B1);
+    e.xpehh = validXpehh ? log(e.iHH_A1/e.iHH_B1) : NAN;
     m_mutex.lock();
     double freqs = ((int) (m_bins*(e.numA+e.numB)/(double)m_snpLength))/(double)m_bins;
-    m_unStandXPEHHByFreq[freqs].push_back(e.xpehh);
+    if (validXpehh)
+        m_unStandXPEHHByFreq[freqs].push_back(e.xpehh);
+    if (m_rsb && !std::isnan(e.rsb))
+        m_unStandRsbByFreq[freqs].push_back(e.rsb);
     m_unStandXPEHHByLine[line] = std::move(e);
     m_freqsByLine[line] = freqs;
     m_mutex.unlock();
 }
 
+void IHSFinder::runSweep(HapMap* map, const std::vector<EHHFinder::SweepSetting>& settings, const std::vector<IHSFinder*>& results)
+{
+    std::size_t numSnps = map->numSnps();
+    std::vector<std::atomic<unsigned long long>*> reachedEnd, outsideMaf;
+    for (IHSFinder* result : results)
+    {
+        result->prepareDone(numSnps);
+        reachedEnd.push_back(&result->m_reachedEnd);
+        outsideMaf.push_back(&result->m_outsideMaf);
+    }
+    prepareDone(numSnps);
+    beginProgress(numPending(0, numSnps));
+    #pragma omp parallel shared(map, settings, results, reachedEnd, outsideMaf)
+    {
+        EHHFinder finder(map->snpDataSize(), 0, 2000, m_cutoff, m_minMAF, m_scale, m_maxExtend);
+        std::atomic<unsigned long long>& completed = threadCounter();
+        std::vector<EHH> ehh;
+        std::vector<LocusTrace> traces;
+        #pragma omp for schedule(dynamic,10)
+        for (std::size_t i = 0; i < numSnps; ++i)
+        {
+            if (m_done[i])
+                continue;
+            auto t0 = std::chrono::steady_clock::now();
+            finder.findSweep(map, i, settings, ehh, reachedEnd, outsideMaf);
+            if (m_tracing)
+            {
+                traces.push_back(finder.trace());
+                traces.back().seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            }
+            for (std::size_t s = 0; s < results.size(); ++s)
+            {
+                results[s]->processEHH(ehh[s], i);
+                results[s]->m_done[i] = true;
+            }
+            m_done[i] = true;
+            completed.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (m_tracing)
+            addTraces(traces);
+    }
+    endProgress();
+}
+
 IHSFinder::LineMap IHSFinder::normalize()
 {
     StatsMap iHSStatsByFreq;
@@ -90,6 +247,25 @@ IHSFinder::LineMap IHSFinder::normalize()
     return m_standIHSSingle;
 }
 
+IHSFinder::LineMap IHSFinder::normalizeNSL() const
+{
+    return normalizeNSL(nslMoments());
+}
+
+IHSFinder::LineMap IHSFinder::normalizeRsb() const
+{
+    MomentsByBin moments = binMoments(m_unStandRsbByFreq);
+    LineMap ret;
+    for (const auto& it : m_unStandXPEHHByLine)
+    {
+        if (std::isnan(it.second.rsb))
+            continue;
+        Stats s = moments[binIndex(m_freqsByLine.at(it.first))].stats();
+        ret[it.first] = (it.second.rsb - s.mean)/s.stddev;
+    }
+    return ret;
+}
+
 IHSFinder::LineMap IHSFinder::normalizeXPEHH()
 {
     StatsMap xpehhStatsByFreq;
@@ -106,48 +282,486 @@ IHSFinder::LineMap IHSFinder::normalizeXPEHH()
     return ret;
 }
 
-void IHSFinder::addData(const IHSFinder::LineMap& freqsBySite,
-                        const IHSFinder::IhsInfoMap& unStandIHSByLine,
-                        const IHSFinder::FreqVecMap& unStandIHSByFreq,
-                        unsigned long long reachedEnd,
-                        unsigned long long outsideMaf,
-                        unsigned long long nanResults)
+IHSFinder::MomentsByBin IHSFinder::binMoments(const FreqVecMap& byFreq) const
+{
+    MomentsByBin ret(m_bins + 1);
+    for (const auto& it : byFreq)
+        ret[binIndex(it.first)] = moments(it.second);
+    return ret;
+}
+
+IHSFinder::MomentsByBin IHSFinder::ihsMoments() const
+{
+    return binMoments(m_unStandIHSByFreq);
+}
+
+IHSFinder::MomentsByBin IHSFinder::xpehhMoments() const
+{
+    return binMoments(m_unStandXPEHHByFreq);
+}
+
+IHSFinder::MomentsByBin IHSFinder::nslMoments() const
+{
+    return binMoments(m_unStandNSLByFreq);
+}
+
+IHSFinder::LineMap IHSFinder::normalize(const MomentsByBin& moments) const
+{
+    LineMap ret;
+    for (const auto& it : m_unStandIHSByLine)
+    {
+        Stats s = moments[binIndex(m_freqsByLine.at(it.first))].stats();
+        ret[it.first] = (it.second.iHS - s.mean)/s.stddev;
+    }
+    return ret;
+}
+
+IHSFinder::LineMap IHSFinder::normalizeNSL(const MomentsByBin& moments) const
+{
+    LineMap ret;
+    for (const auto& it : m_unStandIHSByLine)
+    {
+        Stats s = moments[binIndex(m_freqsByLine.at(it.first))].stats();
+        ret[it.first] = (it.second.nSL - s.mean)/s.stddev;
+    }
+    return ret;
+}
+
+IHSFinder::LineMap IHSFinder::normalizeXPEHH(const MomentsByBin& moments) const
+{
+    LineMap ret;
+    for (const auto& it : m_unStandXPEHHByLine)
+    {
+        Stats s = moments[binIndex(m_freqsByLine.at(it.first))].stats();
+        ret[it.first] = (it.second.xpehh - s.mean)/s.stddev;
+    }
+    return ret;
+}
+
+void IHSFinder::addData(const IhsBlock& block)
+{
+    m_reachedEnd += block.reachedEnd;
+    m_outsideMaf += block.outsideMaf;
+    m_nanResults += block.nanResults;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::lock_guard<std::mutex> freqlock(m_freqmutex);
+    for (std::size_t i = 0; i < block.lines.size(); ++i)
+    {
+        std::size_t line = block.lines[i];
+        if (isDone(line))
+            continue;
+        m_freqsByLine[line] = block.binFreq[i];
+        m_unStandIHSByLine[line] = IhsScore(block.iHS[i], block.iHH_0[i], block.iHH_1[i], block.freq[i]);
+        m_unStandIHSByFreq[block.binFreq[i]].push_back(block.iHS[i]);
+    }
+    for (std::size_t i = block.start; i < block.end && i < m_done.size(); ++i)
+        m_done[i] = true;
+}
+
+void IHSFinder::addXData(const XpehhBlock& block)
+{
+    m_reachedEnd += block.reachedEnd;
+    m_outsideMaf += block.outsideMaf;
+    m_nanResults += block.nanResults;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::lock_guard<std::mutex> freqlock(m_freqmutex);
+    for (std::size_t i = 0; i < block.lines.size(); ++i)
+    {
+        std::size_t line = block.lines[i];
+        if (isDone(line))
+            continue;
+        XPEHH& e = m_unStandXPEHHByLine[line];
+        e.index = line;
+        e.xpehh = block.xpehh[i];
+        e.numA = block.numA[i];
+        e.numB = block.numB[i];
+        e.numNotA = block.numNotA[i];
+        e.numNotB = block.numNotB[i];
+        e.iHH_A1 = block.iHH_A1[i];
+        e.iHH_B1 = block.iHH_B1[i];
+        e.iHH_P1 = block.iHH_P1[i];
+        m_freqsByLine[line] = block.binFreq[i];
+        m_unStandXPEHHByFreq[block.binFreq[i]].push_back(block.xpehh[i]);
+    }
+    for (std::size_t i = block.start; i < block.end && i < m_done.size(); ++i)
+        m_done[i] = true;
+}
+
+void IHSFinder::releaseResults()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::lock_guard<std::mutex> freqlock(m_freqmutex);
+    m_freqsByLine.clear();
+    m_unStandIHSByLine.clear();
+    m_unStandXPEHHByLine.clear();
+    m_unStandIHSByFreq.clear();
+    m_unStandXPEHHByFreq.clear();
+    m_unStandNSLByFreq.clear();
+    m_unStandRsbByFreq.clear();
+}
+
+IhsBlock IHSFinder::ihsBlock(std::size_t start, std::size_t end) const
+{
+    IhsBlock block;
+    block.start = start;
+    block.end = end;
+    for (auto it = m_unStandIHSByLine.lower_bound(start); it != m_unStandIHSByLine.end() && it->first < end; ++it)
+    {
+        block.lines.push_back(it->first);
+        block.binFreq.push_back(m_freqsByLine.at(it->first));
+        block.iHS.push_back(it->second.iHS);
+        block.iHH_0.push_back(it->second.iHH_0);
+        block.iHH_1.push_back(it->second.iHH_1);
+        block.freq.push_back(it->second.freq);
+    }
+    return block;
+}
+
+XpehhBlock IHSFinder::xpehhBlock(std::size_t start, std::size_t end) const
+{
+    XpehhBlock block;
+    block.start = start;
+    block.end = end;
+    for (auto it = m_unStandXPEHHByLine.lower_bound(start); it != m_unStandXPEHHByLine.end() && it->first < end; ++it)
+    {
+        const XPEHH& e = it->second;
+        block.lines.push_back(it->first);
+        block.binFreq.push_back(m_freqsByLine.at(it->first));
+        block.xpehh.push_back(e.xpehh);
+        block.numA.push_back(e.numA);
+        block.numB.push_back(e.numB);
+        block.numNotA.push_back(e.numNotA);
+        block.numNotB.push_back(e.numNotB);
+        block.iHH_A1.push_back(e.iHH_A1);
+        block.iHH_B1.push_back(e.iHH_B1);
+        block.iHH_P1.push_back(e.iHH_P1);
+    }
+    return block;
+}
+
+IHSFinder::ChunkSource IHSFinder::singleChunk(std::size_t start, std::size_t end)
+{
+    bool given = false;
+    return [=](std::size_t& s, std::size_t& e) mutable {
+        if (given)
+            return false;
+        s = start;
+        e = end;
+        given = true;
+        return true;
+    };
+}
+
+void IHSFinder::addTraces(std::vector<LocusTrace>& traces)
 {
-    m_reachedEnd += reachedEnd;
-    m_outsideMaf += outsideMaf;
-    m_nanResults += nanResults;
     m_mutex.lock();
-    m_freqsByLine.insert(freqsBySite.begin(), freqsBySite.end());
-    m_unStandIHSByLine.insert(unStandIHSByLine.begin(), unStandIHSByLine.end());
+    m_traces.insert(m_traces.end(), traces.begin(), traces.end());
     m_mutex.unlock();
-    m_freqmutex.lock();
-    for (auto pair : unStandIHSByFreq)
+    traces.clear();
+}
+
+namespace {
+
+/**
+ * Power of two histogram. Bucket 0 holds zeros, bucket i > 0 holds [2^(i-1), 2^i).
+ */
+void writeHistogram(std::ostream& out, const char* metric, const std::vector<unsigned long long>& values)
+{
+    std::vector<unsigned long long> buckets;
+    for (unsigned long long v : values)
+    {
+        std::size_t b = 0;
+        while (v != 0)
+        {
+            v >>= 1;
+            ++b;
+        }
+        if (b >= buckets.size())
+            buckets.resize(b+1);
+        ++buckets[b];
+    }
+    for (std::size_t b = 0; b < buckets.size(); ++b)
     {
-        std::vector<double>& v = m_unStandIHSByFreq[pair.first];
-        v.insert(v.end(), pair.second.begin(), pair.second.end());
+        if (buckets[b] == 0)
+            continue;
+        unsigned long long lower = (b == 0) ? 0ULL : (1ULL << (b-1));
+        unsigned long long upper = (b == 0) ? 1ULL : (1ULL << b);
+        out << metric << '\t' << lower << '\t' << upper << '\t' << buckets[b] << '\n';
     }
-    m_freqmutex.unlock();
 }
 
-void IHSFinder::addXData(const IHSFinder::LineMap& freqsBySite,
-                        const IHSFinder::XpehhInfoMap& unStandIHSByLine,
-                        const IHSFinder::FreqVecMap& unStandIHSByFreq,
-                        unsigned long long reachedEnd,
-                        unsigned long long outsideMaf,
-                        unsigned long long nanResults)
+}
+
+bool IHSFinder::writeTraces(const std::string& filename)
 {
-    m_reachedEnd += reachedEnd;
-    m_outsideMaf += outsideMaf;
-    m_nanResults += nanResults;
+    std::sort(m_traces.begin(), m_traces.end(), [](const LocusTrace& a, const LocusTrace& b) { return a.index < b.index; });
+
+    std::ofstream out(filename);
+    if (!out.good())
+    {
+        std::cerr << "ERROR: Cannot open trace file: " << filename << std::endl;
+        return false;
+    }
+    out << "Index\tSeconds\tUpstream\tDownstream\tPeakBranches\tReallocs\n";
+    for (const LocusTrace& t : m_traces)
+        out << t.index << '\t' << t.seconds << '\t' << t.upstreamRows << '\t' << t.downstreamRows << '\t' << t.peakBranches << '\t' << t.reallocs << '\n';
+
+    std::vector<unsigned long long> micros, rows, branches;
+    micros.reserve(m_traces.size());
+    rows.reserve(m_traces.size());
+    branches.reserve(m_traces.size());
+    for (const LocusTrace& t : m_traces)
+    {
+        micros.push_back((unsigned long long) (t.seconds*1e6));
+        rows.push_back(t.upstreamRows + t.downstreamRows);
+        branches.push_back(t.peakBranches);
+    }
+    std::ofstream hist(filename + ".hist");
+    hist << "Metric\tLower\tUpper\tLoci\n";
+    writeHistogram(hist, "Microseconds", micros);
+    writeHistogram(hist, "Rows", rows);
+    writeHistogram(hist, "PeakBranches", branches);
+    return true;
+}
+
+void IHSFinder::prepareDone(std::size_t numSnps)
+{
+    if (m_done.size() == 0)
+        m_done = std::vector<std::atomic<bool>>(numSnps);
+    assert(m_done.size() == numSnps);
+}
+
+std::size_t IHSFinder::numPending(std::size_t start, std::size_t end) const
+{
+    std::size_t ret = 0;
+    for (std::size_t i = start; i < end; ++i)
+        if (!m_done[i])
+            ++ret;
+    return ret;
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+long long nowMillis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+}
+
+/*
+ * The records are raw IhsRecord or XpehhRecord structs, so the version in the magic is bumped whenever their
+ * layout changes, and the header also holds the record size, which must match.
+ */
+const uint64_t checkpointMagic = 0x3230544B43424848ULL; // "HHBCKT02"
+// Written before nSL was added to IhsScore and the p-value and Rsb to XPEHH.
+const uint64_t checkpointMagicV1 = 0x3130544B43424848ULL; // "HHBCKT01"
+
+enum CheckpointKind : uint64_t
+{
+    IhsCheckpoint = 1,
+    XpehhCheckpoint = 2
+};
+
+struct CheckpointHeader
+{
+    uint64_t magic;
+    uint64_t kind;
+    uint64_t numSnps;
+    uint64_t snpLength;
+    double cutoff;
+    double minMAF;
+    double scale;
+    uint64_t maxExtend;
+    int64_t bins;
+    uint64_t binom;
+    uint64_t reachedEnd;
+    uint64_t outsideMaf;
+    uint64_t nanResults;
+    uint64_t numRecords;
+    uint64_t recordSize;
+};
+
+struct IhsRecord
+{
+    uint64_t line;
+    double freq;
+    IhsScore score;
+};
+
+struct XpehhRecord
+{
+    uint64_t line;
+    double freq;
+    XPEHH score;
+};
+
+}
+
+void IHSFinder::setCheckpoint(const std::string& filename, double interval)
+{
+    m_checkpointFile = filename;
+    m_checkpointInterval = interval;
+    m_nextCheckpoint = nowMillis() + (long long) (interval*1000.0);
+}
+
+void IHSFinder::checkpointIfDue(bool xpehh, bool binom)
+{
+    if (m_checkpointFile.empty() || m_checkpointInterval <= 0.0)
+        return;
+    long long now = nowMillis();
+    long long due = m_nextCheckpoint;
+    if (now < due)
+        return;
+    // Only the thread which moves the deadline on writes the checkpoint.
+    if (!m_nextCheckpoint.compare_exchange_strong(due, now + (long long) (m_checkpointInterval*1000.0)))
+        return;
+    saveCheckpoint(m_checkpointFile, xpehh, binom);
+}
+
+bool IHSFinder::saveCheckpoint(const std::string& filename, bool xpehh, bool binom)
+{
+    CheckpointHeader h;
+    h.magic = checkpointMagic;
+    h.kind = xpehh ? XpehhCheckpoint : IhsCheckpoint;
+    h.numSnps = m_done.size();
+    h.snpLength = m_snpLength;
+    h.cutoff = m_cutoff;
+    h.minMAF = m_minMAF;
+    h.scale = m_scale;
+    h.maxExtend = m_maxExtend;
+    h.bins = m_bins;
+    h.binom = binom;
+    std::vector<uint64_t> done((m_done.size()+63)/64);
+    std::vector<IhsRecord> ihsRecords;
+    std::vector<XpehhRecord> xpehhRecords;
+
+    /*
+     * Only loci flagged as done are saved. A locus is flagged after its result has been stored, so the
+     * records are consistent with the flags. The skipped loci counters may include a few loci which are not
+     * yet flagged and will be counted again on resume.
+     */
     m_mutex.lock();
-    m_freqsByLine.insert(freqsBySite.begin(), freqsBySite.end());
-    m_unStandXPEHHByLine.insert(unStandIHSByLine.begin(), unStandIHSByLine.end());
+    h.reachedEnd = m_reachedEnd;
+    h.outsideMaf = m_outsideMaf;
+    h.nanResults = m_nanResults;
+    for (std::size_t i = 0; i < m_done.size(); ++i)
+        if (m_done[i])
+            done[i/64] |= (1ULL << (i % 64));
+    auto flagged = [&done](std::size_t line) { return (done[line/64] >> (line % 64)) & 1; };
+    for (const auto& it : m_unStandIHSByLine)
+        if (flagged(it.first))
+            ihsRecords.push_back(IhsRecord{it.first, m_freqsByLine.at(it.first), it.second});
+    for (const auto& it : m_unStandXPEHHByLine)
+        if (flagged(it.first))
+            xpehhRecords.push_back(XpehhRecord{it.first, m_freqsByLine.at(it.first), it.second});
     m_mutex.unlock();
-    m_freqmutex.lock();
-    for (auto pair : unStandIHSByFreq)
+
+    h.numRecords = xpehh ? xpehhRecords.size() : ihsRecords.size();
+    h.recordSize = xpehh ? sizeof(XpehhRecord) : sizeof(IhsRecord);
+
+    std::string tmp = filename + ".tmp";
+    std::ofstream out(tmp, std::ios::out | std::ios::binary);
+    out.write((const char*) &h, sizeof(h));
+    out.write((const char*) done.data(), done.size()*sizeof(uint64_t));
+    if (xpehh)
+        out.write((const char*) xpehhRecords.data(), xpehhRecords.size()*sizeof(XpehhRecord));
+    else
+        out.write((const char*) ihsRecords.data(), ihsRecords.size()*sizeof(IhsRecord));
+    out.close();
+    if (!out.good() || std::rename(tmp.c_str(), filename.c_str()) != 0)
+    {
+        std::cerr << "ERROR: Could not write checkpoint: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool IHSFinder::loadCheckpoint(const std::string& filename, bool xpehh, bool binom)
+{
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+    if (!in.good())
+    {
+        std::cerr << "ERROR: Cannot open file or file not found: " << filename << std::endl;
+        return false;
+    }
+    CheckpointHeader h = CheckpointHeader();
+    in.read((char*) &h, sizeof(h));
+    if (h.magic == checkpointMagicV1)
+    {
+        std::cerr << "ERROR: " << filename << " was written by an older version of hapbin, whose records do not hold nSL, p-values or Rsb. Remove it and calculate again." << std::endl;
+        return false;
+    }
+    if (!in.good() || h.magic != checkpointMagic)
+    {
+        std::cerr << "ERROR: Not a hapbin checkpoint: " << filename << std::endl;
+        return false;
+    }
+    if (h.kind != (xpehh ? XpehhCheckpoint : IhsCheckpoint))
+    {
+        std::cerr << "ERROR: " << filename << " does not contain " << (xpehh ? "XPEHH" : "iHS") << " results." << std::endl;
+        return false;
+    }
+    if (h.recordSize != (xpehh ? sizeof(XpehhRecord) : sizeof(IhsRecord)))
+    {
+        std::cerr << "ERROR: " << filename << " was written by a different version of hapbin." << std::endl;
+        return false;
+    }
+    if (h.snpLength != m_snpLength || h.cutoff != m_cutoff || h.minMAF != m_minMAF || h.scale != m_scale
+        || h.maxExtend != m_maxExtend || h.bins != m_bins || (bool) h.binom != binom)
+    {
+        std::cerr << "ERROR: " << filename << " was calculated with different parameters." << std::endl;
+        return false;
+    }
+    if (m_done.size() != 0 && m_done.size() != h.numSnps)
+    {
+        std::cerr << "ERROR: " << filename << " has " << h.numSnps << " loci, expected " << m_done.size() << "." << std::endl;
+        return false;
+    }
+    std::vector<uint64_t> done((h.numSnps+63)/64);
+    in.read((char*) done.data(), done.size()*sizeof(uint64_t));
+    std::vector<IhsRecord> ihsRecords;
+    std::vector<XpehhRecord> xpehhRecords;
+    if (xpehh)
+    {
+        xpehhRecords.resize(h.numRecords);
+        in.read((char*) xpehhRecords.data(), xpehhRecords.size()*sizeof(XpehhRecord));
+    }
+    else
+    {
+        ihsRecords.resize(h.numRecords);
+        in.read((char*) ihsRecords.data(), ihsRecords.size()*sizeof(IhsRecord));
+    }
+    if (!in.good())
+    {
+        std::cerr << "ERROR: Truncated checkpoint: " << filename << std::endl;
+        return false;
+    }
+
+    prepareDone(h.numSnps);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::lock_guard<std::mutex> freqlock(m_freqmutex);
+    for (const IhsRecord& r : ihsRecords)
+    {
+        if (isDone(r.line))
+            continue;
+        m_freqsByLine[r.line] = r.freq;
+        m_unStandIHSByLine[r.line] = r.score;
+        m_unStandIHSByFreq[r.freq].push_back(r.score.iHS);
+    }
+    for (const XpehhRecord& r : xpehhRecords)
     {
-        std::vector<double>& v = m_unStandIHSByFreq[pair.first];
-        v.insert(v.end(), pair.second.begin(), pair.second.end());
+        if (isDone(r.line))
+            continue;
+        m_freqsByLine[r.line] = r.freq;
+        m_unStandXPEHHByLine[r.line] = r.score;
+        m_unStandXPEHHByFreq[r.freq].push_back(r.score.xpehh);
     }
-    m_freqmutex.unlock();
+    for (std::size_t i = 0; i < h.numSnps; ++i)
+        if (done[i/64] & (1ULL << (i % 64)))
+            m_done[i] = true;
+    m_reachedEnd += h.reachedEnd;
+    m_outsideMaf += h.outsideMaf;
+    m_nanResults += h.nanResults;
+    return true;
 }
@@ -20,7 +20,11 @@
 #ifndef IHSFINDER_H
 #define IHSFINDER_H
 #include "ehhfinder.hpp"
+#include "progress.hpp"
 #include <map>
+#include <memory>
+#include <string>
+#include <vector>
 #include <mutex>
 #ifdef __MINGW32__
 //from https://github.com/meganz/mingw-std-threads
@@ -31,6 +35,47 @@
 #include <thread>
 #include <atomic>
 
+/**
+ * The results for the loci [start, end) as flat columns with one entry per locus that has a result, so that a
+ * chunk is sent to another rank with one copy per column. binFreq is the frequency bin used for
+ * standardization. The counters are the skipped loci to add on the receiving rank.
+ */
+struct IhsBlock
+{
+    IhsBlock() : start(0), end(0), reachedEnd(0), outsideMaf(0), nanResults(0) {}
+    std::size_t start;
+    std::size_t end;
+    unsigned long long reachedEnd;
+    unsigned long long outsideMaf;
+    unsigned long long nanResults;
+    std::vector<uint64_t> lines;
+    std::vector<double> binFreq;
+    std::vector<double> iHS;
+    std::vector<double> iHH_0;
+    std::vector<double> iHH_1;
+    std::vector<double> freq;
+};
+
+struct XpehhBlock
+{
+    XpehhBlock() : start(0), end(0), reachedEnd(0), outsideMaf(0), nanResults(0) {}
+    std::size_t start;
+    std::size_t end;
+    unsigned long long reachedEnd;
+    unsigned long long outsideMaf;
+    unsigned long long nanResults;
+    std::vector<uint64_t> lines;
+    std::vector<double> binFreq;
+    std::vector<double> xpehh;
+    std::vector<int32_t> numA;
+    std::vector<int32_t> numB;
+    std::vector<int32_t> numNotA;
+    std::vector<int32_t> numNotB;
+    std::vector<double> iHH_A1;
+    std::vector<double> iHH_B1;
+    std::vector<double> iHH_P1;
+};
+
 class IHSFinder
 {
 public:
@@ -39,30 +84,186 @@ public:
     using XpehhInfoMap = std::map<std::size_t, XPEHH>;
     using FreqVecMap = std::map<double, std::vector<double>>;
     using StatsMap = std::map<double, Stats>;
+    using MomentsByBin = std::vector<Moments>;
+    /**
+     * Called between chunks to get the next range of loci [start, end) to calculate. Returns false when there
+     * are none left.
+     */
+    using ChunkSource = std::function<bool(std::size_t& start, std::size_t& end)>;
 
     IHSFinder(std::size_t snpLength, double cutoff, double minMAF, double scale, unsigned long long maxExtend, int bins);
-    FreqVecMap unStdIHSByFreq() const { return m_unStandIHSByFreq; }
-    IhsInfoMap unStdIHSByLine() const { return m_unStandIHSByLine; }
-    XpehhInfoMap unStdXPEHHByLine() const { return m_unStandXPEHHByLine; }
-    LineMap    freqsByLine() const    { return m_freqsByLine; }
+    /**
+     * The results held so far. Not to be used while a run is adding to them.
+     */
+    const FreqVecMap& unStdIHSByFreq() const { return m_unStandIHSByFreq; }
+    const IhsInfoMap& unStdIHSByLine() const { return m_unStandIHSByLine; }
+    const XpehhInfoMap& unStdXPEHHByLine() const { return m_unStandXPEHHByLine; }
+    const LineMap&    freqsByLine() const    { return m_freqsByLine; }
     unsigned long long numCompleted() const { return m_counter; }
     unsigned long long numReachedEnd() const { return m_reachedEnd; }
     unsigned long long numOutsideMaf() const { return m_outsideMaf; }
     unsigned long long numNanResults() const { return m_nanResults; }
+    /**
+     * Loci skipped because their walk reached the edge of the rows loaded in the HapMap. They are not flagged
+     * as completed, so running the same range again with a larger window calculates just these.
+     */
+    unsigned long long numWindowEdge() const { return m_windowEdge; }
+    void clearWindowEdge() { m_windowEdge = 0; }
+
+    /**
+     * Report progress every #interval seconds while running. An interval <= 0 disables reporting. When
+     * #metricsFile is not empty, each report is also written to it as a tab separated row.
+     */
+    void setProgress(double interval, const std::string& metricsFile = std::string(), const std::string& label = std::string());
+
+    /**
+     * Record a LocusTrace with the wall time of every locus calculated by run() or runXpehh().
+     */
+    void setTracing(bool enabled) { m_tracing = enabled; }
+    /**
+     * Also keep nSL, the log ratio of the EHH integrals over rows rather than genetic distance, for every
+     * locus with an iHS. The walks are the same, so this costs two sums per row.
+     */
+    void setNsl(bool enabled) { m_nsl = enabled; }
+    /**
+     * Have runXpehh() also calculate Rsb from the integrated site EHH of each population (see
+     * EHHFinder::setSiteEhh()).
+     */
+    void setRsb(bool enabled) { m_rsb = enabled; }
+    const std::vector<LocusTrace>& traces() const { return m_traces; }
+    /**
+     * Write the recorded traces as a tab separated file sorted by index, and histograms of the time, rows
+     * visited and peak branch count to #filename.hist.
+     */
+    bool writeTraces(const std::string& filename);
+
+    /**
+     * Have runXpehh() also score #count random relabellings of the two populations at every locus and give
+     * each result an empirical p-value (see EHHFinder::setPermutations()). The relabellings are drawn once
+     * from #seed and used for every locus.
+     */
+    void setPermutations(std::size_t count, unsigned long long seed) { m_permutations = count; m_permutationSeed = seed; }
+
+    /**
+     * Periodically save the completed loci to #filename while running, at most every #interval seconds,
+     * and once more when a run finishes. An empty #filename disables checkpointing.
+     */
+    void setCheckpoint(const std::string& filename, double interval);
+    /**
+     * Write the completed loci, their unstandardized scores and frequency bins, and the skipped loci
+     * counters to #filename. The file is written to #filename.tmp first and then renamed over #filename.
+     */
+    bool saveCheckpoint(const std::string& filename, bool xpehh, bool binom);
+    /**
+     * Add the loci stored in a checkpoint to this IHSFinder. Loci already completed here are skipped, so
+     * loading several checkpoints merges them. run() and runXpehh() skip completed loci. Fails if the
+     * checkpoint was calculated with different parameters.
+     */
+    bool loadCheckpoint(const std::string& filename, bool xpehh, bool binom);
+    bool isDone(std::size_t line) const { return line < m_done.size() && m_done[line]; }
+    std::size_t numDone() const { return m_done.size() - numPending(0, m_done.size()); }
+
+    /**
+     * Size the completed loci flags for #numSnps loci. Called by run() and runXpehh(), and needed before
+     * addData() or addXData() if those may be called first.
+     */
+    void prepareDone(std::size_t numSnps);
 
     template <bool Binom>
     void run(HapMap* map, std::size_t start, std::size_t end);
     template <bool Binom>
     void runXpehh(HapMap* mA, HapMap* mB, std::size_t start, std::size_t end);
+    /**
+     * Calculate chunks of loci until #next returns false. #next is called on the master thread while the
+     * other threads wait, so it may communicate with other ranks. #total is only used for progress reports
+     * and may be 0 if it is not known.
+     */
+    template <bool Binom>
+    void run(HapMap* map, const ChunkSource& next, std::size_t total);
+    template <bool Binom>
+    void runXpehh(HapMap* mA, HapMap* mB, const ChunkSource& next, std::size_t total);
+    /**
+     * Calculate XP-EHH for every pair of #pops with one walk per locus (see EHHFinder::findXPEHHPairs()).
+     * This IHSFinder tracks the progress and completed loci, and the results of pair p go to #pairs[p], which
+     * must have been constructed with the summed snpLength() of the pair. If #ihs is not empty, the iHS of
+     * population k goes to #ihs[k] from the same walk, which must have been constructed with its snpLength().
+     */
+    template <bool Binom>
+    void runXpehhPairs(const std::vector<HapMap*>& pops, const std::vector<IHSFinder*>& pairs, const std::vector<IHSFinder*>& ihs = std::vector<IHSFinder*>());
+    /**
+     * Calculate iHS with every one of #settings from one walk per locus (see EHHFinder::findSweep()). This
+     * IHSFinder tracks the progress and completed loci, and the results of setting s go to #results[s].
+     */
+    void runSweep(HapMap* map, const std::vector<EHHFinder::SweepSetting>& settings, const std::vector<IHSFinder*>& results);
     LineMap normalize();
     LineMap normalizeXPEHH();
 
-    void addData(const LineMap& freqsBySite, const IhsInfoMap& unStandIHSByLine, const FreqVecMap& unStandIHSByFreq, unsigned long long reachedEnd, unsigned long long outsideMaf, unsigned long long nanResults);
-    void addXData(const LineMap& freqsBySite, const XpehhInfoMap& unStandXIHSByLine, const FreqVecMap& unStandIHSByFreq, unsigned long long reachedEnd, unsigned long long outsideMaf, unsigned long long nanResults);
+    /**
+     * Moments of the unstandardized scores in each frequency bin, indexed by the bin's frequency times the
+     * number of bins. Merging the moments of every rank gives those of all loci, without the scores.
+     */
+    MomentsByBin ihsMoments() const;
+    MomentsByBin xpehhMoments() const;
+    /**
+     * Standardize the loci held here with the bin moments of all loci, which may be held elsewhere.
+     */
+    LineMap normalize(const MomentsByBin& moments) const;
+    LineMap normalizeXPEHH(const MomentsByBin& moments) const;
+    /**
+     * Standardize nSL in the same frequency bins as iHS, with the moments of the loci held here or of all
+     * loci. Only with setNsl().
+     */
+    MomentsByBin nslMoments() const;
+    LineMap normalizeNSL() const;
+    LineMap normalizeNSL(const MomentsByBin& moments) const;
+    /**
+     * Standardize Rsb in the same frequency bins as XP-EHH. Loci without an Rsb are left out. Only with
+     * setRsb().
+     */
+    LineMap normalizeRsb() const;
+
+    /**
+     * Merge the results another rank calculated for the loci [block.start, block.end). The frequency bins are
+     * rebuilt from the per line results and the whole range is flagged as completed. Loci which are already
+     * completed here are skipped, so the same range may safely be sent twice.
+     */
+    void addData(const IhsBlock& block);
+    void addXData(const XpehhBlock& block);
+
+    /**
+     * Drop the per line results and frequency bins, keeping the completed flags and skipped loci counters.
+     * Used by ranks which send their results to another rank as they go.
+     */
+    void releaseResults();
+
+    /**
+     * The results for the loci [start, end), for sending a chunk to another rank.
+     */
+    IhsBlock ihsBlock(std::size_t start, std::size_t end) const;
+    XpehhBlock xpehhBlock(std::size_t start, std::size_t end) const;
 
 protected:
     void processEHH(const EHH& ehh, std::size_t line);
     void processXPEHH(XPEHH&& e, size_t line);
+    void beginProgress(std::size_t total);
+    void endProgress();
+    std::atomic<unsigned long long>& threadCounter();
+    void addTraces(std::vector<LocusTrace>& traces);
+    std::size_t numPending(std::size_t start, std::size_t end) const;
+    void checkpointIfDue(bool xpehh, bool binom);
+    MomentsByBin binMoments(const FreqVecMap& byFreq) const;
+    std::size_t binIndex(double freq) const { return (std::size_t) std::lround(freq*m_bins); }
+    static ChunkSource singleChunk(std::size_t start, std::size_t end);
+    HapMap::PrimitiveType* permutationMasks(HapMap* mA, HapMap* mB) const;
+
+    /**
+     * Padded to a cache line so that the threads do not contend when bumping their own counter.
+     */
+    struct alignas(64) ThreadCounter
+    {
+        ThreadCounter() : value{} {}
+        std::atomic<unsigned long long> value;
+    };
 
     std::size_t m_snpLength;
     double m_cutoff;
@@ -78,14 +279,49 @@ protected:
     XpehhInfoMap m_unStandXPEHHByLine;
     FreqVecMap m_unStandIHSByFreq;
     FreqVecMap m_unStandXPEHHByFreq;
+    FreqVecMap m_unStandNSLByFreq;
+    FreqVecMap m_unStandRsbByFreq;
     LineMap    m_standIHSSingle;
 
     std::atomic<unsigned long long> m_counter;
     std::atomic<unsigned long long> m_reachedEnd;
     std::atomic<unsigned long long> m_outsideMaf;
     std::atomic<unsigned long long> m_nanResults;
+    std::atomic<unsigned long long> m_windowEdge;
+
+    std::vector<ThreadCounter> m_threadCounters;
+    std::unique_ptr<ProgressReporter> m_reporter;
+    double m_progressInterval;
+    std::string m_metricsFile;
+    std::string m_progressLabel;
+
+    bool m_tracing;
+    std::vector<LocusTrace> m_traces;
+
+    std::vector<std::atomic<bool>> m_done;
+    std::string m_checkpointFile;
+    double m_checkpointInterval;
+    std::atomic<long long> m_nextCheckpoint;
+
+    std::size_t m_permutations;
+    unsigned long long m_permutationSeed;
+    bool m_nsl;
+    bool m_rsb;
 };
 
+#if MPI_FOUND
+/**
+ * Merge the bin moments of every rank of #comm, leaving the moments of all loci on every rank.
+ */
+IHSFinder::MomentsByBin allreduceMoments(const IHSFinder::MomentsByBin& moments, MPI_Comm comm);
+/**
+ * Write a text file whose rows are spread over the ranks of #comm. Each rank passes its pieces of the file
+ * keyed by the first locus they hold, and the file is #header followed by the pieces of every rank in order
+ * of their keys. Collective over #comm.
+ */
+bool writeOrdered(const std::string& filename, const std::string& header, const std::map<std::size_t, std::string>& pieces, MPI_Comm comm);
+#endif
+
 #include "ihsfinder-impl.hpp"
 
 #endif // IHSFINDER_H
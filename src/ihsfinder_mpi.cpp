@@ -0,0 +1,107 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ihsfinder.hpp"
+#include "mpirpc/reduce.hpp"
+#include <algorithm>
+#include <iostream>
+
+#if MPI_FOUND
+
+static void mergeMoments(void* in, void* inout, int* len, MPI_Datatype*)
+{
+    Moments* a = static_cast<Moments*>(in);
+    Moments* b = static_cast<Moments*>(inout);
+    for (int i = 0; i < *len; ++i)
+        b[i].merge(a[i]);
+}
+
+IHSFinder::MomentsByBin allreduceMoments(const IHSFinder::MomentsByBin& moments, MPI_Comm comm)
+{
+    MPI_Datatype type;
+    MPI_Type_contiguous(3, MPI_DOUBLE, &type);
+    MPI_Type_commit(&type);
+    MPI_Op op;
+    MPI_Op_create(&mergeMoments, 1, &op);
+    IHSFinder::MomentsByBin ret = moments;
+    mpirpc::allreduce(ret, op, comm, type);
+    MPI_Op_free(&op);
+    MPI_Type_free(&type);
+    return ret;
+}
+
+bool writeOrdered(const std::string& filename, const std::string& header, const std::map<std::size_t, std::string>& pieces, MPI_Comm comm)
+{
+    /*
+     * Every rank learns the key and length of every piece, so each one can work out where its own pieces go
+     * without sending any text.
+     */
+    int rank, numProcs;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &numProcs);
+    std::vector<uint64_t> local;
+    for (const auto& it : pieces)
+    {
+        local.push_back(it.first);
+        local.push_back(it.second.size());
+    }
+    int count = (int) local.size();
+    std::vector<int> counts(numProcs), displs(numProcs);
+    MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, comm);
+    for (int i = 1; i < numProcs; ++i)
+        displs[i] = displs[i-1] + counts[i-1];
+    std::vector<uint64_t> all(displs[numProcs-1] + counts[numProcs-1]);
+    MPI_Allgatherv(local.data(), count, MPI_UINT64_T, all.data(), counts.data(), displs.data(), MPI_UINT64_T, comm);
+
+    std::map<std::size_t, MPI_Offset> offsets;
+    for (std::size_t i = 0; i < all.size(); i += 2)
+        offsets[all[i]] = all[i+1];
+    MPI_Offset offset = header.size();
+    for (auto& it : offsets)
+    {
+        MPI_Offset length = it.second;
+        it.second = offset;
+        offset += length;
+    }
+
+    MPI_File f;
+    if (MPI_File_open(comm, const_cast<char*>(filename.c_str()), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &f) != MPI_SUCCESS)
+    {
+        std::cerr << "ERROR: Cannot open file for writing: " << filename << std::endl;
+        return false;
+    }
+    // Cuts off whatever an older, longer file had past the end.
+    MPI_File_set_size(f, offset);
+    if (rank == 0)
+        MPI_File_write_at(f, 0, const_cast<char*>(header.data()), (int) header.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+    for (const auto& it : pieces)
+    {
+        // MPI counts are ints, so very large pieces are written in several calls.
+        const std::size_t maxCount = 1ULL << 30;
+        for (std::size_t done = 0; done < it.second.size(); done += maxCount)
+        {
+            int n = (int) std::min(maxCount, it.second.size() - done);
+            MPI_File_write_at(f, offsets[it.first] + done, const_cast<char*>(it.second.data() + done), n, MPI_CHAR, MPI_STATUS_IGNORE);
+        }
+    }
+    MPI_File_close(&f);
+    return true;
+}
+
+#endif
@@ -38,7 +38,10 @@ int main(int argc, char** argv)
     Argument<bool> binom('a', "binom", "Use binomial coefficients rather than frequency squared for EHH", true, false);
     Argument<unsigned long long> maxExtend('e', "max-extend", "Maximum distance in bp to traverse when calculating EHH (default: 0 (disabled))", false, false, 0);
     Argument<const char*> locus('l', "locus", "Locus", false, false, 0);
-    ArgParse argparse({&help, &version, &hap, &map, &locus, &cutoff, &minMAF, &scale, &maxExtend, &binom}, "Usage: ehhbin --map input.map --hap input.hap --locus id");
+    Argument<const char*> loci(ArgumentBase::NO_SHORT_OPT, "loci", "File of locus ids to calculate in parallel and write to --out instead of a single --locus", false, false, "");
+    Argument<const char*> outfile('o', "out", "Output file for --loci", false, false, "out.txt");
+    Argument<bool> binaryOut(ArgumentBase::NO_SHORT_OPT, "binary-out", "Write --out as a binary columnar file instead of a tab separated table (see columns.hpp)", true, false);
+    ArgParse argparse({&help, &version, &hap, &map, &locus, &loci, &outfile, &binaryOut, &cutoff, &minMAF, &scale, &maxExtend, &binom}, "Usage: ehhbin --map input.map --hap input.hap --locus id | --loci file [--out outfile]");
     if (!argparse.parseArguments(argc, argv)) 
     {
         return 3;
@@ -53,11 +56,17 @@ int main(int argc, char** argv)
         argparse.showVersion();
         return 0;
     }
-    else if (!hap.wasFound() || !map.wasFound() || !locus.wasFound())
+    else if (!hap.wasFound() || !map.wasFound() || locus.wasFound() == loci.wasFound())
     {
-        std::cout << "Please specify --hap, --map, and --locus." << std::endl;
+        std::cout << "Please specify --hap, --map, and either --locus or --loci." << std::endl;
         return 4;
     }
+    if (loci.wasFound())
+    {
+        if (!calcEhhLoci(hap.value(), map.value(), loci.value(), outfile.value(), cutoff.value(), minMAF.value(), (double) scale.value(), maxExtend.value(), binom.value(), binaryOut.value()))
+            return 1;
+        return 0;
+    }
     using HapMapType = HapMap;
     HapMapType hmap;
     if (!hmap.loadHap(hap.value()))
@@ -82,5 +91,7 @@ int main(int argc, char** argv)
     e.printEHH(&hmap);
     std::cout << "IHH_0: " << e.iHH_0 << " IHH_1: " << e.iHH_1 << std::endl;
     std::cout << "iHS: " << log(e.iHH_0/e.iHH_1) << std::endl;
+    std::cout << "SL_0: " << e.SL_0 << " SL_1: " << e.SL_1 << std::endl;
+    std::cout << "nSL: " << log(e.SL_0/e.SL_1) << std::endl;
     std::cout << "MAF: " << (double)e.num/(double)hmap.snpLength() << std::endl;
 }
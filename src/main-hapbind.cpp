@@ -0,0 +1,99 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+
+#include "hapbin.hpp"
+#include "hapbind.hpp"
+#include "argparse.hpp"
+
+int main(int argc, char** argv)
+{
+    Argument<bool> help('h', "help", "Show this help", true, false);
+    Argument<bool> version('v', "version", "Version information", true, false);
+    Argument<std::string> populations('p', "populations", "File listing the populations to serve, one \"name hap\" line each", false, false, "");
+    Argument<std::string> map('m', "map", "Map file", false, false, "");
+    Argument<std::string> socketPath('S', "socket", "Unix socket to listen on (default: hapbind.sock)", false, false, "hapbind.sock");
+    Argument<unsigned long long> workers('w', "workers", "Number of requests answered at once (default: number of hardware threads)", false, false, 0);
+    Argument<unsigned long long> cacheSize(ArgumentBase::NO_SHORT_OPT, "cache", "Number of responses to keep, 0 to disable (default: 10000)", false, false, 10000);
+    Argument<double> cutoff('c', "cutoff", "EHH cutoff value (default: 0.05)", false, false, 0.05);
+    Argument<double> minMAF('f', "minmaf", "Minimum allele frequency (default: 0.05)", false, false, 0.05);
+    Argument<unsigned long long> scale('s', "scale", "Gap scale parameter in bp, used to scale gaps > scale parameter as in Voight, et al.", false, false, 20000);
+    Argument<bool> binom('a', "binom", "Use binomial coefficients rather than frequency squared for EHH", true, false);
+    Argument<unsigned long long> maxExtend('e', "max-extend", "Maximum distance in bp to traverse when calculating EHH (default: 0 (disabled))", false, false, 0);
+    ArgParse argparse({&help, &version, &populations, &map, &socketPath, &workers, &cacheSize, &cutoff, &minMAF, &scale, &maxExtend, &binom}, "Usage: hapbind --map input.map --populations populations.txt [--socket path]");
+    if (!argparse.parseArguments(argc, argv))
+    {
+        return 3;
+    }
+    if (help.value())
+    {
+        argparse.showHelp();
+        return 0;
+    }
+    else if (version.value())
+    {
+        argparse.showVersion();
+        return 0;
+    }
+    else if (!populations.wasFound() || !map.wasFound())
+    {
+        std::cout << "Please specify --populations and --map." << std::endl;
+        return 4;
+    }
+
+    QueryServer server(cutoff.value(), minMAF.value(), (double) scale.value(), maxExtend.value(), binom.value(), cacheSize.value());
+    std::ifstream f(populations.value());
+    if (!f.good())
+    {
+        std::cerr << "ERROR: Cannot open file or file not found: " << populations.value() << std::endl;
+        return 1;
+    }
+    std::string line;
+    while (std::getline(f, line))
+    {
+        std::istringstream fields(line);
+        std::string name, hap;
+        if (!(fields >> name) || name[0] == '#')
+            continue;
+        if (!(fields >> hap))
+        {
+            std::cerr << "ERROR: Population " << name << " in " << populations.value() << " has no hap file." << std::endl;
+            return 1;
+        }
+        if (!server.addPopulation(name, hap, map.value()))
+            return 1;
+        std::cout << "Loaded " << name << " from " << hap << std::endl;
+    }
+
+    if (!server.numPopulations())
+    {
+        std::cerr << "ERROR: No populations listed in " << populations.value() << std::endl;
+        return 1;
+    }
+
+    std::size_t numWorkers = workers.value();
+    if (numWorkers == 0)
+        numWorkers = std::max(1U, std::thread::hardware_concurrency());
+    return server.serve(socketPath.value(), numWorkers) ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <iostream>
+
+#include "hapbin.hpp"
+#include "hstats.hpp"
+#include "argparse.hpp"
+
+int main(int argc, char** argv)
+{
+    Argument<bool> help('h', "help", "Show this help", true, false);
+    Argument<bool> version('v', "version", "Version information", true, false);
+    Argument<std::string> hap('d', "hap", "Hap file", false, false, "");
+    Argument<std::string> map('m', "map", "Map file", false, false, "");
+    Argument<unsigned long long> window('w', "window", "Number of loci in each window (default: 400)", false, false, 400);
+    Argument<unsigned long long> step('s', "step", "Number of loci between the starts of windows (default: 50)", false, false, 50);
+    Argument<std::string> outfile('o', "out", "Output file", false, false, "out.txt");
+    Argument<bool> binaryOut(ArgumentBase::NO_SHORT_OPT, "binary-out", "Write --out as a binary columnar file instead of a tab separated table (see columns.hpp)", true, false);
+    ArgParse argparse({&help, &version, &hap, &map, &outfile, &window, &step, &binaryOut}, "Usage: hstatsbin --map input.map --hap input.hap [--window loci] [--step loci] [--out outfile]");
+    if (!argparse.parseArguments(argc, argv))
+    {
+        return 3;
+    }
+    if (help.value())
+    {
+        argparse.showHelp();
+        return 0;
+    }
+    else if (version.value())
+    {
+        argparse.showVersion();
+        return 0;
+    }
+    else if (!hap.wasFound() || !map.wasFound())
+    {
+        std::cout << "Please specify --hap and --map." << std::endl;
+        return 4;
+    }
+    else if (window.value() == 0 || step.value() == 0)
+    {
+        std::cerr << "ERROR: --window and --step must be at least 1." << std::endl;
+        return 2;
+    }
+    if (!calcHStats(hap.value(), map.value(), outfile.value(), window.value(), step.value(), binaryOut.value()))
+        return 1;
+    return 0;
+}
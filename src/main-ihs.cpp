@@ -29,13 +29,21 @@
 #endif
 #include <functional>
 #include <cstdlib>
+#include <cstdio>
 
 int main(int argc, char** argv)
 {
     int ret = 0;
+    int rank = 0;
+    bool sweep;
+    const char* singleProcess;
     std::size_t numSnps;
+    RunOptions options;
 #if MPI_FOUND
-    MPI_Init(&argc, &argv);
+    // Rank 0 serves requests from a progress thread when the MPI library allows it.
+    int threadSupport;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &threadSupport);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 #endif
     Argument<bool> help('h', "help", "Show this help", true, false);
     Argument<bool> version('v', "version", "Version information", true, false);
@@ -48,12 +56,39 @@ int main(int argc, char** argv)
     Argument<bool> binom('a', "binom", "Use binomial coefficients rather than frequency squared for EHH", true, false);
     Argument<unsigned long long> maxExtend('e', "max-extend", "Maximum distance in bp to traverse when calculating EHH (default: 0 (disabled))", false, false, 0);
     Argument<std::string> outfile('o', "out", "Output file", false, false, "out.txt");
-    ArgParse argparse({&help, &version, &hap, &map, &outfile, &cutoff, &minMAF, &scale, &binfac, &maxExtend, &binom}, "Usage: ihsbin --map input.map --hap input.hap [--ascii] [--out outfile]");
+    Argument<double> progress('p', "progress", "Seconds between progress reports, 0 to disable (default: 10)", false, false, 10.0);
+    Argument<std::string> metrics(ArgumentBase::NO_SHORT_OPT, "metrics", "Write progress metrics as tab separated rows to this file", false, false, "");
+    Argument<std::string> checkpoint(ArgumentBase::NO_SHORT_OPT, "checkpoint", "Periodically save completed loci to this file", false, false, "");
+    Argument<double> checkpointInterval(ArgumentBase::NO_SHORT_OPT, "checkpoint-interval", "Seconds between checkpoints (default: 600)", false, false, 600.0);
+    Argument<bool> resume(ArgumentBase::NO_SHORT_OPT, "resume", "Skip the loci already saved in the --checkpoint file", true, false);
+    Argument<std::string> shard(ArgumentBase::NO_SHORT_OPT, "shard", "Only calculate shard i/N of the loci and write unstandardized partial results to --out", false, false, "");
+    Argument<unsigned long long> rangeStart(ArgumentBase::NO_SHORT_OPT, "start", "Only calculate the loci from this index and write unstandardized partial results to --out", false, false, 0);
+    Argument<unsigned long long> rangeEnd(ArgumentBase::NO_SHORT_OPT, "end", "Only calculate the loci before this index and write unstandardized partial results to --out", false, false, 0);
+    Argument<std::string> merge(ArgumentBase::NO_SHORT_OPT, "merge", "Combine partial results from --shard or --start/--end runs and write the standardized output. May be given multiple times.", true, false, "");
+    Argument<unsigned long long> chunkSize(ArgumentBase::NO_SHORT_OPT, "chunk-size", "Number of loci MPI ranks take at a time (default: 0 (automatic))", false, false, 0);
+    Argument<unsigned long long> batchSize(ArgumentBase::NO_SHORT_OPT, "batch-size", "Largest number of loci MPI ranks send results for in one message (default: 65536, 0: whole chunks)", false, false, 65536);
+    Argument<bool> partitionLoad(ArgumentBase::NO_SHORT_OPT, "partition-load", "MPI ranks calculate a fixed slice of the loci and only load the rows they need (binary hap files only)", true, false);
+    Argument<unsigned long long> halo(ArgumentBase::NO_SHORT_OPT, "halo", "Initial rows loaded on each side of a slice with --partition-load when --max-extend is not set (default: 1000)", false, false, 1000);
+    Argument<bool> progressThread(ArgumentBase::NO_SHORT_OPT, "progress-thread", "MPI rank 0 handles results from other ranks on a separate thread while it calculates (default). Disable with --no-progress-thread", false, true);
+    Argument<bool> distributed(ArgumentBase::NO_SHORT_OPT, "distributed-normalize", "MPI ranks standardize and write their own results instead of sending them to rank 0 (not with --checkpoint)", true, false);
+    Argument<bool> sharedMemory(ArgumentBase::NO_SHORT_OPT, "shared-memory", "MPI ranks on the same node share one copy of the input (default). Disable with --no-shared-memory", false, true);
+    Argument<bool> binaryOut(ArgumentBase::NO_SHORT_OPT, "binary-out", "Write --out as a binary columnar file instead of a tab separated table (see columns.hpp)", true, false);
+    Argument<std::string> batch(ArgumentBase::NO_SHORT_OPT, "batch", "Calculate every chromosome listed in this file, one \"hap map out\" line each, in a single process", false, false, "");
+    Argument<bool> genomeWide(ArgumentBase::NO_SHORT_OPT, "genome-wide", "With --batch, standardize with the frequency bins of all chromosomes together", true, false);
+    Argument<bool> nsl(ArgumentBase::NO_SHORT_OPT, "nsl", "Also calculate nSL from the same walks and write it and its standardized score next to iHS", true, false);
+    Argument<double> sweepCutoff(ArgumentBase::NO_SHORT_OPT, "sweep-cutoff", "Calculate iHS with this EHH cutoff in a sweep, written to [out].c[cutoff]-e[max-extend][-binom]. May be given multiple times.", true, false, 0.05);
+    Argument<unsigned long long> sweepMaxExtend(ArgumentBase::NO_SHORT_OPT, "sweep-max-extend", "Calculate iHS with this maximum extension in a sweep. May be given multiple times.", true, false, 0);
+    Argument<bool> sweepBoth(ArgumentBase::NO_SHORT_OPT, "sweep-both", "Calculate every setting of a sweep with both frequency squared and binomial EHH", true, false);
+    Argument<std::string> trace(ArgumentBase::NO_SHORT_OPT, "trace", "Write per-locus timing, rows visited and branch counts to this file, with histograms in [file].hist", false, false, "");
+    ArgParse argparse({&help, &version, &hap, &map, &outfile, &cutoff, &minMAF, &scale, &binfac, &maxExtend, &binom, &progress, &metrics, &trace, &checkpoint, &checkpointInterval, &resume, &shard, &rangeStart, &rangeEnd, &merge, &chunkSize, &batchSize, &partitionLoad, &halo, &sharedMemory, &progressThread, &distributed, &binaryOut, &batch, &genomeWide, &nsl, &sweepCutoff, &sweepMaxExtend, &sweepBoth}, "Usage: ihsbin --map input.map --hap input.hap [--ascii] [--out outfile]");
     if (!argparse.parseArguments(argc, argv))
     {
         ret = 1;
         goto out;
     }
+    // Modes which only run in a single process, without checkpoints or distributed runs.
+    sweep = sweepCutoff.wasFound() || sweepMaxExtend.wasFound() || sweepBoth.value();
+    singleProcess = batch.wasFound() ? "--batch" : nsl.value() ? "--nsl" : sweep ? "A sweep" : nullptr;
     if (help.value())
     {
         argparse.showHelp();
@@ -64,17 +99,122 @@ int main(int argc, char** argv)
         argparse.showVersion();
         goto out;
     }
-    else if (!hap.wasFound() || !map.wasFound())
+    else if (singleProcess && (checkpoint.wasFound() || shard.wasFound() || rangeStart.wasFound() || rangeEnd.wasFound() || merge.wasFound() || distributed.value()))
+    {
+        std::cerr << "ERROR: " << singleProcess << " runs in a single process and cannot be combined with --checkpoint, --shard, --start, --end, --merge or --distributed-normalize." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (batch.wasFound() && (hap.wasFound() || map.wasFound()))
+    {
+        std::cerr << "ERROR: --batch takes the hap and map files from the manifest and cannot be combined with --hap or --map." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (sweep && (batch.wasFound() || nsl.value()))
+    {
+        std::cerr << "ERROR: A sweep cannot be combined with --batch or --nsl." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (genomeWide.value() && !batch.wasFound())
+    {
+        std::cerr << "ERROR: --genome-wide requires --batch." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (!batch.wasFound() && (!hap.wasFound() || !map.wasFound()))
     {
         std::cout << "Please specify --hap and --map." << std::endl;
         ret = 2;
         goto out;
     }
+    else if (resume.value() && !checkpoint.wasFound())
+    {
+        std::cerr << "ERROR: --resume requires --checkpoint." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (distributed.value() && binaryOut.value())
+    {
+        std::cerr << "ERROR: --distributed-normalize cannot be combined with --binary-out." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (distributed.value() && checkpoint.wasFound())
+    {
+        std::cerr << "ERROR: --distributed-normalize cannot be combined with --checkpoint." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (merge.wasFound() && (shard.wasFound() || rangeStart.wasFound() || rangeEnd.wasFound()))
+    {
+        std::cerr << "ERROR: --merge cannot be combined with --shard, --start or --end." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (shard.wasFound() && (rangeStart.wasFound() || rangeEnd.wasFound()))
+    {
+        std::cerr << "ERROR: --shard cannot be combined with --start or --end." << std::endl;
+        ret = 2;
+        goto out;
+    }
+    else if (shard.wasFound() && (sscanf(shard.value().c_str(), "%d/%d", &options.shard, &options.numShards) != 2
+                                  || options.numShards < 1 || options.shard < 0 || options.shard >= options.numShards))
+    {
+        std::cerr << "ERROR: --shard expects i/N with 0 <= i < N." << std::endl;
+        ret = 2;
+        goto out;
+    }
 
-    numSnps = HapMap::querySnpLength(hap.value().c_str());
-    std::cout << "Chromosomes per SNP: " << numSnps << std::endl;
+    if (!batch.wasFound())
+    {
+        numSnps = HapMap::querySnpLength(hap.value().c_str());
+        std::cout << "Chromosomes per SNP: " << numSnps << std::endl;
+    }
 
-    calcIhs(hap.value(), map.value(), outfile.value(), cutoff.value(), minMAF.value(), (double) scale.value(), maxExtend.value(), binfac.value(), binom.value());
+    options.progressInterval = progress.value();
+    options.metricsFile = metrics.value();
+    options.traceFile = trace.value();
+    options.checkpointFile = checkpoint.value();
+    options.checkpointInterval = checkpointInterval.value();
+    options.resume = resume.value();
+    options.partial = shard.wasFound() || rangeStart.wasFound() || rangeEnd.wasFound();
+    options.rangeStart = rangeStart.value();
+    options.rangeEnd = rangeEnd.value();
+    options.chunkSize = chunkSize.value();
+    options.batchSize = batchSize.value();
+    options.partitionLoad = partitionLoad.value();
+    options.halo = halo.value();
+    options.sharedMemory = sharedMemory.value();
+    options.progressThread = progressThread.value();
+    options.distributed = distributed.value();
+    options.binaryOutput = binaryOut.value();
+    options.genomeWide = genomeWide.value();
+    options.nsl = nsl.value();
+    if (merge.wasFound())
+        options.mergeFiles = merge.values();
+    /*
+     * Batches, sweeps, nSL, shards and merges are meant for nodes or clusters without MPI, so they run in a single
+     * process. Under mpirun only rank 0 runs them and the other ranks wait for it at the final barrier.
+     */
+    if ((singleProcess || options.partial || !options.mergeFiles.empty()) && rank != 0)
+    {
+        goto out;
+    }
+    if (sweep)
+    {
+        std::vector<double> cutoffs = sweepCutoff.wasFound() ? sweepCutoff.values() : std::vector<double>{cutoff.value()};
+        std::vector<unsigned long long> maxExtends = sweepMaxExtend.wasFound() ? sweepMaxExtend.values() : std::vector<unsigned long long>{maxExtend.value()};
+        std::vector<bool> binoms = sweepBoth.value() ? std::vector<bool>{false, true} : std::vector<bool>{binom.value()};
+        calcIhsSweep(hap.value(), map.value(), outfile.value(), cutoffs, maxExtends, binoms, minMAF.value(), (double) scale.value(), binfac.value(), options);
+    }
+    else if (batch.wasFound())
+        calcIhsBatch(batch.value(), cutoff.value(), minMAF.value(), (double) scale.value(), maxExtend.value(), binfac.value(), binom.value(), options);
+    else if (options.partial || !options.mergeFiles.empty() || options.nsl)
+        calcIhsNoMpi(hap.value(), map.value(), outfile.value(), cutoff.value(), minMAF.value(), (double) scale.value(), maxExtend.value(), binfac.value(), binom.value(), options);
+    else
+        calcIhs(hap.value(), map.value(), outfile.value(), cutoff.value(), minMAF.value(), (double) scale.value(), maxExtend.value(), binfac.value(), binom.value(), options);
 out:
 #if MPI_FOUND
     MPI_Barrier(MPI_COMM_WORLD);
@@ -0,0 +1,54 @@
+/*
+ * MPIRPC: MPI based invocation of functions on other ranks
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "counter.hpp"
+
+namespace mpirpc
+{
+
+SharedCounter::SharedCounter(MPI_Comm comm, unsigned long long initial, int root) : m_value(nullptr), m_root(root)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Aint size = (rank == root) ? sizeof(unsigned long long) : 0;
+    MPI_Win_allocate(size, sizeof(unsigned long long), MPI_INFO_NULL, comm, &m_value, &m_win);
+    if (rank == root)
+    {
+        MPI_Win_lock(MPI_LOCK_EXCLUSIVE, root, 0, m_win);
+        *m_value = initial;
+        MPI_Win_unlock(root, m_win);
+    }
+    MPI_Barrier(comm);
+}
+
+SharedCounter::~SharedCounter()
+{
+    MPI_Win_free(&m_win);
+}
+
+unsigned long long SharedCounter::fetchAdd(unsigned long long value)
+{
+    unsigned long long ret;
+    MPI_Win_lock(MPI_LOCK_SHARED, m_root, 0, m_win);
+    MPI_Fetch_and_op(&value, &ret, MPI_UNSIGNED_LONG_LONG, m_root, 0, MPI_SUM, m_win);
+    MPI_Win_unlock(m_root, m_win);
+    return ret;
+}
+
+}
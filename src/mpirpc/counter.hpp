@@ -0,0 +1,55 @@
+/*
+ * MPIRPC: MPI based invocation of functions on other ranks
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MPIRPC_COUNTER_HPP
+#define MPIRPC_COUNTER_HPP
+
+#include <mpi.h>
+
+namespace mpirpc
+{
+
+/**
+ * @brief A counter shared by all ranks of a communicator.
+ *
+ * The counter lives in an RMA window on the root rank and is incremented with MPI_Fetch_and_op under a
+ * passive target lock, so ranks can take work from it without the root having to answer any messages.
+ * Construction and destruction are collective.
+ */
+class SharedCounter
+{
+public:
+    SharedCounter(MPI_Comm comm, unsigned long long initial = 0ULL, int root = 0);
+    ~SharedCounter();
+
+    /**
+     * @brief fetchAdd Atomically add #value to the counter.
+     * @return The value of the counter before the addition.
+     */
+    unsigned long long fetchAdd(unsigned long long value);
+
+private:
+    MPI_Win m_win;
+    unsigned long long *m_value;
+    int m_root;
+};
+
+}
+
+#endif // MPIRPC_COUNTER_HPP
@@ -20,13 +20,14 @@
 #include "manager.hpp"
 #include "common.hpp"
 #include <mpi.h>
+#include <chrono>
 
 #define BUFFER_SIZE 10*1024*1024
 
 namespace mpirpc
 {
 
-Manager::Manager(MPI_Comm comm) : m_comm(comm), m_nextTypeId(0), m_count(0), m_shutdown(false)
+Manager::Manager(MPI_Comm comm) : m_comm(comm), m_nextTypeId(0), m_count(0), m_shutdown(false), m_progressRunning(false)
 {
     MPI_Comm_rank(m_comm, &m_rank);
     MPI_Comm_size(comm, &m_numProcs);
@@ -46,6 +47,7 @@ Manager::Manager(MPI_Comm comm) : m_comm(comm), m_nextTypeId(0), m_count(0), m_s
 
 Manager::~Manager()
 {
+    stopProgressThread();
     MPI_Type_free(&MpiObjectInfo);
     for (auto i : m_mpiMessages)
         delete i.second;
@@ -80,6 +82,7 @@ void Manager::notifyNewObject(TypeId type, ObjectId id)
 
 void Manager::sendRawMessage(int rank, const std::vector<char> *data, int tag)
 {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
     if (checkSends() && !m_shutdown) {
         MPI_Request req;
         MPI_Issend((void*) data->data(), data->size(), MPI_CHAR, rank, tag, m_comm, &req);
@@ -134,6 +137,48 @@ bool Manager::checkSends() {
 }
 
 bool Manager::checkMessages() {
+    bool handled;
+    return pollMessages(handled);
+}
+
+bool Manager::waitMessages(double timeout) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    std::chrono::microseconds backoff(10);
+    while (true) {
+        bool handled = false;
+        if (!pollMessages(handled))
+            return false;
+        if (handled || std::chrono::steady_clock::now() >= deadline)
+            return true;
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff*2, std::chrono::microseconds(1000));
+    }
+}
+
+bool Manager::startProgressThread() {
+    int provided;
+    MPI_Query_thread(&provided);
+    if (provided != MPI_THREAD_MULTIPLE || m_progressRunning)
+        return false;
+    m_progressRunning = true;
+    m_progressThread = std::thread(&Manager::progressLoop, this);
+    return true;
+}
+
+void Manager::stopProgressThread() {
+    if (!m_progressRunning)
+        return;
+    m_progressRunning = false;
+    m_progressThread.join();
+}
+
+void Manager::progressLoop() {
+    while (m_progressRunning && waitMessages()) {}
+}
+
+bool Manager::pollMessages(bool& handled) {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    handled = false;
     if (m_shutdown)
         return false;
     checkSends();
@@ -142,6 +187,7 @@ bool Manager::checkMessages() {
         MPI_Status status;
         MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, m_comm, &flag, &status);
         if (flag) {
+            handled = true;
             switch (status.MPI_TAG) {
                 case MPIRPC_TAG_SHUTDOWN:
                     m_shutdown = true;
@@ -198,6 +244,7 @@ void Manager::registerRemoteObject(int rank, TypeId type, ObjectId id) {
 }
 
 void Manager::shutdown() {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
     int buf = 0;
     for (int i = 0; i < m_numProcs; ++i)
     {
@@ -40,6 +40,9 @@
 #include <iterator>
 #include <exception>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <mpi.h>
 
 #include "objectwrapper.hpp"
@@ -650,6 +653,26 @@ public:
      */
     bool checkMessages();
 
+    /**
+     * @brief Like Manager::checkMessages(), but when no message is waiting, sleep with a growing backoff until
+     * one arrives or #timeout seconds have passed, instead of spinning on MPI_Iprobe.
+     * @return True to continue running. False indicates this process should shut down.
+     */
+    bool waitMessages(double timeout = 0.01);
+
+    /**
+     * @brief Handle incoming commands on a separate thread, which sleeps while there are none, so that the
+     * calling thread is free for other work. Needs MPI_THREAD_MULTIPLE; fails without starting the thread
+     * otherwise. Registered functions then run on that thread and must be thread safe.
+     * @return True if the thread was started.
+     */
+    bool startProgressThread();
+
+    /**
+     * @brief Stop the thread started by Manager::startProgressThread() and wait for it to finish.
+     */
+    void stopProgressThread();
+
     /**
      * @brief Checks on the status of the non-blocking sends and frees resources of completed sends.
      * @return True to continue running. False indicates this process should shut down.
@@ -887,6 +910,13 @@ protected:
         return ret;
     }
 
+    /**
+     * @brief Handle all waiting messages, setting #handled if there were any.
+     */
+    bool pollMessages(bool& handled);
+
+    void progressLoop();
+
     /**
      * @brief Handle a message indicating a remote process is registering a new object.
      */
@@ -934,6 +964,14 @@ protected:
     unsigned long long m_count;
     bool m_shutdown;
     MPI_Datatype MpiObjectInfo;
+
+    /**
+     * Held while handling messages or sending, so that a progress thread and the calling thread do not use
+     * MPI or the queues at the same time. Recursive because handlers may send.
+     */
+    std::recursive_mutex m_mutex;
+    std::thread m_progressThread;
+    std::atomic<bool> m_progressRunning;
 };
 
 }
@@ -18,6 +18,7 @@
  */
 
 #include "parameterstream.hpp"
+#include <algorithm>
 #include <cstring>
 
 ParameterStream::ParameterStream(std::vector<char>* buffer)
@@ -278,7 +279,31 @@ void ParameterStream::writeBytes(const char* b, size_t length)
 
 void ParameterStream::readBytes(char *& b, size_t length)
 {
-    std::copy(&(*m_data)[m_pos], &(*m_data)[m_pos+length], b);
+    if (length > 0)
+        std::memcpy(b, m_data->data() + m_pos, length);
     m_pos += length;
 }
 
+const char* ParameterStream::view(size_t length)
+{
+    const char* p = m_data->data() + m_pos;
+    m_pos += length;
+    return p;
+}
+
+void ParameterStream::reserve(size_t length)
+{
+    if (m_data->capacity() < m_data->size() + length)
+        m_data->reserve(std::max(m_data->size() + length, 2*m_data->capacity()));
+}
+
+void ParameterStream::pad(size_t alignment)
+{
+    m_data->resize(m_data->size() + (alignment - m_data->size() % alignment) % alignment, 0);
+}
+
+void ParameterStream::skipPadding(size_t alignment)
+{
+    m_pos += (alignment - m_pos % alignment) % alignment;
+}
+
@@ -26,6 +26,7 @@
 #include<string>
 #include<sstream>
 #include<map>
+#include<type_traits>
 
 class ParameterStream
 {
@@ -38,6 +39,20 @@ public:
 
     void writeBytes(const char* b, size_t length);
     void readBytes(char*& b, size_t length);
+    /**
+     * Return a pointer to the next #length bytes in the buffer and skip them, without copying.
+     */
+    const char* view(size_t length);
+    /**
+     * Make room for #length more bytes, so that large writes do not reallocate repeatedly.
+     */
+    void reserve(size_t length);
+    /**
+     * Write zero bytes up to the next multiple of #alignment, or skip them when reading, so that arrays
+     * start aligned in the buffer. Received buffers hold the whole message, so they line up the same way.
+     */
+    void pad(size_t alignment);
+    void skipPadding(size_t alignment);
     char* data();
     const char* constData() const;
     std::vector<char>* dataVector() const;
@@ -96,19 +111,63 @@ inline typename std::decay<T>::type unmarshal(ParameterStream& s) {
     return ret;
 }
 
+/**
+ * Arrays of these types are written as raw bytes with a single copy instead of element by element. Pointers
+ * are excluded since they are written as the strings they point to.
+ */
 template<typename T>
-ParameterStream& operator<<(ParameterStream& out, const std::vector<T>& vector)
+struct IsBulkCopyable : std::integral_constant<bool, std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value && !std::is_same<T, bool>::value> {};
+
+/**
+ * A read-only view of an array inside a ParameterStream, read without copying. It is only valid while the
+ * stream's buffer is, which for a function invoked through mpirpc is until the function returns. Reads the
+ * same format a std::vector<T> is written in.
+ */
+template<typename T>
+struct ArrayView
+{
+    ArrayView() : data(nullptr), size(0) {}
+    const T* data;
+    std::size_t size;
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+    const T& operator[](std::size_t i) const { return data[i]; }
+};
+
+namespace detail
+{
+template<typename T>
+void writeVector(ParameterStream& out, const std::vector<T>& vector, std::true_type)
+{
+    out.reserve(sizeof(std::size_t) + alignof(T) + vector.size()*sizeof(T));
+    out << vector.size();
+    out.pad(alignof(T));
+    out.writeBytes(reinterpret_cast<const char*>(vector.data()), vector.size()*sizeof(T));
+}
+
+template<typename T>
+void writeVector(ParameterStream& out, const std::vector<T>& vector, std::false_type)
 {
     out << vector.size();
     for (std::size_t i = 0; i < vector.size(); ++i)
     {
         out << vector[i];
     }
-    return out;
 }
 
-template <typename T>
-ParameterStream& operator>>(ParameterStream& in, std::vector<T>& vector)
+template<typename T>
+void readVector(ParameterStream& in, std::vector<T>& vector, std::true_type)
+{
+    std::size_t size;
+    in >> size;
+    in.skipPadding(alignof(T));
+    vector.resize(size);
+    char* p = reinterpret_cast<char*>(vector.data());
+    in.readBytes(p, size*sizeof(T));
+}
+
+template<typename T>
+void readVector(ParameterStream& in, std::vector<T>& vector, std::false_type)
 {
     std::size_t size;
     in >> size;
@@ -119,14 +178,40 @@ ParameterStream& operator>>(ParameterStream& in, std::vector<T>& vector)
         in >> val;
         vector[i] = val;
     }
+}
+}
+
+template<typename T>
+ParameterStream& operator<<(ParameterStream& out, const std::vector<T>& vector)
+{
+    detail::writeVector(out, vector, IsBulkCopyable<T>());
+    return out;
+}
+
+template <typename T>
+ParameterStream& operator>>(ParameterStream& in, std::vector<T>& vector)
+{
+    detail::readVector(in, vector, IsBulkCopyable<T>());
+    return in;
+}
+
+template <typename T>
+ParameterStream& operator>>(ParameterStream& in, ArrayView<T>& view)
+{
+    static_assert(IsBulkCopyable<T>::value, "ArrayView needs a trivially copyable type");
+    in >> view.size;
+    in.skipPadding(alignof(T));
+    view.data = reinterpret_cast<const T*>(in.view(view.size*sizeof(T)));
     return in;
 }
 
 template<typename T, typename U>
 ParameterStream& operator<<(ParameterStream& out, const std::map<T, U>& map)
 {
+    if (IsBulkCopyable<T>::value && IsBulkCopyable<U>::value)
+        out.reserve(sizeof(std::size_t) + map.size()*(sizeof(T) + sizeof(U)));
     out <<  map.size();
-    for (auto pair : map)
+    for (const auto& pair : map)
     {
         out << pair.first << pair.second;
     }
@@ -143,7 +228,8 @@ ParameterStream& operator>>(ParameterStream& in, std::map<T, U>& map)
         T first;
         U second;
         in >> first >> second;
-        map.insert(std::make_pair(first, second));
+        // Maps are written in order, so each element goes at the end.
+        map.emplace_hint(map.end(), std::move(first), std::move(second));
     }
     return in;
 }
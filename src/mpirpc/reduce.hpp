@@ -21,7 +21,9 @@
 #define REDUCE_HPP
 
 #include <type_traits>
+#include <vector>
 #include <mpi.h>
+#include "mpitype.hpp"
 
 namespace mpirpc
 {
@@ -46,6 +48,28 @@ unsigned long allreduce(unsigned long value, MPI_Op op, int count, MPI_Comm comm
 float allreduce(float value, MPI_Op op, int count, MPI_Comm comm);
 double allreduce(double value, MPI_Op op, int count, MPI_Comm comm);
 
+/**
+ * Reduce #values element-wise over #comm in place, leaving the result on every rank. Every rank must pass
+ * the same number of values. #type defaults to the MPI type of T; pass a derived type together with a
+ * user defined #op to reduce structures.
+ */
+template<typename T>
+void allreduce(std::vector<T>& values, MPI_Op op, MPI_Comm comm, MPI_Datatype type = mpiType<T>())
+{
+    MPI_Allreduce(MPI_IN_PLACE, values.data(), (int) values.size(), type, op, comm);
+}
+
+template<typename T>
+void reduce(std::vector<T>& values, MPI_Op op, int root, MPI_Comm comm, MPI_Datatype type = mpiType<T>())
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (rank == root)
+        MPI_Reduce(MPI_IN_PLACE, values.data(), (int) values.size(), type, op, root, comm);
+    else
+        MPI_Reduce(values.data(), nullptr, (int) values.size(), type, op, root, comm);
+}
+
 }
 
 #endif // REDUCE_HPP
@@ -0,0 +1,114 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "output.hpp"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+TextBlock& TextBlock::operator<<(unsigned long long v)
+{
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do
+    {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    m_data.append(p, buf + sizeof(buf) - p);
+    return *this;
+}
+
+TextBlock& TextBlock::operator<<(int v)
+{
+    if (v < 0)
+    {
+        m_data.push_back('-');
+        return *this << (unsigned long long) -(long long) v;
+    }
+    return *this << (unsigned long long) v;
+}
+
+TextBlock& TextBlock::operator<<(double v)
+{
+    // The default std::ostream formatting of a double is printf's %g.
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%g", v);
+    m_data.append(buf, n);
+    return *this;
+}
+
+void ColumnTable::add(const std::string& name, std::vector<uint64_t> values)
+{
+    Column c;
+    c.name = name;
+    c.type = ColumnInfo::UInt64;
+    c.u = std::move(values);
+    m_columns.push_back(std::move(c));
+}
+
+void ColumnTable::add(const std::string& name, std::vector<double> values)
+{
+    Column c;
+    c.name = name;
+    c.type = ColumnInfo::Float64;
+    c.d = std::move(values);
+    m_columns.push_back(std::move(c));
+}
+
+bool ColumnTable::write(const std::string& filename) const
+{
+    ColumnFileHeader header;
+    header.magic = columnFileMagic;
+    header.version = columnFileVersion;
+    header.numRows = m_columns.empty() ? 0 : std::max(m_columns[0].u.size(), m_columns[0].d.size());
+    header.numColumns = m_columns.size();
+
+    std::vector<ColumnInfo> infos(m_columns.size());
+    uint64_t offset = sizeof(ColumnFileHeader) + infos.size()*sizeof(ColumnInfo);
+    for (std::size_t i = 0; i < m_columns.size(); ++i)
+    {
+        std::memset(&infos[i], 0, sizeof(ColumnInfo));
+        std::strncpy(infos[i].name, m_columns[i].name.c_str(), sizeof(infos[i].name) - 1);
+        infos[i].type = m_columns[i].type;
+        offset = (offset + columnAlignment - 1)/columnAlignment*columnAlignment;
+        infos[i].offset = offset;
+        offset += header.numRows*8;
+    }
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary);
+    out.write((const char*) &header, sizeof(header));
+    out.write((const char*) infos.data(), infos.size()*sizeof(ColumnInfo));
+    const char zeros[columnAlignment] = {};
+    for (std::size_t i = 0; i < m_columns.size(); ++i)
+    {
+        out.write(zeros, infos[i].offset - out.tellp());
+        if (m_columns[i].type == ColumnInfo::UInt64)
+            out.write((const char*) m_columns[i].u.data(), m_columns[i].u.size()*sizeof(uint64_t));
+        else
+            out.write((const char*) m_columns[i].d.data(), m_columns[i].d.size()*sizeof(double));
+    }
+    out.close();
+    if (!out.good())
+    {
+        std::cerr << "ERROR: Could not write output file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
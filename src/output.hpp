@@ -0,0 +1,114 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iostream>
+#include "columns.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * Text being formatted for output. Numbers are written the way an std::ostream with the default flags
+ * writes them, so files are unchanged, but without the stream's locale and sentry overhead.
+ */
+class TextBlock
+{
+public:
+    TextBlock& operator<<(char c) { m_data.push_back(c); return *this; }
+    TextBlock& operator<<(const std::string& s) { m_data.append(s); return *this; }
+    TextBlock& operator<<(const char* s) { m_data.append(s); return *this; }
+    TextBlock& operator<<(unsigned long long v);
+    TextBlock& operator<<(unsigned long v) { return *this << (unsigned long long) v; }
+    TextBlock& operator<<(int v);
+    TextBlock& operator<<(double v);
+
+    const std::string& str() const { return m_data; }
+    std::size_t size() const { return m_data.size(); }
+    void clear() { m_data.clear(); }
+
+protected:
+    std::string m_data;
+};
+
+/**
+ * Write #header and then one row for every element of #rows, in order, to #filename. Rows are formatted
+ * into blocks by all threads with #format(TextBlock&, key, value), and the blocks are written in order.
+ */
+template<typename Key, typename Value, typename Format>
+bool writeRows(const std::string& filename, const std::string& header, const std::map<Key, Value>& rows, Format format)
+{
+    std::vector<typename std::map<Key, Value>::const_iterator> its;
+    its.reserve(rows.size());
+    for (auto it = rows.cbegin(); it != rows.cend(); ++it)
+        its.push_back(it);
+
+    const std::size_t blockRows = 4096;
+    std::size_t numBlocks = (its.size() + blockRows - 1)/blockRows;
+    std::vector<TextBlock> blocks(numBlocks);
+    #pragma omp parallel for schedule(dynamic,1)
+    for (std::size_t b = 0; b < numBlocks; ++b)
+    {
+        for (std::size_t i = b*blockRows; i < its.size() && i < (b+1)*blockRows; ++i)
+            format(blocks[b], its[i]->first, its[i]->second);
+    }
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary);
+    out.write(header.data(), header.size());
+    for (const TextBlock& b : blocks)
+        out.write(b.str().data(), b.size());
+    out.close();
+    if (!out.good())
+    {
+        std::cerr << "ERROR: Could not write output file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Columns being collected for a columnar output file (see columns.hpp). Every column must have as many
+ * values as the first one.
+ */
+class ColumnTable
+{
+public:
+    void add(const std::string& name, std::vector<uint64_t> values);
+    void add(const std::string& name, std::vector<double> values);
+    bool write(const std::string& filename) const;
+
+protected:
+    struct Column
+    {
+        std::string name;
+        uint32_t type;
+        std::vector<uint64_t> u;
+        std::vector<double> d;
+    };
+    std::vector<Column> m_columns;
+};
+
+#endif // OUTPUT_HPP
@@ -0,0 +1,111 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "progress.hpp"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+ProgressReporter::ProgressReporter(double interval, unsigned long long total, Sampler sampler, const std::string& metricsFile, const std::string& label)
+    : m_interval(interval)
+    , m_total(total)
+    , m_sampler(sampler)
+    , m_label(label)
+    , m_running(false)
+{
+    if (!metricsFile.empty())
+    {
+        m_metrics.open(metricsFile);
+        if (!m_metrics.good())
+            std::cerr << "WARNING: Cannot open metrics file: " << metricsFile << std::endl;
+        else
+            m_metrics << "Seconds\tCompleted\tTotal\tLociPerSec\tETA\tReachedEnd\tOutsideMaf\tNaN" << std::endl;
+    }
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    stop();
+}
+
+void ProgressReporter::start()
+{
+    if (m_interval <= 0.0 || m_running)
+        return;
+    m_start = std::chrono::steady_clock::now();
+    m_running = true;
+    m_thread = std::thread(&ProgressReporter::loop, this);
+}
+
+void ProgressReporter::stop()
+{
+    if (!m_running)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+    report(true);
+}
+
+void ProgressReporter::loop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto interval = std::chrono::duration<double>(m_interval);
+    while (m_running)
+    {
+        if (m_cond.wait_for(lock, interval, [this] { return !m_running; }))
+            break;
+        report(false);
+    }
+}
+
+void ProgressReporter::report(bool final)
+{
+    ProgressSample s = m_sampler();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    double rate = (elapsed > 0.0) ? s.completed/elapsed : 0.0;
+    double eta = (rate > 0.0 && m_total > s.completed) ? (m_total - s.completed)/rate : 0.0;
+
+    /*
+     * The whole line is built first and written with a single call so that lines from different ranks sharing
+     * a terminal do not interleave.
+     */
+    std::ostringstream line;
+    if (!m_label.empty())
+        line << m_label << ": ";
+    line << (final ? "Completed " : "Progress: ") << s.completed;
+    if (m_total > 0)
+        line << "/" << m_total << " (" << std::fixed << std::setprecision(1) << 100.0*s.completed/m_total << "%)";
+    line << std::fixed << std::setprecision(1) << " " << rate << " loci/s";
+    if (!final && m_total > 0)
+        line << " ETA " << (unsigned long long) eta << "s";
+    else
+        line << " in " << elapsed << "s";
+    line << " reached end: " << s.reachedEnd << " outside MAF: " << s.outsideMaf << '\n';
+    std::cout << line.str() << std::flush;
+
+    if (m_metrics.is_open())
+    {
+        m_metrics << elapsed << '\t' << s.completed << '\t' << m_total << '\t' << rate << '\t' << eta << '\t'
+                  << s.reachedEnd << '\t' << s.outsideMaf << '\t' << s.nanResults << std::endl;
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Hapbin: A fast binary implementation EHH, iHS, and XPEHH
+ * Copyright (C) 2014  Colin MacLean <s0838159@sms.ed.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PROGRESS_HPP
+#define PROGRESS_HPP
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#ifdef __MINGW32__
+//from https://github.com/meganz/mingw-std-threads
+#include <windows.h>
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#include "mingw.thread.h"
+#endif
+#include <thread>
+
+struct ProgressSample
+{
+    ProgressSample() : completed{}, reachedEnd{}, outsideMaf{}, nanResults{} {}
+    unsigned long long completed;
+    unsigned long long reachedEnd;
+    unsigned long long outsideMaf;
+    unsigned long long nanResults;
+};
+
+/**
+ * Reports the progress of a run from a background thread.
+ *
+ * The worker threads only bump their own counters. Every interval the reporter calls the sampler, prints a
+ * single line with the throughput, ETA and skipped loci counts and, if a metrics file was given, appends the
+ * same figures to it as a tab separated row. A total of 0 means the total is not known, and only the count
+ * and rate are reported.
+ */
+class ProgressReporter
+{
+public:
+    using Sampler = std::function<ProgressSample()>;
+
+    ProgressReporter(double interval, unsigned long long total, Sampler sampler, const std::string& metricsFile = std::string(), const std::string& label = std::string());
+    ~ProgressReporter();
+
+    void start();
+    void stop();
+protected:
+    void loop();
+    void report(bool final);
+
+    double m_interval;
+    unsigned long long m_total;
+    Sampler m_sampler;
+    std::string m_label;
+    std::ofstream m_metrics;
+    std::chrono::steady_clock::time_point m_start;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_thread;
+    bool m_running;
+};
+
+#endif // PROGRESS_HPP
@@ -20,11 +20,91 @@
 #include "hapmap.hpp"
 #include "ihsfinder.hpp"
 #include "hapbin.hpp"
+#include "calcselect.hpp"
+#include "output.hpp"
+#include <fstream>
+#include <sstream>
+#include <memory>
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+bool writeXpehhResults(
+    const std::string& outfile,
+    const HapMap& hA,
+    std::size_t numChromosomes,
+    const IHSFinder::XpehhInfoMap& unStd,
+    const IHSFinder::LineMap& standardized,
+    bool binary,
+    bool pValues,
+    const IHSFinder::LineMap* stdRsb)
+{
+    auto rsbOf = [&](std::size_t line) {
+        auto it = stdRsb->find(line);
+        return (it == stdRsb->end()) ? NAN : it->second;
+    };
+    if (!binary)
+    {
+        std::string header = "Index\tID\tFreq\tiHH_A1\tiHH_B1\tiHH_P1\tXPEHH\tstd XPEHH";
+        if (pValues)
+            header += "\tp";
+        if (stdRsb)
+            header += "\tiES_A\tiES_B\tRsb\tstd Rsb";
+        header += "\n";
+        return writeRows(outfile, header, unStd, [&](TextBlock& out, std::size_t line, const XPEHH& e) {
+            double freq = (double)(e.numA + e.numB)/((double) numChromosomes);
+            out << line << '\t' << hA.lineToId(line) << '\t' << freq << '\t' << e.iHH_A1 << '\t' << e.iHH_B1 << '\t' << e.iHH_P1 << '\t' << e.xpehh << '\t' << standardized.at(line);
+            if (pValues)
+                out << '\t' << e.pValue;
+            if (stdRsb)
+                out << '\t' << e.iES_A << '\t' << e.iES_B << '\t' << e.rsb << '\t' << rsbOf(line);
+            out << '\n';
+        });
+    }
+    std::vector<uint64_t> index, position;
+    std::vector<double> freq, iHH_A1, iHH_B1, iHH_P1, xpehh, stdXPEHH, p, iES_A, iES_B, rsb, stdRSB;
+    for (const auto& it : unStd)
+    {
+        const XPEHH& e = it.second;
+        index.push_back(it.first);
+        position.push_back(hA.physicalPosition(it.first));
+        freq.push_back((double)(e.numA + e.numB)/((double) numChromosomes));
+        iHH_A1.push_back(e.iHH_A1);
+        iHH_B1.push_back(e.iHH_B1);
+        iHH_P1.push_back(e.iHH_P1);
+        xpehh.push_back(e.xpehh);
+        stdXPEHH.push_back(standardized.at(it.first));
+        p.push_back(e.pValue);
+        if (stdRsb)
+        {
+            iES_A.push_back(e.iES_A);
+            iES_B.push_back(e.iES_B);
+            rsb.push_back(e.rsb);
+            stdRSB.push_back(rsbOf(it.first));
+        }
+    }
+    ColumnTable table;
+    table.add("Index", std::move(index));
+    table.add("Position", std::move(position));
+    table.add("Freq", std::move(freq));
+    table.add("iHH_A1", std::move(iHH_A1));
+    table.add("iHH_B1", std::move(iHH_B1));
+    table.add("iHH_P1", std::move(iHH_P1));
+    table.add("XPEHH", std::move(xpehh));
+    table.add("std XPEHH", std::move(stdXPEHH));
+    if (pValues)
+        table.add("p", std::move(p));
+    if (stdRsb)
+    {
+        table.add("iES_A", std::move(iES_A));
+        table.add("iES_B", std::move(iES_B));
+        table.add("Rsb", std::move(rsb));
+        table.add("std Rsb", std::move(stdRSB));
+    }
+    return table.write(outfile);
+}
+
 void calcXpehhNoMpi(
     const std::string& hapA,
     const std::string& hapB,
@@ -35,7 +115,8 @@ void calcXpehhNoMpi(
     double scale,
     unsigned long long maxExtend,
     int bins,
-    bool binom)
+    bool binom,
+    const RunOptions& options)
 {
     HapMap hA, hB;
     if (!hA.loadHap(hapA.c_str()))
@@ -54,26 +135,225 @@ void calcXpehhNoMpi(
     hA.loadMap(map.c_str());
     auto start = std::chrono::high_resolution_clock::now();
     IHSFinder *ihsfinder = new IHSFinder(hA.snpLength() + hB.snpLength(), cutoff, minMAF, scale, maxExtend, bins);
-    if (binom)
-        ihsfinder->runXpehh<true>(&hA, &hB, 0ULL, hA.numSnps());
+    ihsfinder->setProgress(options.progressInterval, options.metricsFile);
+    ihsfinder->setTracing(!options.traceFile.empty());
+    ihsfinder->setPermutations(options.permutations, options.seed);
+    ihsfinder->setRsb(options.rsb);
+    if (!options.checkpointFile.empty())
+    {
+        if (options.resume && std::ifstream(options.checkpointFile).good())
+        {
+            if (!ihsfinder->loadCheckpoint(options.checkpointFile, true, binom))
+            {
+                delete ihsfinder;
+                return;
+            }
+            std::cout << "Resuming with " << ihsfinder->numDone() << " loci completed." << std::endl;
+        }
+        ihsfinder->setCheckpoint(options.checkpointFile, options.checkpointInterval);
+    }
+    if (!options.mergeFiles.empty())
+    {
+        for (const auto& file : options.mergeFiles)
+        {
+            if (!ihsfinder->loadCheckpoint(file, true, binom))
+            {
+                delete ihsfinder;
+                return;
+            }
+        }
+        if (ihsfinder->numDone() < hA.numSnps())
+            std::cerr << "WARNING: The merged files only cover " << ihsfinder->numDone() << " of " << hA.numSnps() << " loci." << std::endl;
+    }
     else
-        ihsfinder->runXpehh<false>(&hA, &hB, 0ULL, hA.numSnps());
+    {
+        std::size_t first, last;
+        options.range(hA.numSnps(), first, last);
+        if (binom)
+            ihsfinder->runXpehh<true>(&hA, &hB, first, last);
+        else
+            ihsfinder->runXpehh<false>(&hA, &hB, first, last);
+    }
+
+    if (options.partial)
+    {
+        if (!options.traceFile.empty())
+            ihsfinder->writeTraces(options.traceFile);
+        if (ihsfinder->saveCheckpoint(outfile, true, binom))
+            std::cout << "Wrote partial results for " << ihsfinder->numDone() << " loci to " << outfile << std::endl;
+        delete ihsfinder;
+        return;
+    }
 
     IHSFinder::LineMap standardized = ihsfinder->normalizeXPEHH();
+    IHSFinder::LineMap rsb;
+    if (options.rsb)
+        rsb = ihsfinder->normalizeRsb();
+
+    if (!options.traceFile.empty())
+        ihsfinder->writeTraces(options.traceFile);
 
     auto tend = std::chrono::high_resolution_clock::now();
     auto diff = tend - start;
     std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(diff).count() << "ms" << std::endl;
 
-    std::ofstream out(outfile);
-    out << "Index\tID\tFreq\tiHH_A1\tiHH_B1\tiHH_P1\tXPEHH\tstd XPEHH" << std::endl;
-    for (const auto& it : ihsfinder->unStdXPEHHByLine())
-    {
-        double freq = (double)(it.second.numA + it.second.numB)/((double) hA.snpLength() + hB.snpLength());
-        out << it.first << '\t' << hA.lineToId(it.first) << '\t' << freq << '\t' << it.second.iHH_A1 << '\t' << it.second.iHH_B1 << '\t' << it.second.iHH_P1 << '\t' << it.second.xpehh << '\t' << standardized[it.first] << std::endl;
-    }
+    writeXpehhResults(outfile, hA, hA.snpLength() + hB.snpLength(), ihsfinder->unStdXPEHHByLine(), standardized, options.binaryOutput, options.permutations > 0, options.rsb ? &rsb : nullptr);
 
     std::cout << "# valid loci: " << minMAF << ": " << ihsfinder->unStdXPEHHByLine().size() << std::endl;
 
     delete ihsfinder;
 }
+
+/*
+ * The walk of every pair of #maps, named #names, shared by --populations and --with-ihs. Pair (A, B) is
+ * written to #outfile.A-B or, if #pairFiles is not set, to #outfile, and population A's iHS to
+ * #outfile.iHS-A when options.withIhs is set.
+ */
+static void calcPopulations(
+    const std::vector<std::string>& names,
+    std::vector<std::unique_ptr<HapMap>>& maps,
+    const std::string& map,
+    const std::string& outfile,
+    bool pairFiles,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    int bins,
+    bool binom,
+    const RunOptions& options)
+{
+#ifdef _OPENMP
+    std::cout << "Threads: " << omp_get_max_threads() << std::endl;
+#endif
+    maps[0]->loadMap(map.c_str());
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<HapMap*> pops;
+    std::vector<std::unique_ptr<IHSFinder>> pairs, ihs;
+    std::vector<IHSFinder*> pairPtrs, ihsPtrs;
+    for (std::size_t a = 0; a < maps.size(); ++a)
+    {
+        pops.push_back(maps[a].get());
+        for (std::size_t b = a + 1; b < maps.size(); ++b)
+        {
+            pairs.emplace_back(new IHSFinder(maps[a]->snpLength() + maps[b]->snpLength(), cutoff, minMAF, scale, maxExtend, bins));
+            pairPtrs.push_back(pairs.back().get());
+        }
+        if (options.withIhs)
+        {
+            ihs.emplace_back(new IHSFinder(maps[a]->snpLength(), cutoff, minMAF, scale, maxExtend, bins));
+            ihsPtrs.push_back(ihs.back().get());
+        }
+    }
+    IHSFinder walker(maps[0]->snpLength(), cutoff, minMAF, scale, maxExtend, bins);
+    walker.setProgress(options.progressInterval, options.metricsFile);
+    walker.setTracing(!options.traceFile.empty());
+    if (binom)
+        walker.runXpehhPairs<true>(pops, pairPtrs, ihsPtrs);
+    else
+        walker.runXpehhPairs<false>(pops, pairPtrs, ihsPtrs);
+    if (!options.traceFile.empty())
+        walker.writeTraces(options.traceFile);
+
+    auto tend = std::chrono::high_resolution_clock::now();
+    std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(tend - start).count() << "ms" << std::endl;
+
+    std::size_t p = 0;
+    for (std::size_t a = 0; a < maps.size(); ++a)
+    {
+        for (std::size_t b = a + 1; b < maps.size(); ++b, ++p)
+        {
+            IHSFinder::LineMap standardized = pairs[p]->normalizeXPEHH();
+            std::string pairFile = pairFiles ? outfile + "." + names[a] + "-" + names[b] : outfile;
+            writeXpehhResults(pairFile, *maps[0], maps[a]->snpLength() + maps[b]->snpLength(), pairs[p]->unStdXPEHHByLine(), standardized, options.binaryOutput);
+            std::cout << pairFile << ": " << standardized.size() << " valid loci" << std::endl;
+        }
+    }
+    for (std::size_t a = 0; a < ihs.size(); ++a)
+    {
+        IHSFinder::LineMap res = ihs[a]->normalize();
+        std::string ihsFile = outfile + ".iHS-" + names[a];
+        writeIhsResults(ihsFile, *maps[0], res, ihs[a]->unStdIHSByLine(), options.binaryOutput);
+        std::cout << ihsFile << ": " << res.size() << " valid loci, " << ihs[a]->numOutsideMaf() << " with MAF <= " << minMAF
+                  << ", " << ihs[a]->numNanResults() << " NaN, " << ihs[a]->numReachedEnd() << " reached the end of the chromosome" << std::endl;
+    }
+}
+
+void calcXpehhPairs(
+    const std::string& populations,
+    const std::string& map,
+    const std::string& outfile,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    int bins,
+    bool binom,
+    const RunOptions& options)
+{
+    std::vector<std::string> names;
+    std::vector<std::unique_ptr<HapMap>> maps;
+    std::ifstream f(populations);
+    if (!f.good())
+    {
+        std::cerr << "ERROR: Cannot open file or file not found: " << populations << std::endl;
+        return;
+    }
+    std::string line;
+    while (std::getline(f, line))
+    {
+        std::istringstream fields(line);
+        std::string name, hap;
+        if (!(fields >> name) || name[0] == '#')
+            continue;
+        if (!(fields >> hap))
+        {
+            std::cerr << "ERROR: Population " << name << " in " << populations << " has no hap file." << std::endl;
+            return;
+        }
+        maps.emplace_back(new HapMap());
+        if (!maps.back()->loadHap(hap.c_str()))
+            return;
+        if (maps.back()->numSnps() != maps[0]->numSnps())
+        {
+            std::cerr << "ERROR: " << hap << " has " << maps.back()->numSnps() << " loci but " << maps[0]->numSnps() << " were expected." << std::endl;
+            return;
+        }
+        names.push_back(name);
+    }
+    if (maps.size() < 2)
+    {
+        std::cerr << "ERROR: " << populations << " must list at least two populations." << std::endl;
+        return;
+    }
+    calcPopulations(names, maps, map, outfile, true, cutoff, minMAF, scale, maxExtend, bins, binom, options);
+}
+
+void calcXpehhWithIhs(
+    const std::string& hapA,
+    const std::string& hapB,
+    const std::string& map,
+    const std::string& outfile,
+    double cutoff,
+    double minMAF,
+    double scale,
+    unsigned long long maxExtend,
+    int bins,
+    bool binom,
+    const RunOptions& options)
+{
+    std::vector<std::unique_ptr<HapMap>> maps;
+    maps.emplace_back(new HapMap());
+    maps.emplace_back(new HapMap());
+    if (!maps[0]->loadHap(hapA.c_str()) || !maps[1]->loadHap(hapB.c_str()))
+        return;
+    if (maps[1]->numSnps() != maps[0]->numSnps())
+    {
+        std::cerr << "ERROR: " << hapB << " has " << maps[1]->numSnps() << " loci but " << maps[0]->numSnps() << " were expected." << std::endl;
+        return;
+    }
+    RunOptions withIhs = options;
+    withIhs.withIhs = true;
+    calcPopulations({"A", "B"}, maps, map, outfile, false, cutoff, minMAF, scale, maxExtend, bins, binom, withIhs);
+}
@@ -20,11 +20,15 @@
 #include "hapmap.hpp"
 #include "ihsfinder.hpp"
 #include "hapbin.hpp"
+#include "calcselect.hpp"
+#include "output.hpp"
 #include "ehh.hpp"
 
 #if MPI_FOUND
 #include "mpirpc/manager.hpp"
+#include "mpirpc/counter.hpp"
 #include "mpirpc/parameterstream.hpp"
+#include "mpirpc/reduce.hpp"
 
 ParameterStream& operator<<(ParameterStream& out, const XPEHH& info)
 {
@@ -37,9 +41,25 @@ ParameterStream& operator>>(ParameterStream& in, XPEHH& info)
     in >> info.index >> info.xpehh >> info.numA >> info.numB >> info.numNotA >> info.numNotB >>  info.iHH_A1 >> info.iHH_B1 >> info.iHH_P1;
     return in;
 }
+
+ParameterStream& operator<<(ParameterStream& out, const XpehhBlock& block)
+{
+    out << block.start << block.end << block.reachedEnd << block.outsideMaf << block.nanResults;
+    out << block.lines << block.binFreq << block.xpehh << block.numA << block.numB << block.numNotA << block.numNotB << block.iHH_A1 << block.iHH_B1 << block.iHH_P1;
+    return out;
+}
+
+ParameterStream& operator>>(ParameterStream& in, XpehhBlock& block)
+{
+    in >> block.start >> block.end >> block.reachedEnd >> block.outsideMaf >> block.nanResults;
+    in >> block.lines >> block.binFreq >> block.xpehh >> block.numA >> block.numB >> block.numNotA >> block.numNotB >> block.iHH_A1 >> block.iHH_B1 >> block.iHH_P1;
+    return in;
+}
 #endif
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -55,28 +75,99 @@ void calcXpehhMpi(
     double scale,
     unsigned long long maxExtend,
     int binFactor,
-    bool binom)
+    bool binom,
+    const RunOptions& options)
 {
 #if MPI_FOUND
     std::cout << "Calculating XPEHH using MPI." << std::endl;
+    mpirpc::Manager *manager = new mpirpc::Manager();
     HapMap mA, mB;
-    if (!mA.loadHap(hapA.c_str()))
+    /*
+     * With --partition-load, each rank calculates a fixed slice of the loci and only reads the rows of the
+     * slice plus a halo the walks can reach, see calcIhsMpi().
+     */
+    std::size_t sliceStart = 0, sliceEnd = 0;
+    unsigned long long haloDistance = maxExtend;
+    std::size_t haloRows = options.halo;
+    auto loadWindow = [&](MPI_Comm comm) {
+        std::size_t first = sliceStart, end = sliceEnd;
+        mA.widenRange(first, end, haloDistance, haloRows);
+        if (!mA.loadHapBinaryRange(hapA.c_str(), first, end, comm) || !mB.loadHapBinaryRange(hapB.c_str(), first, end, comm))
+            return false;
+        std::cout << "Rank " << manager->rank() << " loaded rows " << first << " to " << end << " for loci " << sliceStart << " to " << sliceEnd << "." << std::endl;
+        return true;
+    };
+    if (options.partitionLoad)
+    {
+        if (!mA.loadHapBinaryRange(hapA.c_str(), 0, 0, manager->comm()) || !mB.loadHapBinaryRange(hapB.c_str(), 0, 0, manager->comm()))
+        {
+            delete manager;
+            return;
+        }
+        mA.loadMap(mapfile.c_str(), manager->rank() == 0 || options.distributed);
+        splitRange(mA.numSnps(), manager->rank(), manager->numProcs(), sliceStart, sliceEnd);
+        if (!loadWindow(manager->comm()))
+        {
+            delete manager;
+            return;
+        }
+    }
+    else if (options.sharedMemory)
     {
-        return;
+        if (!mA.loadShared(hapA.c_str(), mapfile.c_str(), manager->comm(), manager->rank() == 0 || options.distributed) || !mB.loadShared(hapB.c_str(), nullptr, manager->comm(), false))
+        {
+            mA.freeShared();
+            delete manager;
+            return;
+        }
     }
-    if (!mB.loadHap(hapB.c_str()))
+    else
     {
-        return;
+        if (!mA.loadHap(hapA.c_str()) || !mB.loadHap(hapB.c_str()))
+        {
+            delete manager;
+            return;
+        }
+        mA.loadMap(mapfile.c_str());
     }
     std::cout << "Loaded " << mA.numSnps() << " snps for population A." << std::endl;
     std::cout << "Loaded " << mB.numSnps() << " snps for population B." << std::endl;
     std::cout << "Population A haplotype count: " << mA.snpLength() << std::endl;
     std::cout << "Population B haplotype count: " << mB.snpLength() << std::endl;
-    mA.loadMap(mapfile.c_str());
     IHSFinder *ihsfinder = new IHSFinder(mA.snpLength() + mB.snpLength(), cutoff, minMAF, scale, maxExtend, binFactor);
-    mpirpc::Manager *manager = new mpirpc::Manager();
-    int procsToGo = manager->numProcs();
+    std::atomic<int> procsToGo(manager->numProcs());
     std::cout << "Processes: " << procsToGo << std::endl;
+    std::string metricsFile = options.metricsFile;
+    if (!metricsFile.empty() && manager->numProcs() > 1)
+        metricsFile += "." + std::to_string(manager->rank());
+    ihsfinder->setProgress(options.progressInterval, metricsFile, "Rank " + std::to_string(manager->rank()));
+    ihsfinder->setTracing(!options.traceFile.empty());
+    /*
+     * Loci are handed out in chunks from a counter shared by all ranks, so every rank, including rank 0,
+     * keeps taking work until none is left. The results of every chunk are sent to rank 0 as soon as it is
+     * done, so only rank 0 writes a checkpoint. On resume, every rank loads it to skip the loci already done.
+     */
+    ihsfinder->prepareDone(mA.numSnps());
+    if (!options.checkpointFile.empty())
+    {
+        if (options.resume && std::ifstream(options.checkpointFile).good())
+        {
+            if (!ihsfinder->loadCheckpoint(options.checkpointFile, true, binom))
+            {
+                mA.freeShared();
+                mB.freeShared();
+                delete ihsfinder;
+                delete manager;
+                return;
+            }
+            if (manager->rank() == 0)
+                std::cout << "Resuming with " << ihsfinder->numDone() << " loci completed." << std::endl;
+            else
+                ihsfinder->releaseResults();
+        }
+        if (manager->rank() == 0)
+            ihsfinder->setCheckpoint(options.checkpointFile, options.checkpointInterval);
+    }
 #ifdef _OPENMP
     std::cout << "Threads: " << omp_get_max_threads() << std::endl;
 #endif
@@ -99,57 +190,141 @@ void calcXpehhMpi(
     }
     manager->barrier();
     mpirpc::ObjectWrapperBase* mainihsfinder = *(manager->getObjectsOfType<IHSFinder>().cbegin());
-    mpirpc::FunctionHandle runXPEHH =  manager->registerLambda([&](std::size_t start, std::size_t end) {
-        std::cout << "Computing XPEHH for " << (end-start) << " lines on rank " << manager->rank() << std::endl;
-        if (binom)
-            ihsfinder->runXpehh<true>(&mA, &mB, start, end);
-        else
-            ihsfinder->runXpehh<false>(&mA, &mB, start, end);
-        IHSFinder::LineMap fbl = ihsfinder->freqsByLine();
-        manager->invokeFunction(mainihsfinder, &IHSFinder::addXData, false, fbl, ihsfinder->unStdXPEHHByLine(), ihsfinder->unStdIHSByFreq(), ihsfinder->numReachedEnd(), ihsfinder->numOutsideMaf(), ihsfinder->numNanResults());
-        manager->invokeFunction(0, done);
-    });
-    manager->barrier();
-
-    auto start = std::chrono::high_resolution_clock::now();
 
-    if (manager->rank() == 0)
-    {
-
-        std::size_t numSnps = mA.numSnps();
-        std::size_t snpsPerRank = numSnps/manager->numProcs();
-        std::size_t pos = 0ULL;
-        for (int i = 1; i < manager->numProcs(); ++i)
+    std::size_t numSnps = mA.numSnps();
+    std::size_t chunkSize = options.chunkSize;
+    if (chunkSize == 0)
+        chunkSize = std::max<std::size_t>(1, numSnps/(16*manager->numProcs()));
+    std::size_t batchSize = options.batchSize > 0 ? options.batchSize : chunkSize;
+    mpirpc::SharedCounter *counter = new mpirpc::SharedCounter(manager->comm());
+    std::size_t nextInSlice = sliceStart;
+    std::size_t limit = options.partitionLoad ? sliceEnd : numSnps;
+    std::size_t chunkStart = 0, chunkEnd = 0;
+    bool progressThread = false;
+    std::vector<std::size_t> chunkStarts;
+    unsigned long long sentReachedEnd = ihsfinder->numReachedEnd();
+    unsigned long long sentOutsideMaf = ihsfinder->numOutsideMaf();
+    unsigned long long sentNanResults = ihsfinder->numNanResults();
+    IHSFinder::ChunkSource nextChunk = [&](std::size_t& s, std::size_t& e) {
+        if (ihsfinder->numWindowEdge() > 0)
+        {
+            haloDistance *= 2;
+            haloRows *= 2;
+            ihsfinder->clearWindowEdge();
+            if (!loadWindow(MPI_COMM_SELF))
+                MPI_Abort(manager->comm(), 1);
+            s = chunkStart;
+            e = chunkEnd;
+            return true;
+        }
+        if (!options.distributed && manager->rank() != 0 && chunkEnd > chunkStart)
         {
-            std::size_t start = snpsPerRank*i;
-            std::size_t end = snpsPerRank*(i+1);
-            if (i == manager->numProcs()-1)
+            /*
+             * The results are sent in batches of at most batchSize loci and then dropped, so neither the
+             * messages nor the memory of this rank grow with the number of loci.
+             */
+            for (std::size_t batch = chunkStart; batch < chunkEnd; batch += batchSize)
             {
-                end = numSnps;
+                XpehhBlock block = ihsfinder->xpehhBlock(batch, std::min(batch + batchSize, chunkEnd));
+                block.reachedEnd = ihsfinder->numReachedEnd() - sentReachedEnd;
+                block.outsideMaf = ihsfinder->numOutsideMaf() - sentOutsideMaf;
+                block.nanResults = ihsfinder->numNanResults() - sentNanResults;
+                manager->invokeFunction(mainihsfinder, &IHSFinder::addXData, false, block);
+                sentReachedEnd = ihsfinder->numReachedEnd();
+                sentOutsideMaf = ihsfinder->numOutsideMaf();
+                sentNanResults = ihsfinder->numNanResults();
             }
-            manager->invokeFunction(i, runXPEHH, start, end);
-            manager->checkMessages();
+            ihsfinder->releaseResults();
         }
-        while (manager->queueSize() > 0) {
+        if (!progressThread)
             manager->checkMessages();
+        if (options.partitionLoad)
+        {
+            chunkStart = nextInSlice;
+            nextInSlice += chunkSize;
         }
-        std::size_t end = snpsPerRank;
-        if (manager->numProcs() == 1)
-            end = numSnps;
-        if (binom)
-            ihsfinder->runXpehh<true>(&mA, &mB, 0ULL, end);
         else
-            ihsfinder->runXpehh<false>(&mA, &mB, 0ULL, end);
+            chunkStart = counter->fetchAdd(chunkSize);
+        if (chunkStart >= limit)
+        {
+            chunkStart = chunkEnd = 0;
+            return false;
+        }
+        chunkEnd = std::min(chunkStart + chunkSize, limit);
+        chunkStarts.push_back(chunkStart);
+        s = chunkStart;
+        e = chunkEnd;
+        return true;
+    };
+    manager->barrier();
+    /*
+     * Rank 0 merges the results of other ranks on a progress thread, so its own OpenMP team does not wait
+     * for them between chunks.
+     */
+    progressThread = options.progressThread && manager->rank() == 0 && manager->numProcs() > 1 && manager->startProgressThread();
+    if (progressThread)
+        std::cout << "Handling results on a progress thread." << std::endl;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (binom)
+        ihsfinder->runXpehh<true>(&mA, &mB, nextChunk, 0);
+    else
+        ihsfinder->runXpehh<false>(&mA, &mB, nextChunk, 0);
+    if (progressThread)
+        manager->stopProgressThread();
+    if (manager->rank() == 0)
         --procsToGo;
-    }
+    else
+        manager->invokeFunction(0, done);
 
-    while(manager->checkMessages())
+    while(manager->waitMessages())
     {
         if (procsToGo == 0)
             manager->shutdown();
     }
+    delete counter;
 
-    if (manager->rank() == 0)
+    if (manager->rank() == 0 && !options.checkpointFile.empty())
+        ihsfinder->saveCheckpoint(options.checkpointFile, true, binom);
+
+    if (!options.traceFile.empty())
+        ihsfinder->writeTraces(manager->numProcs() > 1 ? options.traceFile + "." + std::to_string(manager->rank()) : options.traceFile);
+
+    if (options.distributed)
+    {
+        /*
+         * Every rank standardizes the loci it calculated and writes their rows. The rows are grouped by the
+         * chunk they were calculated in, which is where they go in the output.
+         */
+        IHSFinder::LineMap standardized = ihsfinder->normalizeXPEHH(allreduceMoments(ihsfinder->xpehhMoments(), manager->comm()));
+        std::map<std::size_t, std::string> pieces;
+        TextBlock piece;
+        std::size_t key = 0;
+        for (const auto& it : ihsfinder->unStdXPEHHByLine())
+        {
+            std::size_t chunk = *(std::upper_bound(chunkStarts.begin(), chunkStarts.end(), it.first) - 1);
+            if (chunk != key && piece.size() > 0)
+            {
+                pieces[key] = piece.str();
+                piece.clear();
+            }
+            key = chunk;
+            double freq = (double)(it.second.numA + it.second.numB)/((double) mA.snpLength() + mB.snpLength());
+            piece << it.first << '\t' << mA.lineToId(it.first) << '\t' << freq << '\t' << it.second.iHH_A1 << '\t' << it.second.iHH_B1 << '\t' << it.second.iHH_P1 << '\t' << it.second.xpehh << '\t' << standardized.at(it.first) << '\n';
+        }
+        if (piece.size() > 0)
+            pieces[key] = piece.str();
+        writeOrdered(outfile, "Index\tID\tFreq\tiHH_A1\tiHH_B1\tiHH_P1\tXPEHH\tstd XPEHH\n", pieces, manager->comm());
+        unsigned long valid = mpirpc::allreduce((unsigned long) standardized.size(), MPI_SUM, 1, manager->comm());
+        if (manager->rank() == 0)
+        {
+            auto tend = std::chrono::high_resolution_clock::now();
+            std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(tend - start).count() << "ms" << std::endl;
+            std::cout << "# valid loci: " << valid << std::endl;
+        }
+    }
+    else if (manager->rank() == 0)
     {
         IHSFinder::LineMap standardized = ihsfinder->normalizeXPEHH();
 
@@ -157,15 +332,11 @@ void calcXpehhMpi(
         auto diff = tend - start;
         std::cout << "Calculations took " << std::chrono::duration<double, std::milli>(diff).count() << "ms" << std::endl;
 
-        std::ofstream out(outfile);
-        out << "Index\tID\tFreq\tiHH_A1\tiHH_B1\tiHH_P1\tXPEHH\tstd XPEHH" << std::endl;
-        for (const auto& it : ihsfinder->unStdXPEHHByLine())
-        {
-            double freq = (double)(it.second.numA + it.second.numB)/((double) mA.snpLength() + mB.snpLength());
-            out << it.first << '\t' << mA.lineToId(it.first) << '\t' << freq << '\t' << it.second.iHH_A1 << '\t' << it.second.iHH_B1 << '\t' << it.second.iHH_P1 << '\t' << it.second.xpehh << '\t' << standardized[it.first] << std::endl;
-        }
+        writeXpehhResults(outfile, mA, mA.snpLength() + mB.snpLength(), ihsfinder->unStdXPEHHByLine(), standardized, options.binaryOutput);
         std::cout << "# valid loci: " << ihsfinder->unStdXPEHHByLine().size() << std::endl;
     }
+    mA.freeShared();
+    mB.freeShared();
     delete ihsfinder;
     delete manager;
 #else